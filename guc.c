@@ -27,6 +27,8 @@ int			pgsm_histogram_buckets;
 double		pgsm_histogram_min;
 double		pgsm_histogram_max;
 int			pgsm_query_shared_buffer;
+int			pgsm_flush_batch_size;
+int			pgsm_flush_interval;
 bool		pgsm_track_planning;
 bool		pgsm_extract_comments;
 bool		pgsm_enable_query_plan;
@@ -36,6 +38,10 @@ bool		pgsm_track_utility;
 bool		pgsm_track_application_names;
 bool		pgsm_enable_pgsm_query_id;
 int			pgsm_track;
+double		pgsm_sample_rate;
+int			pgsm_sample_mode;
+int			pgsm_topk;
+int			pgsm_cpu_time_source;
 static int	pgsm_overflow_target;	/* Not used since 2.0 */
 
 /* Check hooks to ensure histogram_min < histogram_max */
@@ -163,6 +169,34 @@ init_guc(void)
 							NULL	/* show_hook */
 		);
 
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_flush_batch_size",	/* name */
+							"Sets the number of statements a backend accumulates locally before flushing them to shared memory. Zero stores every statement immediately.",	/* short_desc */
+							NULL,	/* long_desc */
+							&pgsm_flush_batch_size, /* value address */
+							0,	/* boot value */
+							0,	/* min value */
+							100000, /* max value */
+							PGC_USERSET,	/* context */
+							0,	/* flags */
+							NULL,	/* check_hook */
+							NULL,	/* assign_hook */
+							NULL	/* show_hook */
+		);
+
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_flush_interval",	/* name */
+							"Sets the time after which locally accumulated statistics are flushed by the next statement.",	/* short_desc */
+							NULL,	/* long_desc */
+							&pgsm_flush_interval,	/* value address */
+							1000,	/* boot value */
+							0,	/* min value */
+							INT_MAX,	/* max value */
+							PGC_USERSET,	/* context */
+							GUC_UNIT_MS,	/* flags */
+							NULL,	/* check_hook */
+							NULL,	/* assign_hook */
+							NULL	/* show_hook */
+		);
+
 	/* deprecated in V 2.0 */
 	DefineCustomIntVariable("pg_stat_monitor.pgsm_overflow_target", /* name */
 							"Sets the overflow target for pg_stat_monitor. (Deprecated, use pgsm_enable_overflow)", /* short_desc */
@@ -275,6 +309,59 @@ init_guc(void)
 							 NULL,	/* assign_hook */
 							 NULL	/* show_hook */
 		);
+
+	DefineCustomRealVariable("pg_stat_monitor.pgsm_sample_rate",	/* name */
+							 "Sets the fraction of top level statements tracked by pg_stat_monitor.",	/* short_desc */
+							 "Errors and utility statements are always tracked.",	/* long_desc */
+							 &pgsm_sample_rate, /* value address */
+							 1.0,	/* boot value */
+							 0.0,	/* min value */
+							 1.0,	/* max value */
+							 PGC_USERSET,	/* context */
+							 0, /* flags */
+							 NULL,	/* check_hook */
+							 NULL,	/* assign_hook */
+							 NULL	/* show_hook */
+		);
+
+	DefineCustomEnumVariable("pg_stat_monitor.pgsm_sample_mode",	/* name */
+							 "Selects whether statements are sampled at random or by queryid.",	/* short_desc */
+							 NULL,	/* long_desc */
+							 &pgsm_sample_mode, /* value address */
+							 PGSM_SAMPLE_RANDOM,	/* boot value */
+							 sample_mode_options,	/* enum options */
+							 PGC_USERSET,	/* context */
+							 0, /* flags */
+							 NULL,	/* check_hook */
+							 NULL,	/* assign_hook */
+							 NULL	/* show_hook */
+		);
+
+	DefineCustomEnumVariable("pg_stat_monitor.pgsm_topk",	/* name */
+							 "Selects whether each bucket only keeps the statements with the most calls or time.",	/* short_desc */
+							 NULL,	/* long_desc */
+							 &pgsm_topk,	/* value address */
+							 PGSM_TOPK_OFF, /* boot value */
+							 topk_options,	/* enum options */
+							 PGC_POSTMASTER,	/* context */
+							 0, /* flags */
+							 NULL,	/* check_hook */
+							 NULL,	/* assign_hook */
+							 NULL	/* show_hook */
+		);
+
+	DefineCustomEnumVariable("pg_stat_monitor.pgsm_cpu_time_source",	/* name */
+							 "Selects how the CPU time of statements is measured.",	/* short_desc */
+							 NULL,	/* long_desc */
+							 &pgsm_cpu_time_source, /* value address */
+							 PGSM_CPU_TIME_RUSAGE,	/* boot value */
+							 cpu_time_source_options,	/* enum options */
+							 PGC_USERSET,	/* context */
+							 0, /* flags */
+							 NULL,	/* check_hook */
+							 NULL,	/* assign_hook */
+							 NULL	/* show_hook */
+		);
 #if PG_VERSION_NUM >= 130000
 	DefineCustomBoolVariable("pg_stat_monitor.pgsm_track_planning", /* name */
 							 "Selects whether planning statistics are tracked.",	/* short_desc */
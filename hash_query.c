@@ -25,6 +25,7 @@ static void InitializeSharedState(pgsmSharedState *pgsm);
 
 #define PGSM_BUCKET_INFO_SIZE	(sizeof(TimestampTz) * pgsm_max_buckets)
 #define PGSM_SHARED_STATE_SIZE	(sizeof(pgsmSharedState) + PGSM_BUCKET_INFO_SIZE)
+#define PGSM_BUCKETS_SIZE		(sizeof(pgsmBucket) * pgsm_max_buckets)
 
 #if USE_DYNAMIC_HASH
 /* parameter for the shared hash */
@@ -62,10 +63,12 @@ pgsm_ShmemSize(void)
 	Size		sz = MAXALIGN(PGSM_SHARED_STATE_SIZE);
 
 	sz = add_size(sz, MAX_QUERY_BUF);
+	sz = add_size(sz, MAXALIGN(PGSM_BUCKETS_SIZE));
+	sz = add_size(sz, hash_estimate_size(MAX_BUCKET_ENTRIES, sizeof(pgsmText)));
 #if USE_DYNAMIC_HASH
 	sz = add_size(sz, MAX_BUCKETS_MEM);
 #else
-	sz = add_size(sz, hash_estimate_size(MAX_BUCKET_ENTRIES, sizeof(pgsmEntry)));
+	sz = add_size(sz, hash_estimate_size(MAX_BUCKET_ENTRIES + PGSM_OVERFLOW_ENTRIES, sizeof(pgsmEntry)));
 #endif
 	return MAXALIGN(sz);
 }
@@ -111,9 +114,19 @@ pgsm_startup(void)
 		/* First time through ... */
 		dsa_area   *dsa;
 		char	   *p = (char *) pgsm;
+		LWLockPadded *locks = GetNamedLWLockTranche("pg_stat_monitor");
 
 		pgsm->pgsm_oom = false;
-		pgsm->lock = &(GetNamedLWLockTranche("pg_stat_monitor"))->lock;
+
+		/*
+		 * First lock is the main lock, the second one protects the query
+		 * texts, the third one serializes evictions, the rest protect the
+		 * hash partitions
+		 */
+		pgsm->lock = &locks[0].lock;
+		pgsm->text_lock = &locks[1].lock;
+		pgsm->evict_lock = &locks[2].lock;
+		pgsm->partition_locks = &locks[3];
 		SpinLockInit(&pgsm->mutex);
 		InitializeSharedState(pgsm);
 		/* the allocation of pgsmSharedState itself */
@@ -125,6 +138,9 @@ pgsm_startup(void)
 		dsa_pin(dsa);
 		dsa_set_size_limit(dsa, pgsm_query_area_size());
 
+		/* One slot per backend for the not yet flushed statistics */
+		pgsm->pending_stats = dsa_allocate0(dsa, sizeof(pgsmPendingStats) * MAX_BACKEND_PROCESES);
+
 		pgsm->hash_handle = pgsm_create_bucket_hash(pgsm, dsa);
 
 		/*
@@ -163,8 +179,30 @@ pgsm_startup(void)
 static void
 InitializeSharedState(pgsmSharedState *pgsm)
 {
+	bool		found;
+	int			i;
+	HASHCTL		info;
+
 	pg_atomic_init_u64(&pgsm->current_wbucket, 0);
 	pg_atomic_init_u64(&pgsm->prev_bucket_sec, 0);
+	pg_atomic_init_u64(&pgsm->plan_epoch, 0);
+	pg_atomic_init_u64(&pgsm->generation, 1);
+	pg_atomic_init_u64(&pgsm->entry_serial, 0);
+
+	pgsm->buckets = ShmemInitStruct("pg_stat_monitor buckets", PGSM_BUCKETS_SIZE, &found);
+	for (i = 0; i < pgsm_max_buckets; i++)
+	{
+		SpinLockInit(&pgsm->buckets[i].mutex);
+		dlist_init(&pgsm->buckets[i].entries);
+		pgsm->buckets[i].num_entries = 0;
+		pgsm->buckets[i].topk_threshold = 0;
+	}
+
+	/* There can't be more distinct query texts than entries */
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(pgsmTextKey);
+	info.entrysize = sizeof(pgsmText);
+	pgsm->text_hash = ShmemInitHash("pg_stat_monitor: query text hashtable", MAX_BUCKET_ENTRIES, MAX_BUCKET_ENTRIES, &info, HASH_ELEM | HASH_BLOBS);
 }
 
 
@@ -190,7 +228,8 @@ pgsm_create_bucket_hash(pgsmSharedState *pgsm, dsa_area *dsa)
 	memset(&info, 0, sizeof(info));
 	info.keysize = sizeof(pgsmHashKey);
 	info.entrysize = sizeof(pgsmEntry);
-	bucket_hash = ShmemInitHash("pg_stat_monitor: bucket hashtable", MAX_BUCKET_ENTRIES, MAX_BUCKET_ENTRIES, &info, HASH_ELEM | HASH_BLOBS);
+	info.num_partitions = PGSM_NUM_LOCK_PARTITIONS;
+	bucket_hash = ShmemInitHash("pg_stat_monitor: bucket hashtable", MAX_BUCKET_ENTRIES + PGSM_OVERFLOW_ENTRIES, MAX_BUCKET_ENTRIES + PGSM_OVERFLOW_ENTRIES, &info, HASH_ELEM | HASH_BLOBS | HASH_PARTITION);
 #endif
 	return bucket_hash;
 }
@@ -265,6 +304,116 @@ pgsm_get_ss(void)
 	return pgsmStateLocal.shared_pgsmState;
 }
 
+/*
+ * Returns the per-backend array of statistics not yet flushed to the shared
+ * hash, indexed by PGSM_MY_PROC_NUMBER.
+ */
+pgsmPendingStats *
+pgsm_get_pending_stats(void)
+{
+	pgsm_attach_shmem();
+	return (pgsmPendingStats *) dsa_get_address(pgsmStateLocal.dsa,
+												pgsmStateLocal.shared_pgsmState->pending_stats);
+}
+
+/* Build the key of the shared query text of an entry */
+static void
+pgsm_text_key(pgsmTextKey *tkey, pgsmHashKey *key, uint64 pgsm_query_id)
+{
+	memset(tkey, 0, sizeof(pgsmTextKey));
+	tkey->bucket_id = key->bucket_id;
+	tkey->queryid = key->queryid;
+	tkey->pgsm_query_id = pgsm_query_id;
+	tkey->userid = key->userid;
+	tkey->dbid = key->dbid;
+}
+
+/*
+ * Return the shared copy of a query text and take a reference to it. The
+ * text is only copied into the DSA area if no other entry uses it yet.
+ * Returns InvalidDsaPointer if it couldn't be stored.
+ */
+dsa_pointer
+pgsm_text_acquire(pgsmHashKey *entry_key, uint64 pgsm_query_id, const char *query, int query_len)
+{
+	pgsmSharedState *pgsm = pgsm_get_ss();
+	pgsmTextKey key;
+	pgsmText   *text;
+	dsa_pointer text_pos;
+	char	   *text_buff;
+	bool		found;
+
+	pgsm_text_key(&key, entry_key, pgsm_query_id);
+
+	LWLockAcquire(pgsm->text_lock, LW_EXCLUSIVE);
+	text = hash_search(pgsm->text_hash, &key, HASH_FIND, NULL);
+	if (text)
+	{
+		text->refcount++;
+		text_pos = text->text_pos;
+		LWLockRelease(pgsm->text_lock);
+		return text_pos;
+	}
+	LWLockRelease(pgsm->text_lock);
+
+	/* New text, copy it without holding the lock */
+	text_pos = dsa_allocate_extended(pgsmStateLocal.dsa, query_len + 1, DSA_ALLOC_NO_OOM);
+	if (!DsaPointerIsValid(text_pos))
+		return InvalidDsaPointer;
+
+	text_buff = dsa_get_address(pgsmStateLocal.dsa, text_pos);
+	memcpy(text_buff, query, query_len);
+	text_buff[query_len] = '\0';
+
+	LWLockAcquire(pgsm->text_lock, LW_EXCLUSIVE);
+	text = hash_search(pgsm->text_hash, &key, HASH_ENTER_NULL, &found);
+	if (text == NULL)
+	{
+		LWLockRelease(pgsm->text_lock);
+		dsa_free(pgsmStateLocal.dsa, text_pos);
+		return InvalidDsaPointer;
+	}
+
+	if (found)
+	{
+		/* Someone else stored it in the meantime */
+		dsa_free(pgsmStateLocal.dsa, text_pos);
+		text->refcount++;
+	}
+	else
+	{
+		text->text_pos = text_pos;
+		text->refcount = 1;
+	}
+	text_pos = text->text_pos;
+	LWLockRelease(pgsm->text_lock);
+
+	return text_pos;
+}
+
+/*
+ * Drop a reference to a shared query text, freeing it once it's no longer
+ * used by any entry.
+ */
+void
+pgsm_text_release(pgsmHashKey *entry_key, uint64 pgsm_query_id)
+{
+	pgsmSharedState *pgsm = pgsm_get_ss();
+	pgsmTextKey key;
+	pgsmText   *text;
+
+	pgsm_text_key(&key, entry_key, pgsm_query_id);
+
+	LWLockAcquire(pgsm->text_lock, LW_EXCLUSIVE);
+	text = hash_search(pgsm->text_hash, &key, HASH_FIND, NULL);
+	if (text && --text->refcount == 0)
+	{
+		dsa_free(pgsmStateLocal.dsa, text->text_pos);
+		hash_search(pgsm->text_hash, &key, HASH_REMOVE, NULL);
+	}
+	LWLockRelease(pgsm->text_lock);
+}
+
 
 /*
  * shmem_shutdown hook: Dump statistics into file.
@@ -287,14 +436,61 @@ pgsm_shmem_shutdown(int code, Datum arg)
 		return;
 }
 
+#if !USE_DYNAMIC_HASH
+/*
+ * Whether a new entry for the given bucket needs room to be made first: the
+ * hash is full, or in top-K mode the bucket holds its share of the entries.
+ */
+static bool
+hash_is_full(pgsmSharedState *pgsm, uint64 bucket_id)
+{
+	if (hash_get_num_entries(pgsmStateLocal.shared_hash) >= MAX_BUCKET_ENTRIES)
+		return true;
+
+	return (pgsm_topk != PGSM_TOPK_OFF &&
+			pgsm->buckets[bucket_id].num_entries >= PGSM_TOPK_ENTRIES);
+}
+
+/*
+ * The count an entry is ranked by in top-K mode. Like in the Space-Saving
+ * algorithm, it includes what the entry may have missed before it was
+ * created, so it never underestimates the statement.
+ */
+static double
+hash_entry_topk_count(pgsmEntry *entry)
+{
+	if (pgsm_topk == PGSM_TOPK_CALLS)
+		return entry->topk_error + entry->counters.calls.calls;
+
+	return entry->topk_error + entry->counters.time.total_time;
+}
+#endif
+
+/*
+ * Find or create the entry for the given key.
+ *
+ * Caller must hold an exclusive lock on the partition lock of hashcode.
+ */
 pgsmEntry *
-hash_entry_alloc(pgsmSharedState *pgsm, pgsmHashKey *key, int encoding)
+hash_entry_alloc(pgsmSharedState *pgsm, pgsmHashKey *key, uint32 hashcode, int encoding)
 {
 	pgsmEntry  *entry = NULL;
 	bool		found = false;
+#if !USE_DYNAMIC_HASH
+	pgsmBucket *bucket;
+#endif
+
+#if !USE_DYNAMIC_HASH
+	/*
+	 * The caller has to make room with hash_entry_evict() once it is full.
+	 * Overflow entries use the room kept for them on top of that.
+	 */
+	if (!key->overflow && hash_is_full(pgsm, key->bucket_id))
+		return (pgsmEntry *) pgsm_hash_find(pgsmStateLocal.shared_hash, key, hashcode, &found);
+#endif
 
 	/* Find or create an entry with desired hash code */
-	entry = (pgsmEntry *) pgsm_hash_find_or_insert(pgsmStateLocal.shared_hash, key, &found);
+	entry = (pgsmEntry *) pgsm_hash_find_or_insert(pgsmStateLocal.shared_hash, key, hashcode, &found);
 	if (entry == NULL)
 		elog(DEBUG1, "[pg_stat_monitor] hash_entry_alloc: OUT OF MEMORY.");
 	else if (!found)
@@ -303,15 +499,30 @@ hash_entry_alloc(pgsmSharedState *pgsm, pgsmHashKey *key, int encoding)
 		/* reset the statistics */
 		memset(&entry->counters, 0, sizeof(Counters));
 		entry->query_text.query_pos = InvalidDsaPointer;
+		entry->meta.meta_pos = InvalidDsaPointer;
 		entry->counters.info.parent_query = InvalidDsaPointer;
 		entry->stats_since = GetCurrentTimestamp();
 		entry->minmax_stats_since = entry->stats_since;
+		entry->topk_error = 0;
+		entry->generation = pg_atomic_read_u64(&pgsm->generation);
+		entry->serial = pg_atomic_fetch_add_u64(&pgsm->entry_serial, 1);
 
 		/* set the appropriate initial usage count */
 		/* re-initialize the mutex each time ... we assume no one using it */
 		SpinLockInit(&entry->mutex);
 		/* ... and don't forget the query text metadata */
 		entry->encoding = encoding;
+
+#if !USE_DYNAMIC_HASH
+		/* Other partitions may be adding entries to the same bucket */
+		bucket = &pgsm->buckets[key->bucket_id];
+		SpinLockAcquire(&bucket->mutex);
+		dlist_push_tail(&bucket->entries, &entry->bucket_node);
+		bucket->num_entries++;
+		if (pgsm_topk != PGSM_TOPK_OFF && !key->overflow)
+			entry->topk_error = bucket->topk_threshold;
+		SpinLockRelease(&bucket->mutex);
+#endif
 	}
 #if USE_DYNAMIC_HASH
 	if (entry)
@@ -321,6 +532,88 @@ hash_entry_alloc(pgsmSharedState *pgsm, pgsmHashKey *key, int encoding)
 	return entry;
 }
 
+#if !USE_DYNAMIC_HASH
+/*
+ * Hash table entry selected for deallocation by hash_entry_dealloc().
+ */
+typedef struct pgsmDeallocItem
+{
+	pgsmHashKey key;
+	uint32		hashcode;
+	uint64		serial;			/* serial of the entry when it was picked */
+	double		usage;			/* usage, or count in top-K mode */
+} pgsmDeallocItem;
+
+static int
+dealloc_item_cmp(const void *a, const void *b)
+{
+	uint32		pa = PGSM_LOCK_PARTITION(((const pgsmDeallocItem *) a)->hashcode);
+	uint32		pb = PGSM_LOCK_PARTITION(((const pgsmDeallocItem *) b)->hashcode);
+
+	if (pa < pb)
+		return -1;
+	else if (pa > pb)
+		return 1;
+	return 0;
+}
+
+static int
+evict_item_cmp(const void *a, const void *b)
+{
+	const pgsmDeallocItem *ia = (const pgsmDeallocItem *) a;
+	const pgsmDeallocItem *ib = (const pgsmDeallocItem *) b;
+
+	if (ia->usage < ib->usage)
+		return -1;
+	else if (ia->usage > ib->usage)
+		return 1;
+	return 0;
+}
+
+/*
+ * Remove the entry with the given key and free its query texts.
+ *
+ * Caller must hold an exclusive lock on the partition lock of hashcode.
+ */
+static void
+hash_entry_remove(pgsmHashKey *key, uint32 hashcode)
+{
+	pgsmEntry  *entry;
+	bool		found;
+	dsa_pointer pdsa;
+	uint64		pgsm_query_id;
+	dsa_pointer parent_qdsa;
+	dsa_pointer meta_dsa;
+	pgsmBucket *bucket;
+
+	entry = pgsm_hash_find(pgsmStateLocal.shared_hash, key, hashcode, &found);
+	if (entry == NULL)
+		return;
+
+	pdsa = entry->query_text.query_pos;
+	pgsm_query_id = entry->pgsm_query_id;
+	parent_qdsa = entry->counters.info.parent_query;
+	meta_dsa = entry->meta.meta_pos;
+
+	bucket = &pgsmStateLocal.shared_pgsmState->buckets[entry->key.bucket_id];
+	SpinLockAcquire(&bucket->mutex);
+	dlist_delete(&entry->bucket_node);
+	bucket->num_entries--;
+	SpinLockRelease(&bucket->mutex);
+
+	pgsm_hash_delete(pgsmStateLocal.shared_hash, key, hashcode);
+
+	if (DsaPointerIsValid(pdsa))
+		pgsm_text_release(key, pgsm_query_id);
+
+	if (DsaPointerIsValid(parent_qdsa))
+		dsa_free(pgsmStateLocal.dsa, parent_qdsa);
+
+	if (DsaPointerIsValid(meta_dsa))
+		dsa_free(pgsmStateLocal.dsa, meta_dsa);
+}
+#endif
+
 /*
  * Prepare resources for using the new bucket:
  *    - Deallocate finished hash table entries in new_bucket_id (entries whose
@@ -331,19 +624,44 @@ hash_entry_alloc(pgsmSharedState *pgsm, pgsmHashKey *key, int encoding)
  *      previous query buffer (query_buffer[old_bucket_id]) to the new one
  *      (query_buffer[new_bucket_id]).
  *
- * Caller must hold an exclusive lock on pgsm->lock.
+ * The entries to remove are collected from the entry lists of the evicted
+ * buckets, so the cost doesn't depend on the number of entries in the other
+ * buckets. This happens while holding all the partition locks in shared
+ * mode, so that backends updating existing entries are not blocked.
+ * They are then removed one partition at a time, holding only the exclusive
+ * lock of the partition being processed.
+ *
+ * Caller must hold an exclusive lock on pgsm->lock, which keeps error capture
+ * disabled while the partition locks are held.
  */
 void
 hash_entry_dealloc(int new_bucket_id, int old_bucket_id, unsigned char *query_buffer)
 {
-	PGSM_HASH_SEQ_STATUS hstat;
 	pgsmEntry  *entry = NULL;
+#if USE_DYNAMIC_HASH
+	PGSM_HASH_SEQ_STATUS hstat;
+#else
+	pgsmSharedState *pgsm = pgsmStateLocal.shared_pgsmState;
+	pgsmDeallocItem *items;
+	int64		max_items;
+	long		num_items = 0;
+	long		i;
+	int			first_bucket;
+	int			last_bucket;
+	int			b;
+#endif
 
 	/* Store pending query ids from the previous bucket. */
 
 	if (!pgsmStateLocal.shared_hash)
 		return;
 
+	/* Plans stored by the backends may be about to go away */
+	pg_atomic_fetch_add_u64(&pgsmStateLocal.shared_pgsmState->plan_epoch, 1);
+
+#if USE_DYNAMIC_HASH
+	/* dshash takes care of the partition locking by itself */
+
 	/* Iterate over the hash table. */
 	pgsm_hash_seq_init(&hstat, pgsmStateLocal.shared_hash, true);
 
@@ -359,21 +677,307 @@ hash_entry_dealloc(int new_bucket_id, int old_bucket_id, unsigned char *query_bu
 			(entry->key.bucket_id == new_bucket_id))
 		{
 			dsa_pointer parent_qdsa = entry->counters.info.parent_query;
+			dsa_pointer meta_dsa = entry->meta.meta_pos;
+			pgsmHashKey key = entry->key;
+			uint64		pgsm_query_id = entry->pgsm_query_id;
 
 			pdsa = entry->query_text.query_pos;
 
 			pgsm_hash_delete_current(&hstat, pgsmStateLocal.shared_hash, &entry->key);
 
 			if (DsaPointerIsValid(pdsa))
-				dsa_free(pgsmStateLocal.dsa, pdsa);
+				pgsm_text_release(&key, pgsm_query_id);
 
 			if (DsaPointerIsValid(parent_qdsa))
 				dsa_free(pgsmStateLocal.dsa, parent_qdsa);
 
+			if (DsaPointerIsValid(meta_dsa))
+				dsa_free(pgsmStateLocal.dsa, meta_dsa);
+
 			pgsmStateLocal.shared_pgsmState->pgsm_oom = false;
 		}
 	}
 	pgsm_hash_seq_term(&hstat);
+#else
+	if (new_bucket_id < 0)
+	{
+		first_bucket = 0;
+		last_bucket = pgsm_max_buckets - 1;
+	}
+	else
+		first_bucket = last_bucket = new_bucket_id;
+
+	/*
+	 * No entry can be added to or removed from the bucket lists while all the
+	 * partitions are locked, so the lists can be walked without taking the
+	 * bucket spinlocks.
+	 */
+	pgsm_partitions_lock(pgsm, LW_SHARED);
+
+	/* Nothing evicted from the buckets can be missed by new entries anymore */
+	for (b = first_bucket; b <= last_bucket; b++)
+	{
+		SpinLockAcquire(&pgsm->buckets[b].mutex);
+		pgsm->buckets[b].topk_threshold = 0;
+		SpinLockRelease(&pgsm->buckets[b].mutex);
+	}
+
+	max_items = 0;
+	for (b = first_bucket; b <= last_bucket; b++)
+		max_items += pgsm->buckets[b].num_entries;
+
+	if (max_items == 0)
+	{
+		pgsm_partitions_unlock(pgsm);
+		return;
+	}
+
+	items = palloc_extended(sizeof(pgsmDeallocItem) * max_items,
+							MCXT_ALLOC_HUGE | MCXT_ALLOC_NO_OOM);
+	if (items == NULL)
+	{
+		/*
+		 * Not enough local memory to remember the entries, so fall back to
+		 * removing them in place with all the partitions locked.
+		 */
+		pgsm_partitions_unlock(pgsm);
+		pgsm_partitions_lock(pgsm, LW_EXCLUSIVE);
+
+		for (b = first_bucket; b <= last_bucket; b++)
+		{
+			dlist_mutable_iter iter;
+
+			dlist_foreach_modify(iter, &pgsm->buckets[b].entries)
+			{
+				pgsmHashKey key;
+
+				entry = dlist_container(pgsmEntry, bucket_node, iter.cur);
+				key = entry->key;
+				hash_entry_remove(&key, pgsm_hash_value(pgsmStateLocal.shared_hash, &key));
+			}
+		}
+
+		pgsm->pgsm_oom = false;
+		pgsm_partitions_unlock(pgsm);
+		return;
+	}
+
+	/* Only the entries of the buckets being evicted are visited */
+	for (b = first_bucket; b <= last_bucket; b++)
+	{
+		dlist_iter	iter;
+
+		dlist_foreach(iter, &pgsm->buckets[b].entries)
+		{
+			entry = dlist_container(pgsmEntry, bucket_node, iter.cur);
+
+			if (num_items < max_items)
+			{
+				items[num_items].key = entry->key;
+				items[num_items].hashcode = pgsm_hash_value(pgsmStateLocal.shared_hash, &entry->key);
+				num_items++;
+			}
+		}
+	}
+	pgsm_partitions_unlock(pgsm);
+
+	/* Group the entries per partition, and remove them */
+	qsort(items, num_items, sizeof(pgsmDeallocItem), dealloc_item_cmp);
+
+	for (i = 0; i < num_items;)
+	{
+		uint32		partition = PGSM_LOCK_PARTITION(items[i].hashcode);
+		LWLock	   *partition_lock = PGSM_PARTITION_LOCK(pgsm, items[i].hashcode);
+
+		LWLockAcquire(partition_lock, LW_EXCLUSIVE);
+		for (; i < num_items && PGSM_LOCK_PARTITION(items[i].hashcode) == partition; i++)
+			hash_entry_remove(&items[i].key, items[i].hashcode);
+		LWLockRelease(partition_lock);
+	}
+
+	if (num_items > 0)
+		pgsm->pgsm_oom = false;
+
+	pfree(items);
+#endif
+}
+
+/*
+ * Make room in a full hash table by evicting the least used entries of the
+ * bucket being written, the same way pg_stat_statements does: the usage of
+ * the bucket's entries is decayed, then USAGE_DEALLOC_PERCENT of them are
+ * removed, least used first. Entries that were never executed decay faster.
+ * The entries of older buckets are left alone, so that the history being
+ * read stays intact. If the bucket has no entry to give up, the statements
+ * go to the overflow entry until the next rotation frees older buckets.
+ * Returns whether any entry was removed.
+ *
+ * In top-K mode the bucket is limited to its share of the entries, so the
+ * entries with the lowest count of calls or time are removed instead, in
+ * batches rather than one at a time as in the Space-Saving algorithm. The
+ * highest count evicted so far is remembered as the bucket's threshold: no
+ * statement without an entry can have more than that, so it's the error
+ * bound given to the entries created from now on.
+ *
+ * Like hash_entry_dealloc(), the victims are picked with the partitions
+ * locked in shared mode, and removed one partition at a time. An entry that
+ * has been removed and created again in between has another serial, and is
+ * kept. Evictions are serialized with each other by pgsm->evict_lock.
+ * pgsm->lock can't be used for that, as the pending statistics are flushed
+ * with it held.
+ *
+ * Caller must not hold any partition lock.
+ */
+bool
+hash_entry_evict(uint64 bucket_id)
+{
+#if USE_DYNAMIC_HASH
+	/* dshash grows within the DSA area, there is nothing to make room in */
+	return false;
+#else
+	pgsmSharedState *pgsm = pgsmStateLocal.shared_pgsmState;
+	pgsmBucket *bucket = &pgsm->buckets[bucket_id];
+	bool		topk = (pgsm_topk != PGSM_TOPK_OFF);
+	pgsmDeallocItem *items;
+	long		max_items;
+	long		num_items = 0;
+	long		num_victims;
+	long		num_evicted = 0;
+	long		i;
+	dlist_iter	iter;
+
+	LWLockAcquire(pgsm->evict_lock, LW_EXCLUSIVE);
+
+	/* Someone else may have made room in the meantime */
+	if (!hash_is_full(pgsm, bucket_id))
+	{
+		LWLockRelease(pgsm->evict_lock);
+		return true;
+	}
+
+	/*
+	 * No entry can be added to or removed from the bucket lists while all the
+	 * partitions are locked, so the list can be walked without taking the
+	 * bucket spinlock.
+	 */
+	pgsm_partitions_lock(pgsm, LW_SHARED);
+
+	max_items = bucket->num_entries;
+	if (max_items == 0)
+	{
+		pgsm_partitions_unlock(pgsm);
+		LWLockRelease(pgsm->evict_lock);
+		return false;
+	}
+
+	items = palloc_extended(sizeof(pgsmDeallocItem) * max_items,
+							MCXT_ALLOC_HUGE | MCXT_ALLOC_NO_OOM);
+	if (items == NULL)
+	{
+		pgsm_partitions_unlock(pgsm);
+		LWLockRelease(pgsm->evict_lock);
+		return false;
+	}
+
+	dlist_foreach(iter, &bucket->entries)
+	{
+		pgsmEntry  *entry = dlist_container(pgsmEntry, bucket_node, iter.cur);
+
+		/* Evicting an overflow entry would lose the statistics it holds */
+		if (entry->key.overflow)
+			continue;
+
+		items[num_items].key = entry->key;
+		items[num_items].hashcode = pgsm_hash_value(pgsmStateLocal.shared_hash, &entry->key);
+		items[num_items].serial = entry->serial;
+
+		/* The counters are updated under the entry's spinlock */
+		SpinLockAcquire(&entry->mutex);
+		if (topk)
+			items[num_items].usage = hash_entry_topk_count(entry);
+		else
+		{
+			if (entry->counters.calls.calls == 0)
+				entry->counters.calls.usage *= STICKY_DECREASE_FACTOR;
+			else
+				entry->counters.calls.usage *= USAGE_DECREASE_FACTOR;
+			items[num_items].usage = entry->counters.calls.usage;
+		}
+		SpinLockRelease(&entry->mutex);
+		num_items++;
+	}
+	pgsm_partitions_unlock(pgsm);
+
+	/* Least used first */
+	qsort(items, num_items, sizeof(pgsmDeallocItem), evict_item_cmp);
+
+	num_victims = Max(1, num_items * USAGE_DEALLOC_PERCENT / 100);
+	num_victims = Min(num_victims, num_items);
+
+	/* The victims are sorted, the last one has the highest count */
+	if (topk && num_victims > 0)
+	{
+		SpinLockAcquire(&bucket->mutex);
+		bucket->topk_threshold = Max(bucket->topk_threshold, items[num_victims - 1].usage);
+		SpinLockRelease(&bucket->mutex);
+	}
+
+	/* Group the victims per partition, and remove them */
+	qsort(items, num_victims, sizeof(pgsmDeallocItem), dealloc_item_cmp);
+
+	for (i = 0; i < num_victims;)
+	{
+		uint32		partition = PGSM_LOCK_PARTITION(items[i].hashcode);
+		LWLock	   *partition_lock = PGSM_PARTITION_LOCK(pgsm, items[i].hashcode);
+
+		LWLockAcquire(partition_lock, LW_EXCLUSIVE);
+		for (; i < num_victims && PGSM_LOCK_PARTITION(items[i].hashcode) == partition; i++)
+		{
+			pgsmEntry  *entry;
+			bool		found;
+
+			entry = (pgsmEntry *) pgsm_hash_find(pgsmStateLocal.shared_hash, &items[i].key, items[i].hashcode, &found);
+			if (entry == NULL || entry->serial != items[i].serial)
+				continue;
+
+			hash_entry_remove(&items[i].key, items[i].hashcode);
+			num_evicted++;
+		}
+		LWLockRelease(partition_lock);
+	}
+	pg_atomic_fetch_add_u64(&pgsm->plan_epoch, 1);
+
+	pgsm->pgsm_oom = false;
+	LWLockRelease(pgsm->evict_lock);
+
+	pfree(items);
+
+	elog(DEBUG1, "[pg_stat_monitor] hash_entry_evict: evicted %ld entries for bucket %lu.",
+		 num_evicted, (unsigned long) bucket_id);
+
+	return num_evicted > 0;
+#endif
+}
+
+/*
+ * Acquire all the hash partition locks, in order, to avoid deadlocks.
+ */
+void
+pgsm_partitions_lock(pgsmSharedState *pgsm, LWLockMode mode)
+{
+	int			i;
+
+	for (i = 0; i < PGSM_NUM_LOCK_PARTITIONS; i++)
+		LWLockAcquire(&pgsm->partition_locks[i].lock, mode);
+}
+
+void
+pgsm_partitions_unlock(pgsmSharedState *pgsm)
+{
+	int			i;
+
+	for (i = PGSM_NUM_LOCK_PARTITIONS - 1; i >= 0; i--)
+		LWLockRelease(&pgsm->partition_locks[i].lock);
 }
 
 bool
@@ -393,8 +997,21 @@ IsSystemOOM(void)
  * API and call the appropriate hash table function based on USE_DYNAMIC_HASH
  */
 
+/*
+ * Hash code of the key, which also selects its lock partition.
+ */
+uint32
+pgsm_hash_value(PGSM_HASH_TABLE * shared_hash, pgsmHashKey *key)
+{
+#if USE_DYNAMIC_HASH
+	return dshash_memhash(key, sizeof(pgsmHashKey), NULL);
+#else
+	return get_hash_value(shared_hash, key);
+#endif
+}
+
 void *
-pgsm_hash_find_or_insert(PGSM_HASH_TABLE * shared_hash, pgsmHashKey *key, bool *found)
+pgsm_hash_find_or_insert(PGSM_HASH_TABLE * shared_hash, pgsmHashKey *key, uint32 hashcode, bool *found)
 {
 #if USE_DYNAMIC_HASH
 	void	   *entry;
@@ -402,17 +1019,17 @@ pgsm_hash_find_or_insert(PGSM_HASH_TABLE * shared_hash, pgsmHashKey *key, bool *
 	entry = dshash_find_or_insert(shared_hash, key, found);
 	return entry;
 #else
-	return hash_search(shared_hash, key, HASH_ENTER_NULL, found);
+	return hash_search_with_hash_value(shared_hash, key, hashcode, HASH_ENTER_NULL, found);
 #endif
 }
 
 void *
-pgsm_hash_find(PGSM_HASH_TABLE * shared_hash, pgsmHashKey *key, bool *found)
+pgsm_hash_find(PGSM_HASH_TABLE * shared_hash, pgsmHashKey *key, uint32 hashcode, bool *found)
 {
 #if USE_DYNAMIC_HASH
 	return dshash_find(shared_hash, key, false);
 #else
-	return hash_search(shared_hash, key, HASH_FIND, found);
+	return hash_search_with_hash_value(shared_hash, key, hashcode, HASH_FIND, found);
 #endif
 }
 
@@ -453,3 +1070,13 @@ pgsm_hash_delete_current(PGSM_HASH_SEQ_STATUS * hstat, PGSM_HASH_TABLE * shared_
 	hash_search(shared_hash, key, HASH_REMOVE, NULL);
 #endif
 }
+
+void
+pgsm_hash_delete(PGSM_HASH_TABLE * shared_hash, pgsmHashKey *key, uint32 hashcode)
+{
+#if USE_DYNAMIC_HASH
+	dshash_delete_key(shared_hash, key);
+#else
+	hash_search_with_hash_value(shared_hash, key, hashcode, HASH_REMOVE, NULL);
+#endif
+}
@@ -0,0 +1,725 @@
+/* contrib/pg_stat_monitor/pg_stat_monitor--2.1--2.2.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "ALTER EXTENSION pg_stat_monitor" to load this file. \quit
+
+CREATE FUNCTION pg_stat_monitor_pending_stats(
+    OUT pid                 int4,
+    OUT pending_calls       int8,
+    OUT pending_since       timestamp with time zone
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_pending_stats'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+GRANT EXECUTE ON FUNCTION pg_stat_monitor_pending_stats TO PUBLIC;
+
+-- Overflow rows collect the statistics of statements that couldn't get an
+-- entry of their own, and sample_rate reports the fraction of executions
+-- that were tracked. topk_error bounds what an entry may have missed before
+-- it was created, when only the heaviest statements are kept.
+--
+-- The optional filter arguments are checked while scanning the entries, so
+-- that the rows they reject are never built. A NULL argument doesn't filter
+-- anything. Simple predicates on the pg_stat_monitor view are pushed down
+-- to them when the query is planned.
+DROP FUNCTION pg_stat_monitor_internal CASCADE;
+
+CREATE FUNCTION pg_stat_monitor_internal(
+    IN showtext             boolean,
+    IN bucket_from          int8 DEFAULT NULL,
+    IN bucket_to            int8 DEFAULT NULL,
+    IN filter_dbid          oid DEFAULT NULL,
+    IN filter_userid        oid DEFAULT NULL,
+    IN filter_queryid       int8 DEFAULT NULL,
+    IN min_calls            int8 DEFAULT NULL,
+    IN min_total_time       float8 DEFAULT NULL,
+    OUT bucket              int8,   -- 0
+    OUT userid              oid,
+    OUT username            text,
+    OUT dbid                oid,
+    OUT datname             text,
+    OUT client_ip           int8,
+
+    OUT queryid             int8,  -- 6
+    OUT planid              int8,
+    OUT query               text,
+    OUT query_plan          text,
+    OUT pgsm_query_id       int8,
+    OUT top_queryid         int8,
+    OUT top_query           text,
+    OUT application_name    text,
+
+    OUT relations           text, -- 14
+    OUT cmd_type            int,
+    OUT elevel              int,
+    OUT sqlcode             TEXT,
+    OUT message             text,
+    OUT bucket_start_time   timestamptz,
+
+    OUT calls               int8,  -- 20
+
+    OUT total_exec_time     float8, -- 21
+    OUT min_exec_time       float8,
+    OUT max_exec_time       float8,
+    OUT mean_exec_time      float8,
+    OUT stddev_exec_time    float8,
+
+    OUT rows                int8, -- 26
+
+    OUT plans               int8,  -- 27
+
+    OUT total_plan_time     float8, -- 28
+    OUT min_plan_time       float8,
+    OUT max_plan_time       float8,
+    OUT mean_plan_time      float8,
+    OUT stddev_plan_time    float8,
+
+    OUT shared_blks_hit            int8, -- 33
+    OUT shared_blks_read           int8,
+    OUT shared_blks_dirtied        int8,
+    OUT shared_blks_written        int8,
+    OUT local_blks_hit             int8,
+    OUT local_blks_read            int8,
+    OUT local_blks_dirtied         int8,
+    OUT local_blks_written         int8,
+    OUT temp_blks_read             int8,
+    OUT temp_blks_written          int8,
+    OUT shared_blk_read_time       float8,
+    OUT shared_blk_write_time      float8,
+    OUT local_blk_read_time        float8,
+    OUT local_blk_write_time       float8,
+    OUT temp_blk_read_time         float8,
+    OUT temp_blk_write_time        float8,
+
+    OUT resp_calls          text, -- 49
+    OUT cpu_user_time       float8,
+    OUT cpu_sys_time        float8,
+    OUT wal_records         int8,
+    OUT wal_fpi             int8,
+    OUT wal_bytes           numeric,
+    OUT comments            TEXT,
+
+    OUT jit_functions           int8, -- 56
+    OUT jit_generation_time     float8,
+    OUT jit_inlining_count      int8,
+    OUT jit_inlining_time       float8,
+    OUT jit_optimization_count  int8,
+    OUT jit_optimization_time   float8,
+    OUT jit_emission_count      int8,
+    OUT jit_emission_time       float8,
+    OUT jit_deform_count        int8,
+    OUT jit_deform_time         float8,
+
+    OUT stats_since          timestamp with time zone, -- 66
+    OUT minmax_stats_since   timestamp with time zone,
+
+    OUT toplevel            BOOLEAN, -- 68
+    OUT bucket_done         BOOLEAN,
+    OUT overflow            BOOLEAN, -- 70
+    OUT sample_rate         float8,
+    OUT topk_error          float8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_2_2'
+LANGUAGE C VOLATILE PARALLEL SAFE;
+
+-- Register a view on the function for ease of use.
+CREATE OR REPLACE FUNCTION pgsm_create_11_view() RETURNS INT AS
+$$
+BEGIN
+CREATE VIEW pg_stat_monitor AS SELECT
+    bucket,
+    bucket_start_time AS bucket_start_time,
+    userid,
+    username,
+    dbid,
+    datname,
+    '0.0.0.0'::inet + client_ip AS client_ip,
+    pgsm_query_id,
+    queryid,
+    top_queryid,
+    query,
+    comments,
+    planid,
+    query_plan,
+    top_query,
+    application_name,
+    string_to_array(relations, ',') AS relations,
+    cmd_type,
+    get_cmd_type(cmd_type) AS cmd_type_text,
+    elevel,
+    sqlcode,
+    message,
+    calls,
+    total_exec_time AS total_time,
+    min_exec_time AS min_time,
+    max_exec_time AS max_time,
+    mean_exec_time AS mean_time,
+    stddev_exec_time AS stddev_time,
+    rows,
+    shared_blks_hit,
+    shared_blks_read,
+    shared_blks_dirtied,
+    shared_blks_written,
+    local_blks_hit,
+    local_blks_read,
+    local_blks_dirtied,
+    local_blks_written,
+    temp_blks_read,
+    temp_blks_written,
+    shared_blk_read_time AS blk_read_time,
+    shared_blk_write_time AS blk_write_time,
+    (string_to_array(resp_calls, ',')) resp_calls,
+    cpu_user_time,
+    cpu_sys_time,
+    bucket_done,
+    overflow,
+    sample_rate,
+    topk_error
+FROM pg_stat_monitor_internal(TRUE)
+ORDER BY bucket_start_time;
+RETURN 0;
+END;
+$$ LANGUAGE plpgsql;
+
+
+CREATE OR REPLACE FUNCTION pgsm_create_13_view() RETURNS INT AS
+$$
+BEGIN
+CREATE VIEW pg_stat_monitor AS SELECT
+    bucket,
+    bucket_start_time AS bucket_start_time,
+    userid,
+    username,
+    dbid,
+    datname,
+    '0.0.0.0'::inet + client_ip AS client_ip,
+    pgsm_query_id,
+    queryid,
+    toplevel,
+    top_queryid,
+    query,
+    comments,
+    planid,
+    query_plan,
+    top_query,
+    application_name,
+    string_to_array(relations, ',') AS relations,
+    cmd_type,
+    get_cmd_type(cmd_type) AS cmd_type_text,
+    elevel,
+    sqlcode,
+    message,
+    calls,
+    total_exec_time,
+    min_exec_time,
+    max_exec_time,
+    mean_exec_time,
+    stddev_exec_time,
+    rows,
+    shared_blks_hit,
+    shared_blks_read,
+    shared_blks_dirtied,
+    shared_blks_written,
+    local_blks_hit,
+    local_blks_read,
+    local_blks_dirtied,
+    local_blks_written,
+    temp_blks_read,
+    temp_blks_written,
+    shared_blk_read_time AS blk_read_time,
+    shared_blk_write_time AS blk_write_time,
+    (string_to_array(resp_calls, ',')) resp_calls,
+    cpu_user_time,
+    cpu_sys_time,
+    wal_records,
+    wal_fpi,
+    wal_bytes,
+    bucket_done,
+    -- PostgreSQL-13 Specific Coulumns
+    plans,
+    total_plan_time,
+    min_plan_time,
+    max_plan_time,
+    mean_plan_time,
+    stddev_plan_time,
+    overflow,
+    sample_rate,
+    topk_error
+FROM pg_stat_monitor_internal(TRUE)
+ORDER BY bucket_start_time;
+RETURN 0;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION pgsm_create_14_view() RETURNS INT AS
+$$
+BEGIN
+CREATE VIEW pg_stat_monitor AS SELECT
+    bucket,
+    bucket_start_time AS bucket_start_time,
+    userid,
+    username,
+    dbid,
+    datname,
+    '0.0.0.0'::inet + client_ip AS client_ip,
+    pgsm_query_id,
+    queryid,
+    toplevel,
+    top_queryid,
+    query,
+    comments,
+    planid,
+    query_plan,
+    top_query,
+    application_name,
+    string_to_array(relations, ',') AS relations,
+    cmd_type,
+    get_cmd_type(cmd_type) AS cmd_type_text,
+    elevel,
+    sqlcode,
+    message,
+    calls,
+    total_exec_time,
+    min_exec_time,
+    max_exec_time,
+    mean_exec_time,
+    stddev_exec_time,
+    rows,
+    shared_blks_hit,
+    shared_blks_read,
+    shared_blks_dirtied,
+    shared_blks_written,
+    local_blks_hit,
+    local_blks_read,
+    local_blks_dirtied,
+    local_blks_written,
+    temp_blks_read,
+    temp_blks_written,
+    shared_blk_read_time AS blk_read_time,
+    shared_blk_write_time AS blk_write_time,
+    (string_to_array(resp_calls, ',')) resp_calls,
+    cpu_user_time,
+    cpu_sys_time,
+    wal_records,
+    wal_fpi,
+    wal_bytes,
+    bucket_done,
+
+    plans,
+    total_plan_time,
+    min_plan_time,
+    max_plan_time,
+    mean_plan_time,
+    stddev_plan_time,
+    overflow,
+    sample_rate,
+    topk_error
+FROM pg_stat_monitor_internal(TRUE)
+ORDER BY bucket_start_time;
+RETURN 0;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION pgsm_create_15_view() RETURNS INT AS
+$$
+BEGIN
+CREATE VIEW pg_stat_monitor AS SELECT
+    bucket,
+    bucket_start_time AS bucket_start_time,
+    userid,
+    username,
+    dbid,
+    datname,
+    '0.0.0.0'::inet + client_ip AS client_ip,
+    pgsm_query_id,
+    queryid,
+    toplevel,
+    top_queryid,
+    query,
+    comments,
+    planid,
+    query_plan,
+    top_query,
+    application_name,
+    string_to_array(relations, ',') AS relations,
+    cmd_type,
+    get_cmd_type(cmd_type) AS cmd_type_text,
+    elevel,
+    sqlcode,
+    message,
+    calls,
+    total_exec_time,
+    min_exec_time,
+    max_exec_time,
+    mean_exec_time,
+    stddev_exec_time,
+    rows,
+    shared_blks_hit,
+    shared_blks_read,
+    shared_blks_dirtied,
+    shared_blks_written,
+    local_blks_hit,
+    local_blks_read,
+    local_blks_dirtied,
+    local_blks_written,
+    temp_blks_read,
+    temp_blks_written,
+    shared_blk_read_time AS blk_read_time,
+    shared_blk_write_time AS blk_write_time,
+    temp_blk_read_time,
+    temp_blk_write_time,
+
+    (string_to_array(resp_calls, ',')) resp_calls,
+    cpu_user_time,
+    cpu_sys_time,
+    wal_records,
+    wal_fpi,
+    wal_bytes,
+    bucket_done,
+
+    plans,
+    total_plan_time,
+    min_plan_time,
+    max_plan_time,
+    mean_plan_time,
+    stddev_plan_time,
+
+    jit_functions,
+    jit_generation_time,
+    jit_inlining_count,
+    jit_inlining_time,
+    jit_optimization_count,
+    jit_optimization_time,
+    jit_emission_count,
+    jit_emission_time,
+
+    overflow,
+    sample_rate,
+    topk_error
+FROM pg_stat_monitor_internal(TRUE)
+ORDER BY bucket_start_time;
+RETURN 0;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION pgsm_create_17_view() RETURNS INT AS
+$$
+BEGIN
+CREATE VIEW pg_stat_monitor AS SELECT
+    bucket,
+    bucket_start_time,
+    userid,
+    username,
+    dbid,
+    datname,
+    '0.0.0.0'::inet + client_ip AS client_ip,
+    pgsm_query_id,
+    queryid,
+    toplevel,
+    top_queryid,
+    query,
+    comments,
+    planid,
+    query_plan,
+    top_query,
+    application_name,
+    string_to_array(relations, ',') AS relations,
+    cmd_type,
+    get_cmd_type(cmd_type) AS cmd_type_text,
+    elevel,
+    sqlcode,
+    message,
+    calls,
+    total_exec_time,
+    min_exec_time,
+    max_exec_time,
+    mean_exec_time,
+    stddev_exec_time,
+    rows,
+    shared_blks_hit,
+    shared_blks_read,
+    shared_blks_dirtied,
+    shared_blks_written,
+    local_blks_hit,
+    local_blks_read,
+    local_blks_dirtied,
+    local_blks_written,
+    temp_blks_read,
+    temp_blks_written,
+    shared_blk_read_time,
+    shared_blk_write_time,
+    local_blk_read_time,
+    local_blk_write_time,
+    temp_blk_read_time,
+    temp_blk_write_time,
+
+    (string_to_array(resp_calls, ',')) resp_calls,
+    cpu_user_time,
+    cpu_sys_time,
+    wal_records,
+    wal_fpi,
+    wal_bytes,
+    bucket_done,
+
+    plans,
+    total_plan_time,
+    min_plan_time,
+    max_plan_time,
+    mean_plan_time,
+    stddev_plan_time,
+
+    jit_functions,
+    jit_generation_time,
+    jit_inlining_count,
+    jit_inlining_time,
+    jit_optimization_count,
+    jit_optimization_time,
+    jit_emission_count,
+    jit_emission_time,
+    jit_deform_count,
+    jit_deform_time,
+
+    stats_since,
+    minmax_stats_since,
+
+    overflow,
+    sample_rate,
+    topk_error
+FROM pg_stat_monitor_internal(TRUE)
+ORDER BY bucket_start_time;
+RETURN 0;
+END;
+$$ LANGUAGE plpgsql;
+
+SELECT pgsm_create_view();
+
+GRANT EXECUTE ON FUNCTION pg_stat_monitor_internal TO PUBLIC;
+
+GRANT SELECT ON pg_stat_monitor TO PUBLIC;
+
+-- Resolution of the CPU times measured with pgsm_cpu_time_source, in
+-- milliseconds.
+CREATE FUNCTION pg_stat_monitor_cpu_time_resolution()
+RETURNS float8
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_cpu_time_resolution'
+LANGUAGE C VOLATILE PARALLEL SAFE;
+
+GRANT EXECUTE ON FUNCTION pg_stat_monitor_cpu_time_resolution TO PUBLIC;
+
+-- Hits and misses of the cache of normalized statements of the current
+-- backend.
+CREATE FUNCTION pg_stat_monitor_normalize_cache_stats(
+    OUT hits                int8,
+    OUT misses              int8,
+    OUT entries             int4
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_normalize_cache_stats'
+LANGUAGE C STRICT VOLATILE PARALLEL RESTRICTED;
+
+GRANT EXECUTE ON FUNCTION pg_stat_monitor_normalize_cache_stats TO PUBLIC;
+
+-- Entries changed since a cursor, the generation of their last change and
+-- the cursor to pass to the next call. Start with a cursor of 0. When
+-- nothing changed, no rows are returned and the previous cursor stays
+-- valid. Removed entries are not reported. Every call advances the shared
+-- generation counter, which parallel workers must not do.
+CREATE FUNCTION pg_stat_monitor_changes(
+    IN since                int8,
+    OUT bucket              int8,   -- 0
+    OUT userid              oid,
+    OUT username            text,
+    OUT dbid                oid,
+    OUT datname             text,
+    OUT client_ip           int8,
+
+    OUT queryid             int8,  -- 6
+    OUT planid              int8,
+    OUT query               text,
+    OUT query_plan          text,
+    OUT pgsm_query_id       int8,
+    OUT top_queryid         int8,
+    OUT top_query           text,
+    OUT application_name    text,
+
+    OUT relations           text, -- 14
+    OUT cmd_type            int,
+    OUT elevel              int,
+    OUT sqlcode             TEXT,
+    OUT message             text,
+    OUT bucket_start_time   timestamptz,
+
+    OUT calls               int8,  -- 20
+
+    OUT total_exec_time     float8, -- 21
+    OUT min_exec_time       float8,
+    OUT max_exec_time       float8,
+    OUT mean_exec_time      float8,
+    OUT stddev_exec_time    float8,
+
+    OUT rows                int8, -- 26
+
+    OUT plans               int8,  -- 27
+
+    OUT total_plan_time     float8, -- 28
+    OUT min_plan_time       float8,
+    OUT max_plan_time       float8,
+    OUT mean_plan_time      float8,
+    OUT stddev_plan_time    float8,
+
+    OUT shared_blks_hit            int8, -- 33
+    OUT shared_blks_read           int8,
+    OUT shared_blks_dirtied        int8,
+    OUT shared_blks_written        int8,
+    OUT local_blks_hit             int8,
+    OUT local_blks_read            int8,
+    OUT local_blks_dirtied         int8,
+    OUT local_blks_written         int8,
+    OUT temp_blks_read             int8,
+    OUT temp_blks_written          int8,
+    OUT shared_blk_read_time       float8,
+    OUT shared_blk_write_time      float8,
+    OUT local_blk_read_time        float8,
+    OUT local_blk_write_time       float8,
+    OUT temp_blk_read_time         float8,
+    OUT temp_blk_write_time        float8,
+
+    OUT resp_calls          text, -- 49
+    OUT cpu_user_time       float8,
+    OUT cpu_sys_time        float8,
+    OUT wal_records         int8,
+    OUT wal_fpi             int8,
+    OUT wal_bytes           numeric,
+    OUT comments            TEXT,
+
+    OUT jit_functions           int8, -- 56
+    OUT jit_generation_time     float8,
+    OUT jit_inlining_count      int8,
+    OUT jit_inlining_time       float8,
+    OUT jit_optimization_count  int8,
+    OUT jit_optimization_time   float8,
+    OUT jit_emission_count      int8,
+    OUT jit_emission_time       float8,
+    OUT jit_deform_count        int8,
+    OUT jit_deform_time         float8,
+
+    OUT stats_since          timestamp with time zone, -- 66
+    OUT minmax_stats_since   timestamp with time zone,
+
+    OUT toplevel            BOOLEAN, -- 68
+    OUT bucket_done         BOOLEAN,
+    OUT overflow            BOOLEAN, -- 70
+    OUT sample_rate         float8,
+    OUT topk_error          float8,
+    OUT generation          int8, -- 73
+    OUT cursor              int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_changes'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+GRANT EXECUTE ON FUNCTION pg_stat_monitor_changes TO PUBLIC;
+
+
+-- The n entries with the highest value of a metric, optionally in a single
+-- bucket, in descending order. The metric is named after its column: calls,
+-- total_exec_time, mean_exec_time, max_exec_time, rows, total_plan_time,
+-- shared_blks_hit, shared_blks_read, temp_blks_written, cpu_user_time,
+-- cpu_sys_time or wal_bytes.
+CREATE FUNCTION pg_stat_monitor_top(
+    IN n                    int4,
+    IN metric               text DEFAULT 'total_exec_time',
+    IN bucket_id            int8 DEFAULT NULL,
+    OUT bucket              int8,   -- 0
+    OUT userid              oid,
+    OUT username            text,
+    OUT dbid                oid,
+    OUT datname             text,
+    OUT client_ip           int8,
+
+    OUT queryid             int8,  -- 6
+    OUT planid              int8,
+    OUT query               text,
+    OUT query_plan          text,
+    OUT pgsm_query_id       int8,
+    OUT top_queryid         int8,
+    OUT top_query           text,
+    OUT application_name    text,
+
+    OUT relations           text, -- 14
+    OUT cmd_type            int,
+    OUT elevel              int,
+    OUT sqlcode             TEXT,
+    OUT message             text,
+    OUT bucket_start_time   timestamptz,
+
+    OUT calls               int8,  -- 20
+
+    OUT total_exec_time     float8, -- 21
+    OUT min_exec_time       float8,
+    OUT max_exec_time       float8,
+    OUT mean_exec_time      float8,
+    OUT stddev_exec_time    float8,
+
+    OUT rows                int8, -- 26
+
+    OUT plans               int8,  -- 27
+
+    OUT total_plan_time     float8, -- 28
+    OUT min_plan_time       float8,
+    OUT max_plan_time       float8,
+    OUT mean_plan_time      float8,
+    OUT stddev_plan_time    float8,
+
+    OUT shared_blks_hit            int8, -- 33
+    OUT shared_blks_read           int8,
+    OUT shared_blks_dirtied        int8,
+    OUT shared_blks_written        int8,
+    OUT local_blks_hit             int8,
+    OUT local_blks_read            int8,
+    OUT local_blks_dirtied         int8,
+    OUT local_blks_written         int8,
+    OUT temp_blks_read             int8,
+    OUT temp_blks_written          int8,
+    OUT shared_blk_read_time       float8,
+    OUT shared_blk_write_time      float8,
+    OUT local_blk_read_time        float8,
+    OUT local_blk_write_time       float8,
+    OUT temp_blk_read_time         float8,
+    OUT temp_blk_write_time        float8,
+
+    OUT resp_calls          text, -- 49
+    OUT cpu_user_time       float8,
+    OUT cpu_sys_time        float8,
+    OUT wal_records         int8,
+    OUT wal_fpi             int8,
+    OUT wal_bytes           numeric,
+    OUT comments            TEXT,
+
+    OUT jit_functions           int8, -- 56
+    OUT jit_generation_time     float8,
+    OUT jit_inlining_count      int8,
+    OUT jit_inlining_time       float8,
+    OUT jit_optimization_count  int8,
+    OUT jit_optimization_time   float8,
+    OUT jit_emission_count      int8,
+    OUT jit_emission_time       float8,
+    OUT jit_deform_count        int8,
+    OUT jit_deform_time         float8,
+
+    OUT stats_since          timestamp with time zone, -- 66
+    OUT minmax_stats_since   timestamp with time zone,
+
+    OUT toplevel            BOOLEAN, -- 68
+    OUT bucket_done         BOOLEAN,
+    OUT overflow            BOOLEAN, -- 70
+    OUT sample_rate         float8,
+    OUT topk_error          float8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_top'
+LANGUAGE C VOLATILE PARALLEL SAFE;
+
+GRANT EXECUTE ON FUNCTION pg_stat_monitor_top TO PUBLIC;
@@ -17,12 +17,33 @@
 
 #include "postgres.h"
 #include "access/parallel.h"
+#include "access/stratnum.h"
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "lib/binaryheap.h"
+#include "nodes/makefuncs.h"
 #include "nodes/pg_list.h"
+#include "optimizer/optimizer.h"
 #include "utils/guc.h"
-#include <regex.h>
 #include "pgstat.h"
 #include "commands/dbcommands.h"
 #include "commands/explain.h"
+#include "parser/parser.h"
+#include "utils/float.h"
+#include "utils/inval.h"
+#include "utils/syscache.h"
+#if PG_VERSION_NUM >= 140000
+#include "common/hashfn.h"
+#include "utils/numeric.h"
+#else
+#include "utils/hashutils.h"
+#endif
+#if PG_VERSION_NUM >= 150000
+#include "common/pg_prng.h"
+#endif
+#if PG_VERSION_NUM >= 160000
+#include "port/simd.h"
+#endif
 #include "pg_stat_monitor.h"
 
  /*
@@ -32,18 +53,117 @@ typedef enum pgsmVersion
 {
 	PGSM_V1_0 = 0,
 	PGSM_V2_0,
-	PGSM_V2_1
+	PGSM_V2_1,
+	PGSM_V2_2
 } pgsmVersion;
 
+/*
+ * Metrics pg_stat_monitor_top() can rank the entries by, named after the
+ * columns they are reported in.
+ */
+typedef enum pgsmTopMetric
+{
+	PGSM_TOP_CALLS = 0,
+	PGSM_TOP_TOTAL_EXEC_TIME,
+	PGSM_TOP_MEAN_EXEC_TIME,
+	PGSM_TOP_MAX_EXEC_TIME,
+	PGSM_TOP_ROWS,
+	PGSM_TOP_TOTAL_PLAN_TIME,
+	PGSM_TOP_SHARED_BLKS_HIT,
+	PGSM_TOP_SHARED_BLKS_READ,
+	PGSM_TOP_TEMP_BLKS_WRITTEN,
+	PGSM_TOP_CPU_USER_TIME,
+	PGSM_TOP_CPU_SYS_TIME,
+	PGSM_TOP_WAL_BYTES,
+
+	PGSM_TOP_NUM_METRICS		/* Must be last value of this enum */
+} pgsmTopMetric;
+
+static const char *const pgsm_top_metric_names[PGSM_TOP_NUM_METRICS] = {
+	"calls",
+	"total_exec_time",
+	"mean_exec_time",
+	"max_exec_time",
+	"rows",
+	"total_plan_time",
+	"shared_blks_hit",
+	"shared_blks_read",
+	"temp_blks_written",
+	"cpu_user_time",
+	"cpu_sys_time",
+	"wal_bytes"
+};
+
+/* A candidate of pg_stat_monitor_top(), kept in a bounded heap */
+typedef struct pgsmTopEntry
+{
+	double		value;
+	pgsmEntry  *entry;
+} pgsmTopEntry;
+
+/* A relation name looked up while reading pg_stat_monitor */
+typedef struct pgsmRelationName
+{
+	Oid			relid;			/* hash key */
+	char	   *name;			/* qualified name, NULL if unknown */
+} pgsmRelationName;
+
+/*
+ * Optional filters of pg_stat_monitor_internal().  They are checked during
+ * the hash scan, before any column of an entry is built.
+ */
+typedef struct pgsmFilter
+{
+	bool		has_bucket_from;
+	int64		bucket_from;
+	bool		has_bucket_to;
+	int64		bucket_to;
+	bool		has_dbid;
+	Oid			dbid;
+	bool		has_userid;
+	Oid			userid;
+	bool		has_queryid;
+	uint64		queryid;
+	bool		has_min_calls;
+	int64		min_calls;
+	bool		has_min_total_time;
+	double		min_total_time;
+	bool		has_changed_since;
+	uint64		changed_since;
+	int			top_n;			/* only the top_n entries by top_metric */
+	pgsmTopMetric top_metric;
+} pgsmFilter;
+
 PG_MODULE_MAGIC;
 
-#define BUILD_VERSION                   "2.1.0"
+#define BUILD_VERSION                   "2.2.0"
 
 /* Number of output arguments (columns) for various API versions */
 #define PG_STAT_MONITOR_COLS_V1_0    52
 #define PG_STAT_MONITOR_COLS_V2_0    64
 #define PG_STAT_MONITOR_COLS_V2_1    70
-#define PG_STAT_MONITOR_COLS         PG_STAT_MONITOR_COLS_V2_1	/* maximum of above */
+#define PG_STAT_MONITOR_COLS_V2_2    73
+#define PG_STAT_MONITOR_COLS_CHANGES (PG_STAT_MONITOR_COLS_V2_2 + 2)
+#define PG_STAT_MONITOR_COLS         PG_STAT_MONITOR_COLS_CHANGES	/* maximum of above */
+
+/* Input arguments of pg_stat_monitor_internal() for API version 2.2 */
+#define PGSM_ARG_SHOWTEXT            0
+#define PGSM_ARG_BUCKET_FROM         1
+#define PGSM_ARG_BUCKET_TO           2
+#define PGSM_ARG_DBID                3
+#define PGSM_ARG_USERID              4
+#define PGSM_ARG_QUERYID             5
+#define PGSM_ARG_MIN_CALLS           6
+#define PGSM_ARG_MIN_TOTAL_TIME      7
+#define PGSM_NUM_ARGS                8
+
+/* Output columns of pg_stat_monitor_internal() the filters apply to */
+#define PGSM_COL_BUCKET              1
+#define PGSM_COL_USERID              2
+#define PGSM_COL_DBID                4
+#define PGSM_COL_QUERYID             7
+#define PGSM_COL_CALLS               21
+#define PGSM_COL_TOTAL_EXEC_TIME     22
 
 #define PGSM_TEXT_FILE PGSTAT_STAT_PERMANENT_DIRECTORY "pg_stat_monitor_query"
 
@@ -53,18 +173,10 @@ PG_MODULE_MAGIC;
   memcpy((void *)_str_dst, _str_src, _len < _max_len ? _len : _max_len)
 
 #define pgsm_enabled(level) \
-    (!IsParallelWorker() && \
+    (!IsParallelWorker() && pgsm_query_sampled && \
     (pgsm_track == PGSM_TRACK_ALL || \
     (pgsm_track == PGSM_TRACK_TOP && (level) == 0)))
 
-#define _snprintf2(_str_dst, _str_src, _len1, _len2)\
-do                                                      \
-{                                                       \
-	int i;                                            \
-	for(i = 0; i < _len1; i++)                        \
-		strlcpy((char *)_str_dst[i], _str_src[i], _len2); \
-}while(0)
-
 #define PGSM_INVALID_IP_MASK	0xFFFFFFFF
 
 #define pgsm_client_ip_is_valid() \
@@ -77,6 +189,16 @@ void		_PG_init(void);
 static int	nesting_level = 0;
 volatile bool __pgsm_do_not_capture_error = false;
 
+/*
+ * Whether the current top level statement is tracked, and the number of
+ * executions it stands for; see pgsm_sample_query(). This only applies to the
+ * counters of statements that complete, errors are always recorded by
+ * pgsm_emit_log_hook().
+ */
+static bool pgsm_query_sampled = true;
+static bool pgsm_sample_pending = false;
+static double pgsm_sample_weight = 1.0;
+
 #if PG_VERSION_NUM >= 130000 && PG_VERSION_NUM < 170000
 /* Before planner nesting level was conunted separately */
 static int	plan_nested_level = 0;
@@ -86,6 +208,8 @@ static int	plan_nested_level = 0;
 static double hist_bucket_min;
 static double hist_bucket_max;
 static double hist_bucket_timings[MAX_RESPONSE_BUCKET + 2][2];	/* Start and end timings */
+static double hist_bucket_ends[HISTOGRAM_LOOKUP_SIZE];	/* End timings for lookups */
+static int	hist_bucket_count_ends;
 static int	hist_bucket_count_user;
 static int	hist_bucket_count_total;
 
@@ -93,33 +217,81 @@ static uint32 pgsm_client_ip = PGSM_INVALID_IP_MASK;
 
 /* The array to store outer layer query id*/
 uint64	   *nested_queryids;
-char	  **nested_query_txts;
-List	   *lentries = NIL;
 
-/* Regex object used to extract query comments. */
-static regex_t preg_query_comments;
-static char relations[REL_LST][REL_LEN];
+/*
+ * Source text of the statement running at each nesting level. These only
+ * point to queryDesc->sourceText, which stays valid while the nested
+ * statements run. The text is copied to the DSA area when an entry actually
+ * stores it as its parent query.
+ */
+const char **nested_query_txts;
+
+/*
+ * Local entries of the statements in flight, by queryid. The table lives in
+ * the pgsm memory context and goes away with pgsm_cleanup_callback().
+ */
+#define SH_PREFIX pgsm_lentries
+#define SH_ELEMENT_TYPE pgsmLocalEntry
+#define SH_KEY_TYPE uint64
+#define SH_KEY queryid
+#define SH_HASH_KEY(tb, key) murmurhash32((uint32) ((key) ^ ((key) >> 32)))
+#define SH_EQUAL(tb, a, b) ((a) == (b))
+#define SH_SCOPE static inline
+#define SH_DECLARE
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
+static pgsm_lentries_hash *lentries = NULL;
+
+static pgsmRelation relations[REL_LST];
 
 static int	num_relations;		/* Number of relation in the query */
 static bool system_init = false;
-static struct rusage rusage_start;
-static struct rusage rusage_end;
 
-/* Application name and length; set each time when an entry is created locally */
+/*
+ * CPU time at the start of the statement of each nesting level, see
+ * pgsm_cpu_time_start(). Grown as deeper levels are reached.
+ */
+typedef struct pgsmCpuTimeStart
+{
+	int			source;			/* source the start was taken with, -1 if
+								 * none */
+	struct rusage rusage;
+	struct timespec cputime;
+} pgsmCpuTimeStart;
+
+static pgsmCpuTimeStart *cpu_time_starts = NULL;
+static int	cpu_time_levels = 0;
+
+/*
+ * Application name, its length and hash, and the value of the
+ * application_name GUC they were computed from. They are only recomputed
+ * once the GUC changes, see pgsm_application_name_changed().
+ */
 static char app_name[APPLICATIONNAME_LEN];
 static int	app_name_len;
+static uint64 app_name_id;
+static char app_name_guc[APPLICATIONNAME_LEN];
+static const char *app_name_guc_ptr = NULL;
 
 
 /* Query buffer, store queries' text. */
 static char *pgsm_explain(QueryDesc *queryDesc);
+static uint64 pgsm_plan_fingerprint(PlannedStmt *stmt);
+static void pgsm_plan_jumble(pgsmPlanJumble *jumble, Plan *plan, List *rtable);
+static void pgsm_plan_jumble_append(pgsmPlanJumble *jumble, const void *item, Size size);
+static bool pgsm_plan_seen(pgsmHashKey *key);
+static void pgsm_plan_set_seen(pgsmHashKey *key, uint64 epoch);
 
-static void extract_query_comments(const char *query, char *comments, size_t max_len);
+static void extract_query_comments(const char *query, int query_len, char *comments, size_t max_len);
 static void set_histogram_bucket_timings(void);
 static void histogram_bucket_timings(int index, double *b_start, double *b_end);
 static int	get_histogram_bucket(double q_time);
 
 static bool IsSystemInitialized(void);
 static double time_diff(struct timeval end, struct timeval start);
+static void pgsm_cpu_time_start(void);
+static void pgsm_cpu_time_end(SysInfo *sys_info);
 static void request_additional_shared_resources(void);
 
 
@@ -144,14 +316,22 @@ DECLARE_HOOK(void pgsm_emit_log_hook, ErrorData *edata);
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 static ExecutorCheckPerms_hook_type prev_ExecutorCheckPerms_hook = NULL;
 
+static bool pgsm_application_name_changed(void);
+
 PG_FUNCTION_INFO_V1(pg_stat_monitor_version);
 PG_FUNCTION_INFO_V1(pg_stat_monitor_reset);
 PG_FUNCTION_INFO_V1(pg_stat_monitor_1_0);
 PG_FUNCTION_INFO_V1(pg_stat_monitor_2_0);
 PG_FUNCTION_INFO_V1(pg_stat_monitor_2_1);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_2_2);
 PG_FUNCTION_INFO_V1(pg_stat_monitor);
 PG_FUNCTION_INFO_V1(get_histogram_timings);
 PG_FUNCTION_INFO_V1(pg_stat_monitor_hook_stats);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_pending_stats);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_cpu_time_resolution);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_normalize_cache_stats);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_changes);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_top);
 
 static uint pg_get_client_addr(bool *ok);
 static int	pg_get_application_name(char *name, int buff_size);
@@ -203,6 +383,7 @@ char	   *unpack_sql_state(int sql_state);
 
 static pgsmEntry *pgsm_create_hash_entry(uint64 bucket_id, uint64 queryid, PlanInfo *plan_info);
 static void pgsm_add_to_list(pgsmEntry *entry, char *query_text, int query_len);
+static void pgsm_append_relation_name(StringInfo buf, Oid dbid, pgsmRelation *rel, HTAB **names);
 static pgsmEntry *pgsm_get_entry_for_query(uint64 queryid, PlanInfo *plan_info, const char *query_text, int query_len, bool create);
 static uint64 get_pgsm_query_id_hash(const char *norm_query, int len);
 
@@ -218,12 +399,10 @@ MemoryContextCallback mem_cxt_reset_callback =
 volatile bool callback_setup = false;
 
 static void pgsm_update_entry(pgsmEntry *entry,
+							  pgsmEntryMeta *meta,
 							  const char *query,
-							  char *comments,
-							  int comments_len,
 							  PlanInfo *plan_info,
 							  SysInfo *sys_info,
-							  ErrorInfo *error_info,
 							  double plan_total_time,
 							  double exec_total_time,
 							  uint64 rows,
@@ -233,10 +412,78 @@ static void pgsm_update_entry(pgsmEntry *entry,
 							  bool reset,
 							  pgsmStoreKind kind);
 static void pgsm_store(pgsmEntry *entry);
+static void pgsm_sample_query(uint64 queryid, bool parse, bool utility);
+static void pgsm_scale_counters(Counters *counters);
+static void pgsm_reset_local_entry(pgsmEntry *entry);
+static pgsmEntry *pgsm_get_shared_entry(pgsmSharedState *pgsm, pgsmEntry *entry, const char *query, int query_len, uint32 *hashcode);
+static pgsmEntry *pgsm_get_overflow_entry(pgsmSharedState *pgsm, pgsmEntry *entry, uint32 *hashcode);
+static dsa_pointer pgsm_meta_pack(pgsmEntryMeta *meta);
+static void pgsm_meta_unpack(pgsmEntry *entry, pgsmEntryMeta *meta);
+static bool pgsm_meta_changed(pgsmEntry *entry, pgsmEntryMeta *local);
+static bool pgsm_meta_merge(pgsmEntryMeta *dst, pgsmEntryMeta *src);
+static void pgsm_update_shared_meta(pgsmSharedState *pgsm, pgsmEntry *entry, uint32 hashcode, pgsmEntryMeta *local);
+
+/* Statistics accumulated locally while pgsm_flush_batch_size is set */
+static MemoryContext pending_cxt = NULL;
+static HTAB *pending_hash = NULL;
+static int64 pending_calls = 0;
+static uint64 pending_bucket_id = 0;
+static TimestampTz pending_since = 0;
+static pgsmPendingStats *pending_slot = NULL;
+
+static void pgsm_init_pending(void);
+static void pgsm_add_pending(pgsmEntry *entry, const char *query,
+							 BufferUsage *bufusage, WalUsage *walusage, JitInstrumentation *jitusage);
+static void pgsm_merge_entry(pgsmEntry *entry, pgsmEntry *pending);
+static void pgsm_discard_pending(void);
+static void pgsm_flush_pending(void);
+static bool pgsm_pending_expired(void);
+static void pgsm_pending_shmem_exit(int code, Datum arg);
+
+/* Database, user and relation names, looked up once per backend */
+static HTAB *datname_cache = NULL;
+static HTAB *username_cache = NULL;
+static HTAB *relname_cache = NULL;
+
+/* Plans whose text this backend has stored, see pgsm_plan_seen() */
+static HTAB *plan_seen_cache = NULL;
+
+static void pgsm_init_name_cache(void);
+static void pgsm_name_cache_callback(Datum arg, int cacheid, uint32 hashvalue);
+static void pgsm_relname_cache_callback(Datum arg, Oid relid);
+static const char *pgsm_cached_name(HTAB *cache, Oid oid);
+static void pgsm_lookup_names(Oid dbid, Oid userid, const char **datname, const char **username);
+
+/* Normalized statements, by queryid, see pgsm_norm_cache_lookup() */
+static HTAB *norm_cache = NULL;
+static MemoryContext norm_cache_cxt = NULL;
+static dlist_head norm_cache_lru = DLIST_STATIC_INIT(norm_cache_lru);
+static uint64 norm_cache_hits = 0;
+static uint64 norm_cache_misses = 0;
+
+static pgsmNormCacheEntry *pgsm_norm_cache_lookup(uint64 queryid, JumbleState *jstate,
+												  const char *query, int query_loc, int query_len);
+static bool pgsm_norm_cache_match(pgsmNormCacheEntry *entry, JumbleState *jstate,
+								  const char *query, int query_loc, int query_len);
+static bool pgsm_norm_cache_is_constant(const char *p, int len);
+static void pgsm_norm_cache_insert(uint64 queryid, JumbleState *jstate,
+								   const char *query, int query_loc, int query_len,
+								   const char *norm_query, int norm_query_len,
+								   uint64 pgsm_query_id);
 
 static void pg_stat_monitor_internal(FunctionCallInfo fcinfo,
 									 pgsmVersion api_version,
-									 bool showtext);
+									 bool showtext,
+									 pgsmFilter *filter);
+static void pgsm_filter_from_args(FunctionCallInfo fcinfo, pgsmFilter *filter);
+static bool pgsm_filter_key(pgsmFilter *filter, pgsmHashKey *key);
+static bool pgsm_filter_counters(pgsmFilter *filter, Counters *counters);
+static pgsmEntry **pgsm_top_entries(pgsmFilter *filter, int *num_entries);
+static pgsmEntry *pgsm_next_top_entry(pgsmEntry **top_entries, int num_entries, int *next);
+static bool IsBucketValid(uint64 bucketid, TimestampTz now);
+#if PG_VERSION_NUM >= 130000
+static void pgsm_push_down_filters(Query *parse);
+#endif
 
 #if PG_VERSION_NUM < 140000
 static void AppendJumble(JumbleState *jstate,
@@ -259,7 +506,11 @@ static char *generate_normalized_query(JumbleState *jstate, const char *query,
 static void fill_in_constant_lengths(JumbleState *jstate, const char *query, int query_loc);
 static int	comp_location(const void *a, const void *b);
 
-static uint64 get_next_wbucket(pgsmSharedState *pgsm);
+static long pgsm_rotate_bucket(pgsmSharedState *pgsm);
+static void pgsm_bgworker_sigterm(SIGNAL_ARGS);
+
+/* Set by the SIGTERM handler of the background worker */
+static volatile sig_atomic_t got_sigterm = false;
 
 /*
  * To prevent deadlocks against our own backend we need to disable error
@@ -272,6 +523,10 @@ static bool disable_error_capture = false;
 
 static void pgsm_lock_aquire(pgsmSharedState *pgsm, LWLockMode mode);
 static void pgsm_lock_release(pgsmSharedState *pgsm);
+static void pgsm_partition_lock_aquire(pgsmSharedState *pgsm, uint32 hashcode, LWLockMode mode);
+static void pgsm_partition_lock_release(pgsmSharedState *pgsm, uint32 hashcode);
+static void pgsm_all_partitions_lock_aquire(pgsmSharedState *pgsm, LWLockMode mode);
+static void pgsm_all_partitions_lock_release(pgsmSharedState *pgsm);
 
 /*
  * Module load callback
@@ -280,7 +535,7 @@ static void pgsm_lock_release(pgsmSharedState *pgsm);
 void
 _PG_init(void)
 {
-	int			rc;
+	BackgroundWorker worker;
 
 	elog(DEBUG2, "[pg_stat_monitor] pg_stat_monitor: %s().", __FUNCTION__);
 
@@ -312,15 +567,6 @@ _PG_init(void)
 
 	EmitWarningsOnPlaceholders("pg_stat_monitor");
 
-	/*
-	 * Compile regular expression for extracting out query comments only once.
-	 */
-	rc = regcomp(&preg_query_comments, "/\\*([^*]|[\r\n]|(\\*+([^*/]|[\r\n])))*\\*+/", REG_EXTENDED);
-	if (rc != 0)
-	{
-		elog(ERROR, "[pg_stat_monitor] _PG_init: query comments regcomp() failed, return code=(%d).", rc);
-	}
-
 	/*
 	 * Install hooks.
 	 */
@@ -353,8 +599,19 @@ _PG_init(void)
 	prev_ExecutorCheckPerms_hook = ExecutorCheckPerms_hook;
 	ExecutorCheckPerms_hook = HOOK(pgsm_ExecutorCheckPerms);
 
-	nested_queryids = (uint64 *) malloc(sizeof(uint64) * max_stack_depth);
-	nested_query_txts = (char **) malloc(sizeof(char *) * max_stack_depth);
+	/* Bucket rotation is done by a background worker */
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+	worker.bgw_restart_time = 1;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_stat_monitor");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgsm_bgworker_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_stat_monitor bucket worker");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_stat_monitor bucket worker");
+	RegisterBackgroundWorker(&worker);
+
+	nested_queryids = (uint64 *) calloc(max_stack_depth, sizeof(uint64));
+	nested_query_txts = (const char **) calloc(max_stack_depth, sizeof(char *));
 
 	system_init = true;
 }
@@ -383,7 +640,7 @@ request_additional_shared_resources(void)
 	 * resources in pgsm_shmem_startup().
 	 */
 	RequestAddinShmemSpace(pgsm_ShmemSize() + HOOK_STATS_SIZE);
-	RequestNamedLWLockTranche("pg_stat_monitor", 1);
+	RequestNamedLWLockTranche("pg_stat_monitor", 3 + PGSM_NUM_LOCK_PARTITIONS);
 }
 
 /*
@@ -409,12 +666,67 @@ pgsm_shmem_request(void)
 }
 #endif
 
+/*
+ * Decide whether the top level statement that is about to be parsed or
+ * executed is tracked, according to pgsm_sample_rate.
+ *
+ * In random mode, the decision made when a statement is parsed is kept for
+ * its execution, so that it is either tracked completely or not at all. A
+ * statement executed without being parsed first, like a prepared one, gets a
+ * new decision. The counters of a tracked statement stand for 1 /
+ * pgsm_sample_rate executions.
+ *
+ * In queryid mode, the same queries are always tracked, and their counters
+ * are exact. Before PG 14 the queryid is not known yet at parse time, so all
+ * statements are parsed as if they were tracked.
+ *
+ * Utility statements, and whatever they run, are always tracked. They are
+ * rare compared to the statements sampling is meant for.
+ */
+static void
+pgsm_sample_query(uint64 queryid, bool parse, bool utility)
+{
+	if (pgsm_sample_rate >= 1.0 || utility)
+	{
+		pgsm_query_sampled = true;
+		pgsm_sample_weight = 1.0;
+		pgsm_sample_pending = false;
+		return;
+	}
+
+	if (pgsm_sample_mode == PGSM_SAMPLE_QUERYID)
+	{
+		/* The queryid is a hash value already, take its top 53 bits */
+		pgsm_query_sampled = (queryid == UINT64CONST(0) ||
+							  (double) (queryid >> 11) / (double) (UINT64CONST(1) << 53) < pgsm_sample_rate);
+		pgsm_sample_weight = 1.0;
+		pgsm_sample_pending = false;
+		return;
+	}
+
+	/* Use the decision made when the statement was parsed */
+	if (!parse && pgsm_sample_pending)
+	{
+		pgsm_sample_pending = false;
+		return;
+	}
+
+#if PG_VERSION_NUM >= 150000
+	pgsm_query_sampled = (pg_prng_double(&pg_global_prng_state) < pgsm_sample_rate);
+#else
+	pgsm_query_sampled = (random() < pgsm_sample_rate * ((double) MAX_RANDOM_VALUE + 1));
+#endif
+	pgsm_sample_weight = pgsm_query_sampled ? 1.0 / pgsm_sample_rate : 1.0;
+	pgsm_sample_pending = parse;
+}
+
 static void
 pgsm_post_parse_analyze_internal(ParseState *pstate, Query *query, JumbleState *jstate)
 {
 	pgsmEntry  *entry;
 	const char *query_text;
 	char	   *norm_query = NULL;
+	pgsmNormCacheEntry *norm_cached = NULL;
 	int			norm_query_len;
 	int			location;
 	int			query_len;
@@ -436,6 +748,10 @@ pgsm_post_parse_analyze_internal(ParseState *pstate, Query *query, JumbleState *
 		}
 	}
 
+	/* Decide whether the statement is tracked before doing any work for it */
+	if (nesting_level == 0)
+		pgsm_sample_query(query->queryId, true, query->utilityStmt != NULL);
+
 	if (!pgsm_enabled(nesting_level))
 		return;
 
@@ -482,16 +798,23 @@ pgsm_post_parse_analyze_internal(ParseState *pstate, Query *query, JumbleState *
 
 	norm_query_len = query_len;
 
-	/* Generate a normalized query */
+	/*
+	 * Generate a normalized query, unless the same statement has been
+	 * normalized already with other constants.
+	 */
 	if (jstate && jstate->clocations_count > 0 && (pgsm_enable_pgsm_query_id || pgsm_normalized_query))
 	{
-		norm_query = generate_normalized_query(jstate,
-											   query_text,	/* query */
-											   location,	/* query location */
-											   &norm_query_len,
-											   GetDatabaseEncoding());
+		norm_cached = pgsm_norm_cache_lookup(query->queryId, jstate, query_text, location, query_len);
+		if (norm_cached == NULL)
+		{
+			norm_query = generate_normalized_query(jstate,
+												   query_text,	/* query */
+												   location,	/* query location */
+												   &norm_query_len,
+												   GetDatabaseEncoding());
 
-		Assert(norm_query);
+			Assert(norm_query);
+		}
 	}
 
 	/*
@@ -506,7 +829,26 @@ pgsm_post_parse_analyze_internal(ParseState *pstate, Query *query, JumbleState *
 	 * Update other member that are not counters, so that we don't have to
 	 * worry about these.
 	 */
-	entry->pgsm_query_id = get_pgsm_query_id_hash(norm_query ? norm_query : query_text, norm_query_len);
+	if (norm_cached)
+	{
+		/* pgsm_enable_pgsm_query_id may have changed since it was cached */
+		if (!pgsm_enable_pgsm_query_id)
+			entry->pgsm_query_id = 0;
+		else
+		{
+			if (norm_cached->pgsm_query_id == 0)
+				norm_cached->pgsm_query_id = get_pgsm_query_id_hash(norm_cached->norm_query,
+																	norm_cached->norm_query_len);
+			entry->pgsm_query_id = norm_cached->pgsm_query_id;
+		}
+	}
+	else
+	{
+		entry->pgsm_query_id = get_pgsm_query_id_hash(norm_query ? norm_query : query_text, norm_query_len);
+		if (norm_query)
+			pgsm_norm_cache_insert(query->queryId, jstate, query_text, location, query_len,
+								   norm_query, norm_query_len, entry->pgsm_query_id);
+	}
 	entry->counters.info.cmd_type = query->commandType;
 
 	/*
@@ -519,7 +861,9 @@ pgsm_post_parse_analyze_internal(ParseState *pstate, Query *query, JumbleState *
 	 * In case of query_text, request the function to duplicate it so that it
 	 * is put in the relevant memory context.
 	 */
-	if (pgsm_normalized_query && norm_query)
+	if (pgsm_normalized_query && norm_cached)
+		pgsm_add_to_list(entry, norm_cached->norm_query, norm_cached->norm_query_len);
+	else if (pgsm_normalized_query && norm_query)
 		pgsm_add_to_list(entry, norm_query, norm_query_len);
 	else
 	{
@@ -527,7 +871,7 @@ pgsm_post_parse_analyze_internal(ParseState *pstate, Query *query, JumbleState *
 	}
 
 	/* Check that we've not exceeded max_stack_depth */
-	Assert(list_length(lentries) <= max_stack_depth);
+	Assert(lentries == NULL || lentries->members <= max_stack_depth);
 
 	if (norm_query)
 		pfree(norm_query);
@@ -567,8 +911,11 @@ pgsm_post_parse_analyze(ParseState *pstate, Query *query)
 static void
 pgsm_ExecutorStart(QueryDesc *queryDesc, int eflags)
 {
-	if (getrusage(RUSAGE_SELF, &rusage_start) != 0)
-		elog(DEBUG1, "[pg_stat_monitor] pgsm_ExecutorStart: failed to execute getrusage.");
+	if (nesting_level == 0)
+		pgsm_sample_query(queryDesc->plannedstmt->queryId, false, false);
+
+	if (pgsm_enabled(nesting_level))
+		pgsm_cpu_time_start();
 
 	if (prev_ExecutorStart)
 		prev_ExecutorStart(queryDesc, eflags);
@@ -614,7 +961,7 @@ pgsm_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count,
 	if (nesting_level >= 0 && nesting_level < max_stack_depth)
 	{
 		nested_queryids[nesting_level] = queryDesc->plannedstmt->queryId;
-		nested_query_txts[nesting_level] = strdup(queryDesc->sourceText);
+		nested_query_txts[nesting_level] = queryDesc->sourceText;
 	}
 
 	nesting_level++;
@@ -628,8 +975,6 @@ pgsm_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count,
 		if (nesting_level >= 0 && nesting_level < max_stack_depth)
 		{
 			nested_queryids[nesting_level] = UINT64CONST(0);
-			if (nested_query_txts[nesting_level])
-				free(nested_query_txts[nesting_level]);
 			nested_query_txts[nesting_level] = NULL;
 		}
 	}
@@ -639,8 +984,6 @@ pgsm_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count,
 		if (nesting_level >= 0 && nesting_level < max_stack_depth)
 		{
 			nested_queryids[nesting_level] = UINT64CONST(0);
-			if (nested_query_txts[nesting_level])
-				free(nested_query_txts[nesting_level]);
 			nested_query_txts[nesting_level] = NULL;
 		}
 		PG_RE_THROW();
@@ -693,6 +1036,233 @@ pgsm_explain(QueryDesc *queryDesc)
 	return es->str->data;
 }
 
+#define PLAN_JUMBLE_FIELD(item) \
+	pgsm_plan_jumble_append(jumble, &(item), sizeof(item))
+
+/*
+ * Compute the planid of a statement from the shape of its plan tree: the
+ * node types, the relations and indexes scanned, and the join and
+ * aggregation strategies. This is much cheaper than producing the EXPLAIN
+ * text, which is only needed the first time a plan is stored. Like the
+ * queryid, it doesn't depend on the constants of the statement.
+ */
+static uint64
+pgsm_plan_fingerprint(PlannedStmt *stmt)
+{
+	pgsmPlanJumble jumble;
+	ListCell   *lc;
+	uint64		planid;
+
+	jumble.len = 0;
+	pgsm_plan_jumble(&jumble, stmt->planTree, stmt->rtable);
+
+	/* Subplans are referenced by their position in this list */
+	foreach(lc, stmt->subplans)
+		pgsm_plan_jumble(&jumble, (Plan *) lfirst(lc), stmt->rtable);
+
+	planid = DatumGetUInt64(hash_any_extended(jumble.buf, jumble.len, 0));
+
+	/* 0 means there is no plan */
+	return (planid == 0) ? 1 : planid;
+}
+
+static void
+pgsm_plan_jumble_append(pgsmPlanJumble *jumble, const void *item, Size size)
+{
+	const unsigned char *p = item;
+
+	while (size > 0)
+	{
+		Size		part;
+
+		/* Replace a full buffer with its hash, as the query jumbling does */
+		if (jumble->len >= PLAN_JUMBLE_SIZE)
+		{
+			uint64		start_hash;
+
+			start_hash = DatumGetUInt64(hash_any_extended(jumble->buf, PLAN_JUMBLE_SIZE, 0));
+			memcpy(jumble->buf, &start_hash, sizeof(start_hash));
+			jumble->len = sizeof(start_hash);
+		}
+
+		part = Min(size, PLAN_JUMBLE_SIZE - jumble->len);
+		memcpy(jumble->buf + jumble->len, p, part);
+		jumble->len += part;
+		p += part;
+		size -= part;
+	}
+}
+
+static void
+pgsm_plan_jumble_list(pgsmPlanJumble *jumble, List *plans, List *rtable)
+{
+	ListCell   *lc;
+
+	foreach(lc, plans)
+		pgsm_plan_jumble(jumble, (Plan *) lfirst(lc), rtable);
+}
+
+static void
+pgsm_plan_jumble(pgsmPlanJumble *jumble, Plan *plan, List *rtable)
+{
+	NodeTag		tag;
+	Index		scanrelid = 0;
+
+	/* Keep the number of nodes below each node apart from its siblings */
+	if (plan == NULL)
+	{
+		tag = T_Invalid;
+		PLAN_JUMBLE_FIELD(tag);
+		return;
+	}
+
+	check_stack_depth();
+
+	tag = nodeTag(plan);
+	PLAN_JUMBLE_FIELD(tag);
+
+	switch (tag)
+	{
+		case T_SeqScan:
+		case T_SampleScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+#if PG_VERSION_NUM >= 140000
+		case T_TidRangeScan:
+#endif
+		case T_ForeignScan:
+			scanrelid = ((Scan *) plan)->scanrelid;
+			break;
+		case T_IndexScan:
+			scanrelid = ((Scan *) plan)->scanrelid;
+			PLAN_JUMBLE_FIELD(((IndexScan *) plan)->indexid);
+			PLAN_JUMBLE_FIELD(((IndexScan *) plan)->indexorderdir);
+			break;
+		case T_IndexOnlyScan:
+			scanrelid = ((Scan *) plan)->scanrelid;
+			PLAN_JUMBLE_FIELD(((IndexOnlyScan *) plan)->indexid);
+			PLAN_JUMBLE_FIELD(((IndexOnlyScan *) plan)->indexorderdir);
+			break;
+		case T_BitmapIndexScan:
+			PLAN_JUMBLE_FIELD(((BitmapIndexScan *) plan)->indexid);
+			break;
+		case T_CustomScan:
+			scanrelid = ((Scan *) plan)->scanrelid;
+			pgsm_plan_jumble_list(jumble, ((CustomScan *) plan)->custom_plans, rtable);
+			break;
+		case T_SubqueryScan:
+			pgsm_plan_jumble(jumble, ((SubqueryScan *) plan)->subplan, rtable);
+			break;
+		case T_NestLoop:
+		case T_MergeJoin:
+		case T_HashJoin:
+			PLAN_JUMBLE_FIELD(((Join *) plan)->jointype);
+			break;
+		case T_Agg:
+			PLAN_JUMBLE_FIELD(((Agg *) plan)->aggstrategy);
+			break;
+		case T_SetOp:
+			PLAN_JUMBLE_FIELD(((SetOp *) plan)->cmd);
+			PLAN_JUMBLE_FIELD(((SetOp *) plan)->strategy);
+			break;
+		case T_ModifyTable:
+			PLAN_JUMBLE_FIELD(((ModifyTable *) plan)->operation);
+			break;
+		case T_Append:
+			pgsm_plan_jumble_list(jumble, ((Append *) plan)->appendplans, rtable);
+			break;
+		case T_MergeAppend:
+			pgsm_plan_jumble_list(jumble, ((MergeAppend *) plan)->mergeplans, rtable);
+			break;
+		case T_BitmapAnd:
+			pgsm_plan_jumble_list(jumble, ((BitmapAnd *) plan)->bitmapplans, rtable);
+			break;
+		case T_BitmapOr:
+			pgsm_plan_jumble_list(jumble, ((BitmapOr *) plan)->bitmapplans, rtable);
+			break;
+		default:
+			break;
+	}
+
+	/* The relation rather than its range table index, as EXPLAIN shows */
+	if (scanrelid > 0 && scanrelid <= list_length(rtable))
+	{
+		RangeTblEntry *rte = rt_fetch(scanrelid, rtable);
+
+		if (rte->rtekind == RTE_RELATION)
+			PLAN_JUMBLE_FIELD(rte->relid);
+	}
+
+	pgsm_plan_jumble(jumble, plan->lefttree, rtable);
+	pgsm_plan_jumble(jumble, plan->righttree, rtable);
+}
+
+/*
+ * Return whether this backend has already stored the plan text of the entry
+ * with the given key, see pgsm_plan_set_seen(). Any removal of entries from
+ * the shared hash bumps plan_epoch, after which all the plans are stored
+ * again.
+ */
+static bool
+pgsm_plan_seen(pgsmHashKey *key)
+{
+	pgsmSharedState *pgsm;
+	pgsmHashKey seen_key;
+	pgsmPlanSeenEntry *seen;
+
+	/* Without the shared state, there is nothing to store the plan in */
+	if (!IsSystemInitialized())
+		return true;
+
+	if (plan_seen_cache == NULL)
+		return false;
+
+	/* The key as pgsm_store() will complete it, minus the bucket */
+	memcpy(&seen_key, key, sizeof(pgsmHashKey));
+	seen_key.bucket_id = 0;
+	if (pgsm_track == PGSM_TRACK_ALL && nesting_level > 0 && nesting_level < max_stack_depth)
+		seen_key.parentid = nested_queryids[nesting_level - 1];
+	else
+		seen_key.parentid = UINT64CONST(0);
+
+	pgsm = pgsm_get_ss();
+	seen = (pgsmPlanSeenEntry *) hash_search(plan_seen_cache, &seen_key, HASH_FIND, NULL);
+	return (seen != NULL && seen->epoch == pg_atomic_read_u64(&pgsm->plan_epoch));
+}
+
+/*
+ * Remember that the plan text of the shared entry with the given key is
+ * stored. The epoch must have been read while the entry was known to hold
+ * the text, that is under its partition lock.
+ */
+static void
+pgsm_plan_set_seen(pgsmHashKey *key, uint64 epoch)
+{
+	pgsmHashKey seen_key;
+	pgsmPlanSeenEntry *seen;
+
+	if (plan_seen_cache == NULL ||
+		hash_get_num_entries(plan_seen_cache) >= PGSM_PLAN_SEEN_MAX)
+	{
+		HASHCTL		info;
+
+		if (plan_seen_cache != NULL)
+			hash_destroy(plan_seen_cache);
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(pgsmHashKey);
+		info.entrysize = sizeof(pgsmPlanSeenEntry);
+		info.hcxt = TopMemoryContext;
+		plan_seen_cache = hash_create("pg_stat_monitor plans", 64, &info,
+									  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	memcpy(&seen_key, key, sizeof(pgsmHashKey));
+	seen_key.bucket_id = 0;
+	seen = (pgsmPlanSeenEntry *) hash_search(plan_seen_cache, &seen_key, HASH_ENTER, NULL);
+	seen->epoch = epoch;
+}
+
 /*
  * ExecutorEnd hook: store results if needed
  */
@@ -705,33 +1275,16 @@ pgsm_ExecutorEnd(QueryDesc *queryDesc)
 	PlanInfo   *plan_ptr = NULL;
 	pgsmEntry  *entry = NULL;
 
-	/* Extract the plan information in case of SELECT statement */
-	if (queryDesc->operation == CMD_SELECT && pgsm_enable_query_plan)
+	/*
+	 * Identify the plan in case of SELECT statement. Its text is only added
+	 * below if it hasn't been stored yet.
+	 */
+	if (queryDesc->operation == CMD_SELECT && pgsm_enable_query_plan && pgsm_enabled(nesting_level))
 	{
-		int			rv;
-		MemoryContext oldctx;
-
-		/*
-		 * Making sure it is a per query context so that there's no memory
-		 * leak when executor ends.
-		 */
-		oldctx = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
-
-		rv = snprintf(plan_info.plan_text, PLAN_TEXT_LEN, "%s", pgsm_explain(queryDesc));
-
-		/*
-		 * If snprint didn't write anything or there was an error, let's keep
-		 * planinfo as NULL.
-		 */
-		if (rv > 0)
-		{
-			plan_info.plan_len = (rv < PLAN_TEXT_LEN) ? rv : PLAN_TEXT_LEN - 1;
-			plan_info.planid = pgsm_hash_string(plan_info.plan_text, plan_info.plan_len);
-			plan_ptr = &plan_info;
-		}
-
-		/* Switch back to old context */
-		MemoryContextSwitchTo(oldctx);
+		plan_info.planid = pgsm_plan_fingerprint(queryDesc->plannedstmt);
+		plan_info.plan_len = 0;
+		plan_info.plan_text[0] = '\0';
+		plan_ptr = &plan_info;
 	}
 
 	if (queryId != UINT64CONST(0) && queryDesc->totaltime && pgsm_enabled(nesting_level))
@@ -746,30 +1299,43 @@ pgsm_ExecutorEnd(QueryDesc *queryDesc)
 		if (entry->key.planid == 0)
 			entry->key.planid = (plan_ptr) ? plan_ptr->planid : 0;
 
+		if (plan_ptr && plan_ptr->planid == entry->key.planid && !pgsm_plan_seen(&entry->key))
+		{
+			int			rv;
+			MemoryContext oldctx;
+
+			/*
+			 * Making sure it is a per query context so that there's no memory
+			 * leak when executor ends.
+			 */
+			oldctx = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
+
+			rv = snprintf(plan_info.plan_text, PLAN_TEXT_LEN, "%s", pgsm_explain(queryDesc));
+
+			/*
+			 * If snprint didn't write anything or there was an error, let's
+			 * keep the plan text empty.
+			 */
+			if (rv > 0)
+				plan_info.plan_len = (rv < PLAN_TEXT_LEN) ? rv : PLAN_TEXT_LEN - 1;
+
+			/* Switch back to old context */
+			MemoryContextSwitchTo(oldctx);
+		}
+
 		/*
 		 * Make sure stats accumulation is done.  (Note: it's okay if several
 		 * levels of hook all do this.)
 		 */
 		InstrEndLoop(queryDesc->totaltime);
 
-		sys_info.utime = 0;
-		sys_info.stime = 0;
-
-		if (getrusage(RUSAGE_SELF, &rusage_end) != 0)
-			elog(DEBUG1, "[pg_stat_monitor] pgsm_ExecutorEnd: Failed to execute getrusage.");
-		else
-		{
-			sys_info.utime = time_diff(rusage_end.ru_utime, rusage_start.ru_utime);
-			sys_info.stime = time_diff(rusage_end.ru_stime, rusage_start.ru_stime);
-		}
+		pgsm_cpu_time_end(&sys_info);
 
 		pgsm_update_entry(entry,	/* entry */
+						  entry->meta.meta_pointer,	/* meta */
 						  NULL, /* query */
-						  NULL, /* comments */
-						  0,	/* comments length */
 						  plan_ptr, /* PlanInfo */
 						  &sys_info,	/* SysInfo */
-						  NULL, /* ErrorInfo */
 						  0,	/* plan_total_time */
 						  queryDesc->totaltime->total * 1000.0, /* exec_total_time */
 						  queryDesc->estate->es_processed,	/* rows */
@@ -808,7 +1374,6 @@ pgsm_ExecutorCheckPerms(List *rt, List *rp, bool abort)
 	ListCell   *lr = NULL;
 	int			i = 0;
 	int			j = 0;
-	Oid			list_oid[20];
 
 	num_relations = 0;
 
@@ -829,22 +1394,26 @@ pgsm_ExecutorCheckPerms(List *rt, List *rp, bool abort)
 
 			for (j = 0; j < i; j++)
 			{
-				if (list_oid[j] == rte->relid)
+				if (relations[j].relid == rte->relid)
 					found = true;
 			}
 
+			/*
+			 * The name is kept for when it can't be looked up while reading
+			 * the view, in other databases or once the relation is gone.
+			 */
 			if (!found)
 			{
-				char	   *namespace_name;
-				char	   *relation_name;
+				const char *name;
 
-				list_oid[j] = rte->relid;
-				namespace_name = get_namespace_name(get_rel_namespace(rte->relid));
-				relation_name = get_rel_name(rte->relid);
-				if (rte->relkind == 'v')
-					snprintf(relations[i++], REL_LEN, "%s.%s*", namespace_name, relation_name);
-				else
-					snprintf(relations[i++], REL_LEN, "%s.%s", namespace_name, relation_name);
+				if (relname_cache == NULL)
+					pgsm_init_name_cache();
+				name = pgsm_cached_name(relname_cache, rte->relid);
+
+				relations[i].relid = rte->relid;
+				relations[i].is_view = (rte->relkind == 'v');
+				strlcpy(relations[i].name, name ? name : "", sizeof(relations[i].name));
+				i++;
 			}
 		}
 	}
@@ -881,6 +1450,9 @@ pgsm_planner_hook(Query *parse, const char *query_string, int cursorOptions, Par
 	 */
 
 	bool		enabled;
+
+	pgsm_push_down_filters(parse);
+
 #if PG_VERSION_NUM >= 170000
 	enabled = pgsm_enabled(nesting_level);
 #else
@@ -953,12 +1525,10 @@ pgsm_planner_hook(Query *parse, const char *query_string, int cursorOptions, Par
 		/* The plan details are captured when the query finishes */
 		if (entry)
 			pgsm_update_entry(entry,	/* entry */
+							  entry->meta.meta_pointer,	/* meta */
 							  NULL, /* query */
-							  NULL, /* comments */
-							  0,	/* comments length */
 							  NULL, /* PlanInfo */
 							  NULL, /* SysInfo */
-							  NULL, /* ErrorInfo */
 							  INSTR_TIME_GET_MILLISEC(duration),	/* plan_total_time */
 							  0,	/* exec_total_time */
 							  0,	/* rows */
@@ -1040,7 +1610,7 @@ pgsm_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 {
 	Node	   *parsetree = pstmt->utilityStmt;
 	uint64		queryId = 0;
-	bool		enabled = pgsm_track_utility && pgsm_enabled(nesting_level);
+	bool		enabled;
 
 #if PG_VERSION_NUM < 140000
 	int			len = strlen(queryString);
@@ -1048,7 +1618,13 @@ pgsm_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 	queryId = pgsm_hash_string(queryString, len);
 #else
 	queryId = pstmt->queryId;
+#endif
 
+	if (nesting_level == 0)
+		pgsm_sample_query(queryId, false, true);
+	enabled = pgsm_track_utility && pgsm_enabled(nesting_level);
+
+#if PG_VERSION_NUM >= 140000
 	/*
 	 * Force utility statements to get queryId zero.  We do this even in cases
 	 * where the statement contains an optimizable statement for which a
@@ -1097,8 +1673,7 @@ pgsm_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 		WalUsage	walusage_start = pgWalUsage;
 #endif
 
-		if (getrusage(RUSAGE_SELF, &rusage_start) != 0)
-			elog(DEBUG1, "[pg_stat_monitor] pgsm_ProcessUtility: Failed to execute getrusage.");
+		pgsm_cpu_time_start();
 
 		INSTR_TIME_SET_CURRENT(start);
 		nesting_level++;
@@ -1149,18 +1724,9 @@ pgsm_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 			PG_RE_THROW();
 		}
 
-		sys_info.utime = 0;
-		sys_info.stime = 0;
-
 		PG_END_TRY();
 
-		if (getrusage(RUSAGE_SELF, &rusage_end) != 0)
-			elog(DEBUG1, "[pg_stat_monitor] pgsm_ProcessUtility: Failed to execute getrusage.");
-		else
-		{
-			sys_info.utime = time_diff(rusage_end.ru_utime, rusage_start.ru_utime);
-			sys_info.stime = time_diff(rusage_end.ru_stime, rusage_start.ru_stime);
-		}
+		pgsm_cpu_time_end(&sys_info);
 
 		INSTR_TIME_SET_CURRENT(duration);
 		INSTR_TIME_SUBTRACT(duration, start);
@@ -1204,16 +1770,14 @@ pgsm_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 		pgsm_add_to_list(entry, query_text, query_len);
 
 		/* Check that we've not exceeded max_stack_depth */
-		Assert(list_length(lentries) <= max_stack_depth);
+		Assert(lentries == NULL || lentries->members <= max_stack_depth);
 
 		/* The plan details are captured when the query finishes */
 		pgsm_update_entry(entry,	/* entry */
+						  entry->meta.meta_pointer,	/* meta */
 						  (char *) query_text,	/* query */
-						  NULL, /* comments */
-						  0,	/* comments length */
 						  NULL, /* PlanInfo */
 						  &sys_info,	/* SysInfo */
-						  NULL, /* ErrorInfo */
 						  0,	/* plan_total_time */
 						  INSTR_TIME_GET_MILLISEC(duration),	/* exec_total_time */
 						  rows, /* rows */
@@ -1400,6 +1964,28 @@ pg_get_application_name(char *name, int buff_size)
 	return strlen(name);
 }
 
+/*
+ * Check whether the application_name GUC changed since the cached application
+ * name was computed, and remember its current value if so. Setting the GUC
+ * always stores a new copy of the string, so a different pointer is a change.
+ * The same pointer may still be a new string that reuses the memory of an old
+ * one, which the comparison with the remembered value catches. Only the part
+ * of the name that ends up in the entry is compared.
+ */
+static bool
+pgsm_application_name_changed(void)
+{
+	const char *guc = application_name ? application_name : "";
+
+	if (guc == app_name_guc_ptr &&
+		strncmp(guc, app_name_guc, APPLICATIONNAME_LEN - 1) == 0)
+		return false;
+
+	app_name_guc_ptr = guc;
+	strlcpy(app_name_guc, guc, APPLICATIONNAME_LEN);
+	return true;
+}
+
 static uint
 pg_get_client_addr(bool *ok)
 {
@@ -1430,12 +2016,10 @@ pg_get_client_addr(bool *ok)
 
 static void
 pgsm_update_entry(pgsmEntry *entry,
+				  pgsmEntryMeta *meta,
 				  const char *query,
-				  char *comments,
-				  int comments_len,
 				  PlanInfo *plan_info,
 				  SysInfo *sys_info,
-				  ErrorInfo *error_info,
 				  double plan_total_time,
 				  double exec_total_time,
 				  uint64 rows,
@@ -1447,8 +2031,6 @@ pgsm_update_entry(pgsmEntry *entry,
 {
 	int			index;
 	double		old_mean;
-	int			message_len = error_info ? strlen(error_info->message) : 0;
-	int			sqlcode_len = error_info ? strlen(error_info->sqlcode) : 0;
 	int			plan_text_len = plan_info ? plan_info->plan_len : 0;
 
 	/*
@@ -1465,17 +2047,18 @@ pgsm_update_entry(pgsmEntry *entry,
 	/* volatile block */
 	{
 		volatile pgsmEntry *e = (volatile pgsmEntry *) entry;
+		pgsmSharedState *pgsm = (kind == PGSM_STORE) ? pgsm_get_ss() : NULL;
 
 		if (kind == PGSM_STORE)
+		{
 			SpinLockAcquire(&e->mutex);
 
-		/*
-		 * Extract comments if enabled and only when the query has completed
-		 * with or without error
-		 */
-		if (pgsm_extract_comments && kind == PGSM_STORE
-			&& !e->counters.info.comments[0] && comments_len > 0)
-			_snprintf(e->counters.info.comments, comments, comments_len + 1, COMMENTS_LEN);
+			/*
+			 * Read under the mutex, so that a reader that has taken its cursor
+			 * either sees these changes or a generation after its cursor.
+			 */
+			e->generation = pg_atomic_read_u64(&pgsm->generation);
+		}
 
 		if (kind == PGSM_PLAN || kind == PGSM_STORE)
 		{
@@ -1483,6 +2066,7 @@ pgsm_update_entry(pgsmEntry *entry,
 				e->counters.plancalls.usage = USAGE_INIT;
 
 			e->counters.plancalls.calls += 1;
+			e->counters.plancalls.weight += pgsm_sample_weight;
 			e->counters.plantime.total_time += plan_total_time;
 
 			if (e->counters.plancalls.calls == 1)
@@ -1514,6 +2098,7 @@ pgsm_update_entry(pgsmEntry *entry,
 				e->counters.calls.usage = USAGE_INIT;
 
 			e->counters.calls.calls += 1;
+			e->counters.calls.weight += pgsm_sample_weight;
 			e->counters.time.total_time += exec_total_time;
 
 			if (e->counters.calls.calls == 1)
@@ -1541,22 +2126,16 @@ pgsm_update_entry(pgsmEntry *entry,
 			e->counters.resp_calls[index]++;
 		}
 
-		if (plan_text_len > 0 && !e->counters.planinfo.plan_text[0])
+		if (plan_text_len > 0 && meta && !meta->planinfo.plan_text[0])
 		{
-			e->counters.planinfo.planid = plan_info->planid;
-			e->counters.planinfo.plan_len = plan_text_len;
-			_snprintf(e->counters.planinfo.plan_text, plan_info->plan_text, plan_text_len + 1, PLAN_TEXT_LEN);
+			meta->planinfo.planid = plan_info->planid;
+			meta->planinfo.plan_len = plan_text_len;
+			_snprintf(meta->planinfo.plan_text, plan_info->plan_text, plan_text_len + 1, PLAN_TEXT_LEN);
 		}
 
 		/* Only should process this once when storing the data */
 		if (kind == PGSM_STORE)
 		{
-			if (pgsm_track_application_names && app_name_len > 0 && !e->counters.info.application_name[0])
-				_snprintf(e->counters.info.application_name, app_name, app_name_len + 1, APPLICATIONNAME_LEN);
-
-			e->counters.info.num_relations = num_relations;
-			_snprintf2(e->counters.info.relations, relations, num_relations, REL_LEN);
-
 			if (nesting_level > 0 && nesting_level < max_stack_depth && e->key.parentid != 0 && pgsm_track == PGSM_TRACK_ALL)
 			{
 				if (!DsaPointerIsValid(e->counters.info.parent_query))
@@ -1594,13 +2173,6 @@ pgsm_update_entry(pgsmEntry *entry,
 			}
 		}
 
-		if (error_info)
-		{
-			e->counters.error.elevel = error_info->elevel;
-			_snprintf(e->counters.error.sqlcode, error_info->sqlcode, sqlcode_len, SQLCODE_LEN);
-			_snprintf(e->counters.error.message, error_info->message, message_len, ERROR_MESSAGE_LEN);
-		}
-
 		e->counters.calls.rows += rows;
 
 		if (bufusage)
@@ -1631,21 +2203,24 @@ pgsm_update_entry(pgsmEntry *entry,
 			e->counters.blocks.temp_blk_write_time += INSTR_TIME_GET_MILLISEC(bufusage->temp_blk_write_time);
 #endif
 
+			/* Only do this for local storage scenarios */
+			if (kind != PGSM_STORE)
+			{
 #if PG_VERSION_NUM < 170000
-			memcpy((void *) &e->counters.blocks.instr_shared_blk_read_time, &bufusage->blk_read_time, sizeof(instr_time));
-			memcpy((void *) &e->counters.blocks.instr_shared_blk_write_time, &bufusage->blk_write_time, sizeof(instr_time));
+				memcpy((void *) &meta->instr.instr_shared_blk_read_time, &bufusage->blk_read_time, sizeof(instr_time));
+				memcpy((void *) &meta->instr.instr_shared_blk_write_time, &bufusage->blk_write_time, sizeof(instr_time));
 #else
-			memcpy((void *) &e->counters.blocks.instr_shared_blk_read_time, &bufusage->shared_blk_read_time, sizeof(instr_time));
-			memcpy((void *) &e->counters.blocks.instr_shared_blk_write_time, &bufusage->shared_blk_write_time, sizeof(instr_time));
-			memcpy((void *) &e->counters.blocks.instr_local_blk_write_time, &bufusage->local_blk_write_time, sizeof(instr_time));
-			memcpy((void *) &e->counters.blocks.instr_local_blk_write_time, &bufusage->local_blk_write_time, sizeof(instr_time));
+				memcpy((void *) &meta->instr.instr_shared_blk_read_time, &bufusage->shared_blk_read_time, sizeof(instr_time));
+				memcpy((void *) &meta->instr.instr_shared_blk_write_time, &bufusage->shared_blk_write_time, sizeof(instr_time));
+				memcpy((void *) &meta->instr.instr_local_blk_write_time, &bufusage->local_blk_write_time, sizeof(instr_time));
+				memcpy((void *) &meta->instr.instr_local_blk_write_time, &bufusage->local_blk_write_time, sizeof(instr_time));
 #endif
 
-
 #if PG_VERSION_NUM >= 150000
-			memcpy((void *) &e->counters.blocks.instr_temp_blk_read_time, &bufusage->temp_blk_read_time, sizeof(bufusage->temp_blk_read_time));
-			memcpy((void *) &e->counters.blocks.instr_temp_blk_write_time, &bufusage->temp_blk_write_time, sizeof(bufusage->temp_blk_write_time));
+				memcpy((void *) &meta->instr.instr_temp_blk_read_time, &bufusage->temp_blk_read_time, sizeof(bufusage->temp_blk_read_time));
+				memcpy((void *) &meta->instr.instr_temp_blk_write_time, &bufusage->temp_blk_write_time, sizeof(bufusage->temp_blk_write_time));
 #endif
+			}
 		}
 
 		e->counters.calls.usage += USAGE_EXEC(exec_total_time + plan_total_time);
@@ -1687,13 +2262,13 @@ pgsm_update_entry(pgsmEntry *entry,
 			/* Only do this for local storage scenarios */
 			if (kind != PGSM_STORE)
 			{
-				memcpy((void *) &e->counters.jitinfo.instr_generation_counter, &jitusage->generation_counter, sizeof(instr_time));
-				memcpy((void *) &e->counters.jitinfo.instr_inlining_counter, &jitusage->inlining_counter, sizeof(instr_time));
-				memcpy((void *) &e->counters.jitinfo.instr_optimization_counter, &jitusage->optimization_counter, sizeof(instr_time));
-				memcpy((void *) &e->counters.jitinfo.instr_emission_counter, &jitusage->emission_counter, sizeof(instr_time));
+				memcpy((void *) &meta->instr.instr_generation_counter, &jitusage->generation_counter, sizeof(instr_time));
+				memcpy((void *) &meta->instr.instr_inlining_counter, &jitusage->inlining_counter, sizeof(instr_time));
+				memcpy((void *) &meta->instr.instr_optimization_counter, &jitusage->optimization_counter, sizeof(instr_time));
+				memcpy((void *) &meta->instr.instr_emission_counter, &jitusage->emission_counter, sizeof(instr_time));
 
 #if PG_VERSION_NUM >= 170000
-				memcpy((void *) &e->counters.jitinfo.instr_deform_counter, &jitusage->deform_counter, sizeof(instr_time));
+				memcpy((void *) &meta->instr.instr_deform_counter, &jitusage->deform_counter, sizeof(instr_time));
 #endif
 			}
 		}
@@ -1722,9 +2297,9 @@ pgsm_store_error(const char *query, ErrorData *edata)
 
 	entry->pgsm_query_id = get_pgsm_query_id_hash(query, len);
 
-	entry->counters.error.elevel = edata->elevel;
-	snprintf(entry->counters.error.message, ERROR_MESSAGE_LEN, "%s", edata->message);
-	snprintf(entry->counters.error.sqlcode, SQLCODE_LEN, "%s", unpack_sql_state(edata->sqlerrcode));
+	entry->meta.meta_pointer->error.elevel = edata->elevel;
+	snprintf(entry->meta.meta_pointer->error.message, ERROR_MESSAGE_LEN, "%s", edata->message);
+	snprintf(entry->meta.meta_pointer->error.sqlcode, SQLCODE_LEN, "%s", unpack_sql_state(edata->sqlerrcode));
 
 	pgsm_store(entry);
 }
@@ -1732,11 +2307,20 @@ pgsm_store_error(const char *query, ErrorData *edata)
 static void
 pgsm_add_to_list(pgsmEntry *entry, char *query_text, int query_len)
 {
+	pgsmLocalEntry *lentry;
+	bool		found;
+
 	/* Switch to pgsm memory context */
 	MemoryContext oldctx = MemoryContextSwitchTo(GetPgsmMemoryContext());
 
 	entry->query_text.query_pointer = pnstrdup(query_text, query_len);
-	lentries = lappend(lentries, entry);
+
+	if (lentries == NULL)
+		lentries = pgsm_lentries_create(GetPgsmMemoryContext(), 16, NULL);
+
+	/* A later statement with the same queryid takes over */
+	lentry = pgsm_lentries_insert(lentries, entry->key.queryid, &found);
+	lentry->entry = entry;
 	MemoryContextSwitchTo(oldctx);
 }
 
@@ -1744,25 +2328,15 @@ static pgsmEntry *
 pgsm_get_entry_for_query(uint64 queryid, PlanInfo *plan_info, const char *query_text, int query_len, bool create)
 {
 	pgsmEntry  *entry = NULL;
-	ListCell   *lc = NULL;
 
-	/* First bet is on the last entry */
-	if (lentries == NIL && !create)
-		return NULL;
-
-	if (lentries)
+	if (lentries != NULL)
 	{
-		entry = (pgsmEntry *) llast(lentries);
-		if (entry->key.queryid == queryid)
-			return entry;
+		pgsmLocalEntry *lentry = pgsm_lentries_lookup(lentries, queryid);
 
-		foreach(lc, lentries)
-		{
-			entry = lfirst(lc);
-			if (entry->key.queryid == queryid)
-				return entry;
-		}
+		if (lentry != NULL)
+			return lentry->entry;
 	}
+
 	if (create && query_text)
 	{
 		/*
@@ -1787,10 +2361,10 @@ pgsm_get_entry_for_query(uint64 queryid, PlanInfo *plan_info, const char *query_
 static void
 pgsm_cleanup_callback(void *arg)
 {
-	/* Reset the memory context holding the list */
+	/* Reset the memory context holding the local entries */
 	MemoryContextReset(GetPgsmMemoryContext());
 
-	lentries = NIL;
+	lentries = NULL;
 	callback_setup = false;
 }
 
@@ -1805,12 +2379,13 @@ pgsm_create_hash_entry(uint64 bucket_id, uint64 queryid, PlanInfo *plan_info)
 	int			sec_ctx;
 	bool		found_client_addr = false;
 	MemoryContext oldctx;
-	char	   *datname = NULL;
-	char	   *username = NULL;
+	pgsmEntryMeta *meta;
 
 	/* Create an entry in the pgsm memory context */
 	oldctx = MemoryContextSwitchTo(GetPgsmMemoryContext());
 	entry = palloc0(sizeof(pgsmEntry));
+	meta = palloc0(sizeof(pgsmEntryMeta));
+	entry->meta.meta_pointer = meta;
 
 	/*
 	 * Get the user ID. Let's use this instead of GetUserID as this won't
@@ -1820,9 +2395,13 @@ pgsm_create_hash_entry(uint64 bucket_id, uint64 queryid, PlanInfo *plan_info)
 
 	if (pgsm_track_application_names)
 	{
-		/* Get the application name and set appid */
-		app_name_len = pg_get_application_name(app_name, APPLICATIONNAME_LEN);
-		entry->key.appid = pgsm_hash_string((const char *) app_name, app_name_len);
+		/* Get the application name and set appid, if it has changed */
+		if (pgsm_application_name_changed())
+		{
+			app_name_len = pg_get_application_name(app_name, APPLICATIONNAME_LEN);
+			app_name_id = pgsm_hash_string((const char *) app_name, app_name_len);
+		}
+		entry->key.appid = app_name_id;
 	}
 
 	/* client address */
@@ -1850,29 +2429,497 @@ pgsm_create_hash_entry(uint64 bucket_id, uint64 queryid, PlanInfo *plan_info)
 #endif
 #endif
 
-	if (IsTransactionState())
+	MemoryContextSwitchTo(oldctx);
+
+	return entry;
+}
+
+
+/*
+ * Find the shared hash entry for the given local entry, creating it if it
+ * doesn't exist yet. On success the entry's partition lock is held on return
+ * and its hash code is stored in *hashcode. NULL is returned, without any
+ * lock held, if the entry couldn't be created.
+ */
+static pgsmEntry *
+pgsm_get_shared_entry(pgsmSharedState *pgsm, pgsmEntry *entry, const char *query, int query_len, uint32 *hashcode)
+{
+	pgsmEntry  *shared_hash_entry;
+	bool		found;
+	const char *datname;
+	const char *username;
+
+	/* Resolve the names before taking any lock, in case of a cache miss */
+	pgsm_lookup_names(entry->key.dbid, entry->key.userid, &datname, &username);
+
+	/*
+	 * Only the partition holding the key needs to be locked. Acquire a share
+	 * lock to start with. We'd have to acquire exclusive if we need to create
+	 * the entry.
+	 */
+	*hashcode = pgsm_hash_value(get_pgsmHash(), &entry->key);
+	pgsm_partition_lock_aquire(pgsm, *hashcode, LW_SHARED);
+	shared_hash_entry = (pgsmEntry *) pgsm_hash_find(get_pgsmHash(), &entry->key, *hashcode, &found);
+
+	if (!shared_hash_entry)
+	{
+		dsa_pointer dsa_query_pointer;
+		dsa_pointer dsa_meta_pointer;
+		dsa_area   *query_dsa_area = get_dsa_area_for_query_text();
+
+		/*
+		 * Copy the text and the metadata into the DSA area before the
+		 * exclusive lock is taken, so that the partition isn't locked while
+		 * allocating. Another backend may create the same entry meanwhile,
+		 * which is checked for once the lock is held.
+		 */
+		pgsm_partition_lock_release(pgsm, *hashcode);
+
+		/* New query, truncate length if necessary. */
+		if (query_len > pgsm_query_max_len)
+			query_len = pgsm_query_max_len;
+
+		/* Names are only copied once a new entry needs them */
+		strlcpy(entry->meta.meta_pointer->datname, datname, NAMEDATALEN);
+		strlcpy(entry->meta.meta_pointer->username, username, NAMEDATALEN);
+
+		/*
+		 * Get a reference to the query text in raw dsa area, it's only copied
+		 * if no other entry uses the same text yet. Without space for the
+		 * text or the metadata, the statistics are still accounted in the
+		 * overflow entry.
+		 */
+		dsa_query_pointer = pgsm_text_acquire(&entry->key, entry->pgsm_query_id, query, query_len);
+		if (!DsaPointerIsValid(dsa_query_pointer))
+			return pgsm_get_overflow_entry(pgsm, entry, hashcode);
+
+		/* The metadata of the entry lives next to the query text */
+		dsa_meta_pointer = pgsm_meta_pack(entry->meta.meta_pointer);
+		if (!DsaPointerIsValid(dsa_meta_pointer))
+		{
+			pgsm_text_release(&entry->key, entry->pgsm_query_id);
+			return pgsm_get_overflow_entry(pgsm, entry, hashcode);
+		}
+
+		pgsm_partition_lock_aquire(pgsm, *hashcode, LW_EXCLUSIVE);
+
+		/* OK to create a new hashtable entry */
+		PG_TRY();
+		{
+			shared_hash_entry = hash_entry_alloc(pgsm, &entry->key, *hashcode, GetDatabaseEncoding());
+
+			/*
+			 * If the hash is full, evict the least used entries of the
+			 * bucket rather than dropping new statements until the bucket
+			 * rotates.
+			 */
+			if (shared_hash_entry == NULL)
+			{
+				bool		evicted;
+
+				pgsm_partition_lock_release(pgsm, *hashcode);
+				evicted = hash_entry_evict(entry->key.bucket_id);
+				pgsm_partition_lock_aquire(pgsm, *hashcode, LW_EXCLUSIVE);
+
+				if (evicted)
+					shared_hash_entry = hash_entry_alloc(pgsm, &entry->key, *hashcode, GetDatabaseEncoding());
+			}
+		}
+		PG_CATCH();
+		{
+			pgsm_text_release(&entry->key, entry->pgsm_query_id);
+			dsa_free(query_dsa_area, dsa_meta_pointer);
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		if (shared_hash_entry == NULL)
+		{
+			pgsm_partition_lock_release(pgsm, *hashcode);
+
+			pgsm_text_release(&entry->key, entry->pgsm_query_id);
+			dsa_free(query_dsa_area, dsa_meta_pointer);
+
+			/*
+			 * Fold the statistics into the overflow entry of the database
+			 * and user, so that the totals of the bucket stay right.
+			 */
+			shared_hash_entry = pgsm_get_overflow_entry(pgsm, entry, hashcode);
+			if (shared_hash_entry != NULL)
+				return shared_hash_entry;
+
+			/*
+			 * Out of memory; report only if the state has changed now.
+			 * Otherwise we risk filling up the log file with these message.
+			 */
+			if (!IsSystemOOM())
+			{
+				pgsm->pgsm_oom = true;
+
+				disable_error_capture = true;
+				ereport(WARNING,
+						(errcode(ERRCODE_OUT_OF_MEMORY),
+						 errmsg("[pg_stat_monitor] pgsm_store: Hash table is out of memory and can no longer store queries!"),
+						 errdetail("You may reset the view or when the buckets are deallocated, pg_stat_monitor will resume saving " \
+								   "queries. Alternatively, try increasing the value of pg_stat_monitor.pgsm_max.")));
+				disable_error_capture = false;
+			}
+
+			return NULL;
+		}
+		else
+		{
+			/* If we got a new entry, reset the oom value false */
+			pgsm->pgsm_oom = false;
+		}
+
+		/*
+		 * If someone else created the entry in the meantime, drop ours. The
+		 * text reference must be released with the pgsm_query_id it was
+		 * taken with, so the entry keeps its own.
+		 */
+		if (DsaPointerIsValid(shared_hash_entry->query_text.query_pos))
+		{
+			pgsm_text_release(&entry->key, entry->pgsm_query_id);
+			dsa_free(query_dsa_area, dsa_meta_pointer);
+		}
+		else
+		{
+			shared_hash_entry->query_text.query_pos = dsa_query_pointer;
+			shared_hash_entry->meta.meta_pos = dsa_meta_pointer;
+			shared_hash_entry->pgsm_query_id = entry->pgsm_query_id;
+			shared_hash_entry->encoding = entry->encoding;
+			shared_hash_entry->counters.info.cmd_type = entry->counters.info.cmd_type;
+			shared_hash_entry->counters.info.parent_query = InvalidDsaPointer;
+		}
+	}
+
+	return shared_hash_entry;
+}
+
+/*
+ * Find the overflow entry for the bucket, database and user of the given
+ * local entry, creating it if it doesn't exist yet. Statements that couldn't
+ * get an entry of their own are accounted there. The entry's partition lock
+ * is held on return, and NULL is returned without any lock held if even the
+ * overflow entry couldn't be created.
+ */
+static pgsmEntry *
+pgsm_get_overflow_entry(pgsmSharedState *pgsm, pgsmEntry *entry, uint32 *hashcode)
+{
+	pgsmEntry  *shared_hash_entry;
+	pgsmHashKey key;
+
+	memset(&key, 0, sizeof(key));
+	key.bucket_id = entry->key.bucket_id;
+	key.userid = entry->key.userid;
+	key.dbid = entry->key.dbid;
+	key.toplevel = true;
+	key.overflow = true;
+
+	*hashcode = pgsm_hash_value(get_pgsmHash(), &key);
+	pgsm_partition_lock_aquire(pgsm, *hashcode, LW_EXCLUSIVE);
+
+	shared_hash_entry = hash_entry_alloc(pgsm, &key, *hashcode, GetDatabaseEncoding());
+	if (shared_hash_entry == NULL)
 	{
-		datname = get_database_name(entry->key.dbid);
-		username = GetUserNameFromId(entry->key.userid, true);
+		pgsm_partition_lock_release(pgsm, *hashcode);
+		return NULL;
+	}
+
+	/* Keep the names to show, the rest of the metadata is left out */
+	if (!DsaPointerIsValid(shared_hash_entry->meta.meta_pos))
+	{
+		pgsmEntryMeta *meta = palloc0(sizeof(pgsmEntryMeta));
+
+		strlcpy(meta->datname, entry->meta.meta_pointer->datname, sizeof(meta->datname));
+		strlcpy(meta->username, entry->meta.meta_pointer->username, sizeof(meta->username));
+		shared_hash_entry->meta.meta_pos = pgsm_meta_pack(meta);
+		pfree(meta);
 	}
 
-	if (!datname)
-		datname = pnstrdup("<database name not available>", sizeof(entry->datname) - 1);
+	return shared_hash_entry;
+}
+
+/*
+ * Copy the metadata of an entry into a chunk of the DSA area that's just
+ * large enough to hold it. Returns InvalidDsaPointer if there is no space
+ * left.
+ */
+static dsa_pointer
+pgsm_meta_pack(pgsmEntryMeta *meta)
+{
+	const char *strings[6];
+	int			lens[6];
+	int			max_lens[6];
+	int			nstrings = 0;
+	Size		rels_size = meta->num_relations * sizeof(pgsmRelation);
+	Size		size = offsetof(pgsmSharedMeta, data) + rels_size;
+	dsa_area   *query_dsa_area = get_dsa_area_for_query_text();
+	dsa_pointer pos;
+	pgsmSharedMeta *shared;
+	char	   *p;
+	int			i;
 
-	if (!username)
-		username = pnstrdup("<user name not available>", sizeof(entry->username) - 1);
+#define PGSM_META_STRING(_str) \
+	do { \
+		strings[nstrings] = (_str); \
+		max_lens[nstrings] = sizeof(_str) - 1; \
+		nstrings++; \
+	} while (0)
 
-	snprintf(entry->datname, sizeof(entry->datname), "%s", datname);
-	snprintf(entry->username, sizeof(entry->username), "%s", username);
+	/* Must match the order in pgsm_meta_unpack() */
+	PGSM_META_STRING(meta->datname);
+	PGSM_META_STRING(meta->username);
+	PGSM_META_STRING(meta->application_name);
+	PGSM_META_STRING(meta->comments);
+	PGSM_META_STRING(meta->planinfo.plan_text);
+	PGSM_META_STRING(meta->error.message);
 
-	pfree(datname);
-	pfree(username);
+#undef PGSM_META_STRING
 
-	MemoryContextSwitchTo(oldctx);
+	for (i = 0; i < nstrings; i++)
+	{
+		lens[i] = strnlen(strings[i], max_lens[i]);
+		size += lens[i] + 1;
+	}
 
-	return entry;
+	pos = dsa_allocate_extended(query_dsa_area, size, DSA_ALLOC_NO_OOM);
+	if (!DsaPointerIsValid(pos))
+		return InvalidDsaPointer;
+
+	shared = dsa_get_address(query_dsa_area, pos);
+	shared->elevel = meta->error.elevel;
+	memcpy(shared->sqlcode, meta->error.sqlcode, SQLCODE_LEN);
+	shared->sqlcode[SQLCODE_LEN - 1] = '\0';
+	shared->planid = meta->planinfo.planid;
+	shared->message_hash = pgsm_hash_string(meta->error.message, lens[nstrings - 1]);
+	shared->flags = (meta->comments[0] ? PGSM_META_COMMENTS : 0) |
+		(meta->application_name[0] ? PGSM_META_APPLICATION_NAME : 0) |
+		(meta->planinfo.plan_text[0] ? PGSM_META_PLAN : 0);
+	shared->num_relations = meta->num_relations;
+
+	/* data isn't aligned, the relations are only accessed with memcpy */
+	p = shared->data;
+	memcpy(p, meta->relations, rels_size);
+	p += rels_size;
+	for (i = 0; i < nstrings; i++)
+	{
+		memcpy(p, strings[i], lens[i]);
+		p[lens[i]] = '\0';
+		p += lens[i] + 1;
+	}
+
+	return pos;
+}
+
+/*
+ * Read the metadata of a shared entry. The caller must hold the partition
+ * lock of the entry.
+ */
+static void
+pgsm_meta_unpack(pgsmEntry *entry, pgsmEntryMeta *meta)
+{
+	pgsmSharedMeta *shared;
+	const char *p;
+
+	if (!DsaPointerIsValid(entry->meta.meta_pos))
+	{
+		memset(meta, 0, offsetof(pgsmEntryMeta, instr));
+		return;
+	}
+
+	shared = dsa_get_address(get_dsa_area_for_query_text(), entry->meta.meta_pos);
+	meta->error.elevel = shared->elevel;
+	memcpy(meta->error.sqlcode, shared->sqlcode, SQLCODE_LEN);
+	meta->planinfo.planid = shared->planid;
+	meta->num_relations = shared->num_relations;
+
+	p = shared->data;
+	memcpy(meta->relations, p, meta->num_relations * sizeof(pgsmRelation));
+	p += meta->num_relations * sizeof(pgsmRelation);
+
+	/* Each string has been truncated to fit when packing it */
+	strcpy(meta->datname, p);
+	p += strlen(p) + 1;
+	strcpy(meta->username, p);
+	p += strlen(p) + 1;
+	strcpy(meta->application_name, p);
+	p += strlen(p) + 1;
+	strcpy(meta->comments, p);
+	p += strlen(p) + 1;
+	meta->planinfo.plan_len = strlen(p);
+	strcpy(meta->planinfo.plan_text, p);
+	p += meta->planinfo.plan_len + 1;
+	strcpy(meta->error.message, p);
+}
+
+/*
+ * Merge the metadata of a newly stored call into the metadata of an entry.
+ * Comments, application name and plan are the first ones seen, relations
+ * are the ones of the last call, and the error is the one of the last call
+ * that failed. Returns whether anything changed.
+ */
+static bool
+pgsm_meta_merge(pgsmEntryMeta *dst, pgsmEntryMeta *src)
+{
+	bool		changed = false;
+	int			i;
+
+	if (!dst->comments[0] && src->comments[0])
+	{
+		strlcpy(dst->comments, src->comments, sizeof(dst->comments));
+		changed = true;
+	}
+
+	if (!dst->application_name[0] && src->application_name[0])
+	{
+		strlcpy(dst->application_name, src->application_name, sizeof(dst->application_name));
+		changed = true;
+	}
+
+	if (!dst->planinfo.plan_text[0] && src->planinfo.plan_text[0])
+	{
+		memcpy(&dst->planinfo, &src->planinfo, sizeof(PlanInfo));
+		changed = true;
+	}
+
+	for (i = 0; i < src->num_relations; i++)
+	{
+		if (i >= dst->num_relations ||
+			dst->relations[i].relid != src->relations[i].relid ||
+			dst->relations[i].is_view != src->relations[i].is_view ||
+			strcmp(dst->relations[i].name, src->relations[i].name) != 0)
+		{
+			dst->relations[i] = src->relations[i];
+			changed = true;
+		}
+	}
+	if (dst->num_relations != src->num_relations)
+	{
+		dst->num_relations = src->num_relations;
+		changed = true;
+	}
+
+	/* A successful call keeps the error of the last one that failed */
+	if (src->error.elevel != 0 &&
+		(dst->error.elevel != src->error.elevel ||
+		 strcmp(dst->error.sqlcode, src->error.sqlcode) != 0 ||
+		 strcmp(dst->error.message, src->error.message) != 0))
+	{
+		memcpy(&dst->error, &src->error, sizeof(ErrorInfo));
+		changed = true;
+	}
+
+	return changed;
+}
+
+/*
+ * Whether merging the metadata of a newly stored call would change the
+ * metadata of a shared entry. Only the fixed part of the packed metadata is
+ * read, so that the usual case of nothing changing doesn't copy any strings.
+ * The caller must hold the partition lock of the entry.
+ */
+static bool
+pgsm_meta_changed(pgsmEntry *entry, pgsmEntryMeta *local)
+{
+	pgsmSharedMeta *shared;
+	pgsmRelation rel;
+	int			i;
+
+	if (!DsaPointerIsValid(entry->meta.meta_pos))
+		return true;
+
+	shared = dsa_get_address(get_dsa_area_for_query_text(), entry->meta.meta_pos);
+
+	if ((local->comments[0] && !(shared->flags & PGSM_META_COMMENTS)) ||
+		(local->application_name[0] && !(shared->flags & PGSM_META_APPLICATION_NAME)) ||
+		(local->planinfo.plan_text[0] && !(shared->flags & PGSM_META_PLAN)))
+		return true;
+
+	/* The relations come first in the packed data */
+	if (shared->num_relations != local->num_relations)
+		return true;
+	for (i = 0; i < local->num_relations; i++)
+	{
+		memcpy(&rel, shared->data + i * sizeof(pgsmRelation), sizeof(pgsmRelation));
+		if (rel.relid != local->relations[i].relid ||
+			rel.is_view != local->relations[i].is_view ||
+			strcmp(rel.name, local->relations[i].name) != 0)
+			return true;
+	}
+
+	if (local->error.elevel != 0 &&
+		(shared->elevel != local->error.elevel ||
+		 strcmp(shared->sqlcode, local->error.sqlcode) != 0 ||
+		 shared->message_hash != pgsm_hash_string(local->error.message, strlen(local->error.message))))
+		return true;
+
+	return false;
 }
 
+/*
+ * Merge the metadata of a local entry into its shared entry. Usually nothing
+ * changes, which only needs the partition lock the caller already holds in
+ * either mode. Otherwise the lock is upgraded to replace the metadata. The
+ * partition lock is released on return.
+ */
+static void
+pgsm_update_shared_meta(pgsmSharedState *pgsm, pgsmEntry *entry, uint32 hashcode, pgsmEntryMeta *local)
+{
+	pgsmEntryMeta meta;
+	pgsmHashKey key;
+	bool		found;
+	bool		plan_stored = false;
+	uint64		epoch = 0;
+
+	/* Overflow entries only keep the names they were created with */
+	if (entry->key.overflow)
+	{
+		pgsm_partition_lock_release(pgsm, hashcode);
+		return;
+	}
+
+	key = entry->key;
+	if (pgsm_meta_changed(entry, local))
+	{
+		pgsm_partition_lock_release(pgsm, hashcode);
+		pgsm_partition_lock_aquire(pgsm, hashcode, LW_EXCLUSIVE);
+
+		/* The entry may have been replaced or removed in the meantime */
+		entry = (pgsmEntry *) pgsm_hash_find(get_pgsmHash(), &key, hashcode, &found);
+		if (entry)
+		{
+			pgsm_meta_unpack(entry, &meta);
+			if (pgsm_meta_merge(&meta, local))
+			{
+				dsa_pointer pos = pgsm_meta_pack(&meta);
+
+				/* Keep the old metadata if there's no space left for the new one */
+				if (DsaPointerIsValid(pos))
+				{
+					if (DsaPointerIsValid(entry->meta.meta_pos))
+						dsa_free(get_dsa_area_for_query_text(), entry->meta.meta_pos);
+					entry->meta.meta_pos = pos;
+				}
+			}
+		}
+	}
+
+	/* The plan text is only seen once it's in the shared entry */
+	if (entry && local->planinfo.plan_text[0] && DsaPointerIsValid(entry->meta.meta_pos))
+	{
+		pgsmSharedMeta *shared = dsa_get_address(get_dsa_area_for_query_text(), entry->meta.meta_pos);
+
+		plan_stored = (shared->flags & PGSM_META_PLAN) != 0;
+		epoch = pg_atomic_read_u64(&pgsm->plan_epoch);
+	}
+
+	pgsm_partition_lock_release(pgsm, hashcode);
+
+	if (plan_stored)
+		pgsm_plan_set_seen(&key, epoch);
+}
 
 /*
  * Store some statistics for a statement.
@@ -1889,17 +2936,14 @@ pgsm_store(pgsmEntry *entry)
 {
 	pgsmEntry  *shared_hash_entry;
 	pgsmSharedState *pgsm;
-	bool		found;
+	uint32		hashcode;
 	uint64		bucketid;
-	uint64		prev_bucket_id;
-	bool		reset = false;	/* Only used in update function - HAMID */
 	char	   *query;
 	int			query_len;
 	BufferUsage bufusage;
 	WalUsage	walusage;
 	JitInstrumentation jitusage;
-	char		comments[COMMENTS_LEN] = {0};
-	int			comments_len;
+	pgsmEntryMeta *meta = entry->meta.meta_pointer;
 
 	/* Safety check... */
 	if (!IsSystemInitialized())
@@ -1907,19 +2951,33 @@ pgsm_store(pgsmEntry *entry)
 
 	pgsm = pgsm_get_ss();
 
-	prev_bucket_id = pg_atomic_read_u64(&pgsm->current_wbucket);
-	bucketid = get_next_wbucket(pgsm);
-
-	if (bucketid != prev_bucket_id)
-		reset = true;
+	/* Bucket rotation is done by the background worker */
+	bucketid = pg_atomic_read_u64(&pgsm->current_wbucket);
 
 	entry->key.bucket_id = bucketid;
 	query = entry->query_text.query_pointer;
 	query_len = strlen(query);
 
-	/* Let's do all the leg work here before we acquire any locks */
-	extract_query_comments(query, comments, sizeof(comments));
-	comments_len = strlen(comments);
+	/*
+	 * Let's do all the leg work here before we acquire any locks. The
+	 * metadata of the local entry is merged into the shared one later on.
+	 */
+	if (pgsm_extract_comments)
+	{
+		char		comments[COMMENTS_LEN] = {0};
+		int			comments_len;
+
+		extract_query_comments(query, query_len, comments, sizeof(comments));
+		comments_len = strlen(comments);
+		if (comments_len > 0)
+			_snprintf(meta->comments, comments, comments_len + 1, COMMENTS_LEN);
+	}
+
+	if (pgsm_track_application_names && app_name_len > 0)
+		_snprintf(meta->application_name, app_name, app_name_len + 1, APPLICATIONNAME_LEN);
+
+	meta->num_relations = num_relations;
+	memcpy(meta->relations, relations, num_relations * sizeof(pgsmRelation));
 
 	/* bufusage */
 	bufusage.shared_blks_hit = entry->counters.blocks.shared_blks_hit;
@@ -1934,18 +2992,18 @@ pgsm_store(pgsmEntry *entry)
 	bufusage.temp_blks_written = entry->counters.blocks.temp_blks_written;
 
 #if PG_VERSION_NUM < 170000
-	memcpy(&bufusage.blk_read_time, &entry->counters.blocks.instr_shared_blk_read_time, sizeof(instr_time));
-	memcpy(&bufusage.blk_write_time, &entry->counters.blocks.instr_shared_blk_write_time, sizeof(instr_time));
+	memcpy(&bufusage.blk_read_time, &meta->instr.instr_shared_blk_read_time, sizeof(instr_time));
+	memcpy(&bufusage.blk_write_time, &meta->instr.instr_shared_blk_write_time, sizeof(instr_time));
 #else
-	memcpy(&bufusage.shared_blk_read_time, &entry->counters.blocks.instr_shared_blk_read_time, sizeof(instr_time));
-	memcpy(&bufusage.shared_blk_write_time, &entry->counters.blocks.instr_shared_blk_write_time, sizeof(instr_time));
-	memcpy(&bufusage.local_blk_read_time, &entry->counters.blocks.instr_local_blk_read_time, sizeof(instr_time));
-	memcpy(&bufusage.local_blk_write_time, &entry->counters.blocks.instr_local_blk_write_time, sizeof(instr_time));
+	memcpy(&bufusage.shared_blk_read_time, &meta->instr.instr_shared_blk_read_time, sizeof(instr_time));
+	memcpy(&bufusage.shared_blk_write_time, &meta->instr.instr_shared_blk_write_time, sizeof(instr_time));
+	memcpy(&bufusage.local_blk_read_time, &meta->instr.instr_local_blk_read_time, sizeof(instr_time));
+	memcpy(&bufusage.local_blk_write_time, &meta->instr.instr_local_blk_write_time, sizeof(instr_time));
 #endif
 
 #if PG_VERSION_NUM >= 150000
-	memcpy(&bufusage.temp_blk_read_time, &entry->counters.blocks.instr_temp_blk_read_time, sizeof(instr_time));
-	memcpy(&bufusage.temp_blk_write_time, &entry->counters.blocks.instr_temp_blk_write_time, sizeof(instr_time));
+	memcpy(&bufusage.temp_blk_read_time, &meta->instr.instr_temp_blk_read_time, sizeof(instr_time));
+	memcpy(&bufusage.temp_blk_write_time, &meta->instr.instr_temp_blk_write_time, sizeof(instr_time));
 #endif
 
 	/* walusage */
@@ -1953,217 +3011,1393 @@ pgsm_store(pgsmEntry *entry)
 	walusage.wal_fpi = entry->counters.walusage.wal_fpi;
 	walusage.wal_bytes = entry->counters.walusage.wal_bytes;
 
-	/* jit */
-	jitusage.created_functions = entry->counters.jitinfo.jit_functions;
-	memcpy(&jitusage.generation_counter, &entry->counters.jitinfo.instr_generation_counter, sizeof(instr_time));
-	memcpy(&jitusage.inlining_counter, &entry->counters.jitinfo.instr_inlining_counter, sizeof(instr_time));
-	memcpy(&jitusage.optimization_counter, &entry->counters.jitinfo.instr_optimization_counter, sizeof(instr_time));
-	memcpy(&jitusage.emission_counter, &entry->counters.jitinfo.instr_emission_counter, sizeof(instr_time));
+	/* jit */
+	jitusage.created_functions = entry->counters.jitinfo.jit_functions;
+	memcpy(&jitusage.generation_counter, &meta->instr.instr_generation_counter, sizeof(instr_time));
+	memcpy(&jitusage.inlining_counter, &meta->instr.instr_inlining_counter, sizeof(instr_time));
+	memcpy(&jitusage.optimization_counter, &meta->instr.instr_optimization_counter, sizeof(instr_time));
+	memcpy(&jitusage.emission_counter, &meta->instr.instr_emission_counter, sizeof(instr_time));
+
+
+	/* Update parent id if needed */
+	if (pgsm_track == PGSM_TRACK_ALL && nesting_level > 0 && nesting_level < max_stack_depth)
+	{
+		entry->key.parentid = nested_queryids[nesting_level - 1];
+	}
+	else
+	{
+		entry->key.parentid = UINT64CONST(0);
+	}
+
+#if PG_VERSION_NUM >= 170000
+	memcpy(&jitusage.deform_counter, &meta->instr.instr_deform_counter, sizeof(instr_time));
+#endif
+
+	/*
+	 * With batching enabled the statistics are only accumulated in backend
+	 * local memory here, and merged into the shared hash by
+	 * pgsm_flush_pending() once the batch is full, has been waiting for
+	 * pgsm_flush_interval or the bucket changes. A session that goes idle
+	 * keeps its batch until its next statement, or until it exits.
+	 */
+	if (pgsm_flush_batch_size > 0)
+	{
+		/*
+		 * The pending entries may be flushed outside of a transaction, when
+		 * the backend exits. Make sure their names are cached by then.
+		 */
+		pgsm_lookup_names(entry->key.dbid, entry->key.userid, NULL, NULL);
+
+		/* All pending entries belong to the same bucket */
+		if (pending_calls > 0 && pending_bucket_id != bucketid)
+			pgsm_flush_pending();
+
+		pgsm_add_pending(entry, query, &bufusage, &walusage, &jitusage);
+		pgsm_reset_local_entry(entry);
+
+		if (pending_calls >= pgsm_flush_batch_size || pgsm_pending_expired())
+			pgsm_flush_pending();
+		return;
+	}
+
+	shared_hash_entry = pgsm_get_shared_entry(pgsm, entry, query, query_len, &hashcode);
+	if (shared_hash_entry == NULL)
+		return;
+
+	pgsm_update_entry(shared_hash_entry,	/* entry */
+					  NULL,		/* meta */
+					  query,	/* query */
+					  NULL,		/* PlanInfo */
+					  &entry->counters.sysinfo, /* SysInfo */
+					  entry->counters.plantime.total_time,	/* plan_total_time */
+					  entry->counters.time.total_time,	/* exec_total_time */
+					  entry->counters.calls.rows,	/* rows */
+					  &bufusage,	/* bufusage */
+					  &walusage,	/* walusage */
+					  &jitusage,	/* jitusage */
+					  false,	/* reset */
+					  PGSM_STORE);
+
+	/* This releases the partition lock */
+	pgsm_update_shared_meta(pgsm, shared_hash_entry, hashcode, meta);
+	pgsm_reset_local_entry(entry);
+}
+
+/*
+ * Clear the statistics of a local entry once they have been stored, keeping
+ * the names it was created with.
+ */
+static void
+pgsm_reset_local_entry(pgsmEntry *entry)
+{
+	pgsmEntryMeta *meta = entry->meta.meta_pointer;
+
+	memset(&entry->counters, 0, sizeof(entry->counters));
+	memset(&meta->planinfo, 0, sizeof(meta->planinfo));
+	memset(&meta->error, 0, sizeof(meta->error));
+	memset(&meta->instr, 0, sizeof(meta->instr));
+}
+
+/*
+ * Create the caches of database, user and relation names. They live as long
+ * as the backend, and are invalidated through syscache and relcache
+ * callbacks.
+ */
+static void
+pgsm_init_name_cache(void)
+{
+	HASHCTL		info;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(Oid);
+	info.entrysize = sizeof(pgsmNameCacheEntry);
+	info.hcxt = TopMemoryContext;
+	datname_cache = hash_create("pg_stat_monitor database names", 8, &info,
+								HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	username_cache = hash_create("pg_stat_monitor user names", 8, &info,
+								 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	relname_cache = hash_create("pg_stat_monitor relation names", 64, &info,
+								HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	CacheRegisterSyscacheCallback(DATABASEOID, pgsm_name_cache_callback, PointerGetDatum(datname_cache));
+	CacheRegisterSyscacheCallback(AUTHOID, pgsm_name_cache_callback, PointerGetDatum(username_cache));
+	CacheRegisterSyscacheCallback(NAMESPACEOID, pgsm_name_cache_callback, PointerGetDatum(relname_cache));
+	CacheRegisterRelcacheCallback(pgsm_relname_cache_callback, (Datum) 0);
+}
+
+/*
+ * A database or role has changed. Renames are rare enough to just revalidate
+ * all names of the cache on next use.
+ */
+static void
+pgsm_name_cache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	HTAB	   *cache = (HTAB *) DatumGetPointer(arg);
+	HASH_SEQ_STATUS hstat;
+	pgsmNameCacheEntry *entry;
+
+	hash_seq_init(&hstat, cache);
+	while ((entry = hash_seq_search(&hstat)) != NULL)
+		entry->valid = false;
+}
+
+/*
+ * A relation has changed, or all of them if relid is invalid.
+ */
+static void
+pgsm_relname_cache_callback(Datum arg, Oid relid)
+{
+	pgsmNameCacheEntry *entry;
+
+	if (!OidIsValid(relid))
+	{
+		pgsm_name_cache_callback(PointerGetDatum(relname_cache), RELOID, 0);
+		return;
+	}
+
+	entry = (pgsmNameCacheEntry *) hash_search(relname_cache, &relid, HASH_FIND, NULL);
+	if (entry)
+		entry->valid = false;
+}
+
+/*
+ * Return the cached name of a database, user or relation, looking it up in
+ * the catalogs if needed. Relation names are qualified with their schema. Outside of a transaction, the last known name is used
+ * as is. NULL is returned if there is no name to use.
+ */
+static const char *
+pgsm_cached_name(HTAB *cache, Oid oid)
+{
+	pgsmNameCacheEntry *entry;
+	char	   *name;
+
+	entry = (pgsmNameCacheEntry *) hash_search(cache, &oid, HASH_FIND, NULL);
+	if (entry && entry->valid)
+		return entry->name;
+
+	if (!IsTransactionState())
+		return entry ? entry->name : NULL;
+
+	if (cache == datname_cache)
+		name = get_database_name(oid);
+	else if (cache == username_cache)
+		name = GetUserNameFromId(oid, true);
+	else
+	{
+		char	   *relname = get_rel_name(oid);
+		char	   *nspname = NULL;
+
+		if (relname != NULL)
+			nspname = get_namespace_name(get_rel_namespace(oid));
+		name = (nspname != NULL) ? psprintf("%s.%s", nspname, relname) : NULL;
+	}
+
+	if (!name)
+		return NULL;
+
+	entry = (pgsmNameCacheEntry *) hash_search(cache, &oid, HASH_ENTER, NULL);
+	strlcpy(entry->name, name, sizeof(entry->name));
+	entry->valid = true;
+	pfree(name);
+
+	return entry->name;
+}
+
+/*
+ * Get the names of a database and user for a new entry. Either output
+ * argument may be NULL, to only fill the cache.
+ */
+static void
+pgsm_lookup_names(Oid dbid, Oid userid, const char **datname, const char **username)
+{
+	const char *name;
+
+	if (datname_cache == NULL)
+		pgsm_init_name_cache();
+
+	name = pgsm_cached_name(datname_cache, dbid);
+	if (datname)
+		*datname = name ? name : "<database name not available>";
+
+	name = pgsm_cached_name(username_cache, userid);
+	if (username)
+		*username = name ? name : "<user name not available>";
+}
+
+/*
+ * Create the backend local hash that accumulates statistics while batching
+ * is enabled. The exit callback that flushes it is only registered once, on
+ * first use.
+ */
+static void
+pgsm_init_pending(void)
+{
+	HASHCTL		info;
+
+	if (pending_cxt == NULL)
+	{
+		pending_cxt = AllocSetContextCreate(TopMemoryContext,
+											"pg_stat_monitor pending stats",
+											ALLOCSET_DEFAULT_SIZES);
+
+		before_shmem_exit(pgsm_pending_shmem_exit, (Datum) 0);
+
+		pending_slot = &pgsm_get_pending_stats()[PGSM_MY_PROC_NUMBER];
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(pgsmHashKey);
+	info.entrysize = sizeof(pgsmEntry);
+	info.hcxt = pending_cxt;
+	pending_hash = hash_create("pg_stat_monitor pending hash", 64, &info,
+							   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+/*
+ * Accumulate the statistics of one statement into the backend local pending
+ * hash.
+ */
+static void
+pgsm_add_pending(pgsmEntry *entry, const char *query,
+				 BufferUsage *bufusage, WalUsage *walusage, JitInstrumentation *jitusage)
+{
+	pgsmEntry  *pending;
+	bool		found;
+
+	if (pending_hash == NULL)
+		pgsm_init_pending();
+
+	pending = (pgsmEntry *) hash_search(pending_hash, &entry->key, HASH_ENTER, &found);
+	if (!found)
+	{
+		/* Only the key has been copied, initialize everything else */
+		memset(((char *) pending) + sizeof(pgsmHashKey), 0, sizeof(pgsmEntry) - sizeof(pgsmHashKey));
+
+		pending->pgsm_query_id = entry->pgsm_query_id;
+		pending->encoding = entry->encoding;
+		pending->counters.info.cmd_type = entry->counters.info.cmd_type;
+		pending->counters.info.parent_query = InvalidDsaPointer;
+		pending->query_text.query_pointer = MemoryContextStrdup(pending_cxt, query);
+		pending->meta.meta_pointer = MemoryContextAllocZero(pending_cxt, sizeof(pgsmEntryMeta));
+		SpinLockInit(&pending->mutex);
+	}
+
+	pgsm_meta_merge(pending->meta.meta_pointer, entry->meta.meta_pointer);
+
+	pgsm_update_entry(pending,	/* entry */
+					  NULL,		/* meta */
+					  query,	/* query */
+					  NULL,		/* PlanInfo */
+					  &entry->counters.sysinfo, /* SysInfo */
+					  entry->counters.plantime.total_time,	/* plan_total_time */
+					  entry->counters.time.total_time,	/* exec_total_time */
+					  entry->counters.calls.rows,	/* rows */
+					  bufusage, /* bufusage */
+					  walusage, /* walusage */
+					  jitusage, /* jitusage */
+					  false,	/* reset */
+					  PGSM_STORE);
+
+	if (pending_calls++ == 0)
+	{
+		pending_bucket_id = entry->key.bucket_id;
+		pending_since = GetCurrentTimestamp();
+		pending_slot->pid = MyProcPid;
+		pending_slot->since = pending_since;
+	}
+	pending_slot->calls = pending_calls;
+}
+
+/*
+ * Combine the timing statistics of two sets of calls, using the parallel
+ * variant of Welford's algorithm for the variance.
+ */
+static void
+pgsm_merge_call_time(CallTime *dst, int64 dst_calls, CallTime *src, int64 src_calls)
+{
+	double		delta;
+	int64		calls = dst_calls + src_calls;
+
+	if (src_calls == 0)
+		return;
+
+	if (dst_calls == 0)
+	{
+		*dst = *src;
+		return;
+	}
+
+	delta = src->mean_time - dst->mean_time;
+	dst->sum_var_time += src->sum_var_time + delta * delta * dst_calls * src_calls / calls;
+	dst->mean_time += delta * src_calls / calls;
+	dst->total_time += src->total_time;
+
+	if (dst->min_time > src->min_time)
+		dst->min_time = src->min_time;
+	if (dst->max_time < src->max_time)
+		dst->max_time = src->max_time;
+}
+
+/*
+ * Add the counters of a pending entry to a shared entry. The caller must hold
+ * the partition lock of the shared entry.
+ */
+static void
+pgsm_merge_entry(pgsmEntry *entry, pgsmEntry *pending)
+{
+	volatile pgsmEntry *e = (volatile pgsmEntry *) entry;
+	pgsmSharedState *pgsm = pgsm_get_ss();
+	Counters   *dst;
+	Counters   *src = &pending->counters;
+	int			i;
+
+	SpinLockAcquire(&e->mutex);
+	e->generation = pg_atomic_read_u64(&pgsm->generation);
+	dst = (Counters *) &e->counters;
+
+	pgsm_merge_call_time(&dst->time, dst->calls.calls, &src->time, src->calls.calls);
+	pgsm_merge_call_time(&dst->plantime, dst->plancalls.calls, &src->plantime, src->plancalls.calls);
+
+	/* Both sides started their usage off at USAGE_INIT */
+	dst->calls.usage += (dst->calls.calls == 0) ? src->calls.usage : src->calls.usage - USAGE_INIT;
+	dst->calls.calls += src->calls.calls;
+	dst->calls.weight += src->calls.weight;
+	dst->calls.rows += src->calls.rows;
+	dst->plancalls.usage += (dst->plancalls.calls == 0) ? src->plancalls.usage : src->plancalls.usage - USAGE_INIT;
+	dst->plancalls.calls += src->plancalls.calls;
+	dst->plancalls.weight += src->plancalls.weight;
+
+	/* The parent query text is handed over, unless there is one already */
+	if (!DsaPointerIsValid(dst->info.parent_query))
+	{
+		dst->info.parent_query = src->info.parent_query;
+		src->info.parent_query = InvalidDsaPointer;
+	}
+
+	dst->blocks.shared_blks_hit += src->blocks.shared_blks_hit;
+	dst->blocks.shared_blks_read += src->blocks.shared_blks_read;
+	dst->blocks.shared_blks_dirtied += src->blocks.shared_blks_dirtied;
+	dst->blocks.shared_blks_written += src->blocks.shared_blks_written;
+	dst->blocks.local_blks_hit += src->blocks.local_blks_hit;
+	dst->blocks.local_blks_read += src->blocks.local_blks_read;
+	dst->blocks.local_blks_dirtied += src->blocks.local_blks_dirtied;
+	dst->blocks.local_blks_written += src->blocks.local_blks_written;
+	dst->blocks.temp_blks_read += src->blocks.temp_blks_read;
+	dst->blocks.temp_blks_written += src->blocks.temp_blks_written;
+	dst->blocks.shared_blk_read_time += src->blocks.shared_blk_read_time;
+	dst->blocks.shared_blk_write_time += src->blocks.shared_blk_write_time;
+	dst->blocks.local_blk_read_time += src->blocks.local_blk_read_time;
+	dst->blocks.local_blk_write_time += src->blocks.local_blk_write_time;
+	dst->blocks.temp_blk_read_time += src->blocks.temp_blk_read_time;
+	dst->blocks.temp_blk_write_time += src->blocks.temp_blk_write_time;
+
+	dst->sysinfo.utime += src->sysinfo.utime;
+	dst->sysinfo.stime += src->sysinfo.stime;
+
+	dst->walusage.wal_records += src->walusage.wal_records;
+	dst->walusage.wal_fpi += src->walusage.wal_fpi;
+	dst->walusage.wal_bytes += src->walusage.wal_bytes;
+
+	dst->jitinfo.jit_functions += src->jitinfo.jit_functions;
+	dst->jitinfo.jit_generation_time += src->jitinfo.jit_generation_time;
+	dst->jitinfo.jit_inlining_count += src->jitinfo.jit_inlining_count;
+	dst->jitinfo.jit_inlining_time += src->jitinfo.jit_inlining_time;
+	dst->jitinfo.jit_optimization_count += src->jitinfo.jit_optimization_count;
+	dst->jitinfo.jit_optimization_time += src->jitinfo.jit_optimization_time;
+	dst->jitinfo.jit_emission_count += src->jitinfo.jit_emission_count;
+	dst->jitinfo.jit_emission_time += src->jitinfo.jit_emission_time;
+	dst->jitinfo.jit_deform_count += src->jitinfo.jit_deform_count;
+	dst->jitinfo.jit_deform_time += src->jitinfo.jit_deform_time;
+
+	for (i = 0; i < MAX_RESPONSE_BUCKET; i++)
+		dst->resp_calls[i] += src->resp_calls[i];
+
+	SpinLockRelease(&e->mutex);
+}
+
+/*
+ * Throw away the pending statistics of this backend.
+ */
+static void
+pgsm_discard_pending(void)
+{
+	HASH_SEQ_STATUS hstat;
+	pgsmEntry  *pending;
+
+	if (pending_hash == NULL)
+		return;
+
+	/* Parent query texts not handed over to a shared entry live in DSA */
+	hash_seq_init(&hstat, pending_hash);
+	while ((pending = hash_seq_search(&hstat)) != NULL)
+	{
+		if (DsaPointerIsValid(pending->counters.info.parent_query))
+			dsa_free(get_dsa_area_for_query_text(), pending->counters.info.parent_query);
+	}
+
+	MemoryContextReset(pending_cxt);
+	pending_hash = NULL;
+	pending_calls = 0;
+
+	pending_slot->calls = 0;
+	pending_slot->pid = 0;
+}
+
+/*
+ * Merge the pending statistics of this backend into the shared hash.
+ *
+ * The bucket rotation sets the new start time of a bucket under the exclusive
+ * lock before it empties the bucket. The lock is held in shared mode while
+ * each entry is merged, so that it can't end up in a bucket being recycled,
+ * but not across the whole batch, so that the rotation isn't held up. If the
+ * bucket has been recycled since the statistics started accumulating, they
+ * go to the current bucket instead. Entries that can't be created are
+ * accounted in the overflow entry by pgsm_get_shared_entry().
+ */
+static void
+pgsm_flush_pending(void)
+{
+	pgsmSharedState *pgsm;
+	HASH_SEQ_STATUS hstat;
+	pgsmEntry  *pending;
+
+	if (pending_calls == 0)
+		return;
+
+	pgsm = pgsm_get_ss();
+
+	PG_TRY();
+	{
+		hash_seq_init(&hstat, pending_hash);
+		while ((pending = hash_seq_search(&hstat)) != NULL)
+		{
+			pgsmEntry  *shared_hash_entry;
+			uint32		hashcode;
+			char	   *query = pending->query_text.query_pointer;
+
+			pgsm_lock_aquire(pgsm, LW_SHARED);
+
+			/*
+			 * The pending hash is thrown away after the flush, so the key may
+			 * be changed in place.
+			 */
+			if (pgsm->bucket_start_time[pending->key.bucket_id] > pending_since)
+				pending->key.bucket_id = pg_atomic_read_u64(&pgsm->current_wbucket);
+
+			shared_hash_entry = pgsm_get_shared_entry(pgsm, pending, query, strlen(query), &hashcode);
+			if (shared_hash_entry != NULL)
+			{
+				pgsm_merge_entry(shared_hash_entry, pending);
+
+				/* This releases the partition lock */
+				pgsm_update_shared_meta(pgsm, shared_hash_entry, hashcode, pending->meta.meta_pointer);
+			}
+
+			pgsm_lock_release(pgsm);
+		}
+	}
+	PG_CATCH();
+	{
+		/* Part of the batch may have been merged, don't merge it twice */
+		pgsm_discard_pending();
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pgsm_discard_pending();
+}
+
+/*
+ * Whether the pending statistics have been waiting for pgsm_flush_interval.
+ */
+static bool
+pgsm_pending_expired(void)
+{
+	return pending_calls > 0 &&
+		TimestampDifferenceExceeds(pending_since, GetCurrentTimestamp(), pgsm_flush_interval);
+}
+
+/*
+ * Don't lose the pending statistics when the backend exits.
+ */
+static void
+pgsm_pending_shmem_exit(int code, Datum arg)
+{
+	if (IsSystemInitialized())
+		pgsm_flush_pending();
+}
+
+/*
+ * Reset all statement statistics.
+ */
+Datum
+pg_stat_monitor_reset(PG_FUNCTION_ARGS)
+{
+	pgsmSharedState *pgsm;
+
+	/* Safety check... */
+	if (!IsSystemInitialized())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_stat_monitor: must be loaded via shared_preload_libraries")));
+
+	/* Statistics not flushed yet would otherwise survive the reset */
+	pgsm_discard_pending();
+
+	pgsm = pgsm_get_ss();
+	pgsm_lock_aquire(pgsm, LW_EXCLUSIVE);
+	hash_entry_dealloc(-1, -1, NULL);
+
+	pgsm_lock_release(pgsm);
+	PG_RETURN_VOID();
+}
+
+Datum
+pg_stat_monitor_1_0(PG_FUNCTION_ARGS)
+{
+	pg_stat_monitor_internal(fcinfo, PGSM_V1_0, true, NULL);
+	return (Datum) 0;
+}
+
+Datum
+pg_stat_monitor_2_0(PG_FUNCTION_ARGS)
+{
+	pg_stat_monitor_internal(fcinfo, PGSM_V2_0, true, NULL);
+	return (Datum) 0;
+}
+
+Datum
+pg_stat_monitor_2_1(PG_FUNCTION_ARGS)
+{
+	pg_stat_monitor_internal(fcinfo, PGSM_V2_1, true, NULL);
+	return (Datum) 0;
+}
+
+Datum
+pg_stat_monitor_2_2(PG_FUNCTION_ARGS)
+{
+	pgsmFilter	filter;
+
+	pgsm_filter_from_args(fcinfo, &filter);
+	pg_stat_monitor_internal(fcinfo, PGSM_V2_2, true, &filter);
+	return (Datum) 0;
+}
+
+/*
+  * Legacy entry point for pg_stat_monitor() API versions 1.0
+  */
+Datum
+pg_stat_monitor(PG_FUNCTION_ARGS)
+{
+	pg_stat_monitor_internal(fcinfo, PGSM_V1_0, true, NULL);
+	return (Datum) 0;
+}
+
+/*
+ * Entries changed since the given cursor, along with the cursor to pass to
+ * the next call. Removed entries are not reported.
+ */
+Datum
+pg_stat_monitor_changes(PG_FUNCTION_ARGS)
+{
+	pgsmFilter	filter;
+	int64		since = PG_GETARG_INT64(0);
+
+	if (since < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("[pg_stat_monitor] pg_stat_monitor_changes: cursor must not be negative")));
+
+	memset(&filter, 0, sizeof(pgsmFilter));
+	filter.has_changed_since = true;
+	filter.changed_since = (uint64) since;
+	pg_stat_monitor_internal(fcinfo, PGSM_V2_2, true, &filter);
+	return (Datum) 0;
+}
+
+/*
+ * The n entries with the highest value of a metric, optionally in a single
+ * bucket. Only the winners are turned into rows.
+ */
+Datum
+pg_stat_monitor_top(PG_FUNCTION_ARGS)
+{
+	pgsmFilter	filter;
+	int32		n;
+	char	   *metric;
+	int			i;
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("[pg_stat_monitor] pg_stat_monitor_top: n and metric must not be NULL")));
+
+	n = PG_GETARG_INT32(0);
+	metric = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	if (n <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("[pg_stat_monitor] pg_stat_monitor_top: n must be positive")));
+
+	memset(&filter, 0, sizeof(pgsmFilter));
+	filter.top_n = Min(n, MAX_BUCKET_ENTRIES + PGSM_OVERFLOW_ENTRIES);
+
+	for (i = 0; i < PGSM_TOP_NUM_METRICS; i++)
+		if (strcmp(metric, pgsm_top_metric_names[i]) == 0)
+			break;
+	if (i == PGSM_TOP_NUM_METRICS)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("[pg_stat_monitor] pg_stat_monitor_top: unknown metric \"%s\"", metric),
+				 errhint("Valid metrics are calls, total_exec_time, mean_exec_time, max_exec_time, rows, "
+						 "total_plan_time, shared_blks_hit, shared_blks_read, temp_blks_written, "
+						 "cpu_user_time, cpu_sys_time and wal_bytes.")));
+	filter.top_metric = (pgsmTopMetric) i;
+
+	if (!PG_ARGISNULL(2))
+	{
+		filter.has_bucket_from = filter.has_bucket_to = true;
+		filter.bucket_from = filter.bucket_to = PG_GETARG_INT64(2);
+	}
+
+	pg_stat_monitor_internal(fcinfo, PGSM_V2_2, true, &filter);
+	return (Datum) 0;
+}
+
+/*
+ * Read the value of a metric of an entry, as pg_stat_monitor_internal would
+ * report it. Returns false if the entry wouldn't be reported at all.
+ */
+static bool
+pgsm_top_value(pgsmEntry *entry, pgsmTopMetric metric, TimestampTz now, double *value)
+{
+	volatile pgsmEntry *e = (volatile pgsmEntry *) entry;
+	int64		calls;
+	double		weight;
+	double		v = 0;
+	bool		additive = true;
+	CmdType		cmd_type;
+
+	SpinLockAcquire(&e->mutex);
+	calls = e->counters.calls.calls;
+	weight = e->counters.calls.weight;
+	cmd_type = e->counters.info.cmd_type;
+	switch (metric)
+	{
+		case PGSM_TOP_CALLS:
+			v = calls;
+			break;
+		case PGSM_TOP_TOTAL_EXEC_TIME:
+			v = e->counters.time.total_time;
+			break;
+		case PGSM_TOP_MEAN_EXEC_TIME:
+			v = e->counters.time.mean_time;
+			additive = false;
+			break;
+		case PGSM_TOP_MAX_EXEC_TIME:
+			v = e->counters.time.max_time;
+			additive = false;
+			break;
+		case PGSM_TOP_ROWS:
+			v = e->counters.calls.rows;
+			break;
+		case PGSM_TOP_TOTAL_PLAN_TIME:
+			/* Planning is sampled on its own */
+			v = e->counters.plantime.total_time;
+			calls = e->counters.plancalls.calls;
+			weight = e->counters.plancalls.weight;
+			break;
+		case PGSM_TOP_SHARED_BLKS_HIT:
+			v = e->counters.blocks.shared_blks_hit;
+			break;
+		case PGSM_TOP_SHARED_BLKS_READ:
+			v = e->counters.blocks.shared_blks_read;
+			break;
+		case PGSM_TOP_TEMP_BLKS_WRITTEN:
+			v = e->counters.blocks.temp_blks_written;
+			break;
+		case PGSM_TOP_CPU_USER_TIME:
+			v = e->counters.sysinfo.utime;
+			break;
+		case PGSM_TOP_CPU_SYS_TIME:
+			v = e->counters.sysinfo.stime;
+			break;
+		case PGSM_TOP_WAL_BYTES:
+			v = e->counters.walusage.wal_bytes;
+			break;
+		case PGSM_TOP_NUM_METRICS:
+			break;
+	}
+	SpinLockRelease(&e->mutex);
+
+	/* Same as the checks of pg_stat_monitor_internal */
+	if (cmd_type == CMD_SELECT && pgsm_enable_query_plan && entry->key.planid == 0)
+		return false;
+	if (!IsBucketValid(entry->key.bucket_id, now))
+		return false;
+
+	/* See pgsm_scale_counters() */
+	if (calls > 0 && weight > calls)
+	{
+		if (metric == PGSM_TOP_CALLS)
+			v = rint(weight);
+		else if (additive)
+			v *= weight / calls;
+	}
+	if (metric == PGSM_TOP_CALLS && v == 0)
+		v = 1;
+
+	*value = v;
+	return true;
+}
+
+/* Order the bounded heap of pgsm_top_entries() with the lowest value first */
+static int
+pgsm_top_cmp(Datum a, Datum b, void *arg)
+{
+	double		va = ((pgsmTopEntry *) DatumGetPointer(a))->value;
+	double		vb = ((pgsmTopEntry *) DatumGetPointer(b))->value;
+
+	if (va < vb)
+		return 1;
+	if (va > vb)
+		return -1;
+	return 0;
+}
+
+/*
+ * Select the entries for pg_stat_monitor_top() with a bounded heap, and
+ * return them in descending order of the metric. The caller must hold the
+ * partition locks, which keep the entries from going away.
+ */
+static pgsmEntry **
+pgsm_top_entries(pgsmFilter *filter, int *num_entries)
+{
+	PGSM_HASH_SEQ_STATUS hstat;
+	pgsmEntry  *entry;
+	pgsmTopEntry *candidates;
+	pgsmEntry **result;
+	binaryheap *heap;
+	TimestampTz now = GetCurrentTimestamp();
+	int			n = 0;
+
+	candidates = palloc(sizeof(pgsmTopEntry) * filter->top_n);
+	heap = binaryheap_allocate(filter->top_n, pgsm_top_cmp, NULL);
+
+	pgsm_hash_seq_init(&hstat, get_pgsmHash(), false);
+	while ((entry = pgsm_hash_seq_next(&hstat)) != NULL)
+	{
+		double		value;
+		pgsmTopEntry *lowest;
+
+		if (!pgsm_filter_key(filter, &entry->key))
+			continue;
+		if (!pgsm_top_value(entry, filter->top_metric, now, &value))
+			continue;
+
+		if (n < filter->top_n)
+		{
+			candidates[n].value = value;
+			candidates[n].entry = entry;
+			binaryheap_add(heap, PointerGetDatum(&candidates[n]));
+			n++;
+			continue;
+		}
+
+		lowest = (pgsmTopEntry *) DatumGetPointer(binaryheap_first(heap));
+		if (value > lowest->value)
+		{
+			lowest->value = value;
+			lowest->entry = entry;
+			binaryheap_replace_first(heap, PointerGetDatum(lowest));
+		}
+	}
+	pgsm_hash_seq_term(&hstat);
+
+	/* The heap gives the lowest first, fill the result from the end */
+	result = palloc(sizeof(pgsmEntry *) * Max(n, 1));
+	*num_entries = n;
+	while (n > 0)
+		result[--n] = ((pgsmTopEntry *) DatumGetPointer(binaryheap_remove_first(heap)))->entry;
+
+	binaryheap_free(heap);
+	pfree(candidates);
+	return result;
+}
+
+static pgsmEntry *
+pgsm_next_top_entry(pgsmEntry **top_entries, int num_entries, int *next)
+{
+	if (*next >= num_entries)
+		return NULL;
+	return top_entries[(*next)++];
+}
+
+/*
+ * Read the filter arguments of pg_stat_monitor_internal().  A NULL argument
+ * doesn't filter anything.
+ */
+static void
+pgsm_filter_from_args(FunctionCallInfo fcinfo, pgsmFilter *filter)
+{
+	memset(filter, 0, sizeof(pgsmFilter));
+
+	/* Called through an older definition of the function */
+	if (PG_NARGS() < PGSM_NUM_ARGS)
+		return;
+
+	if (!PG_ARGISNULL(PGSM_ARG_BUCKET_FROM))
+	{
+		filter->has_bucket_from = true;
+		filter->bucket_from = PG_GETARG_INT64(PGSM_ARG_BUCKET_FROM);
+	}
+	if (!PG_ARGISNULL(PGSM_ARG_BUCKET_TO))
+	{
+		filter->has_bucket_to = true;
+		filter->bucket_to = PG_GETARG_INT64(PGSM_ARG_BUCKET_TO);
+	}
+	if (!PG_ARGISNULL(PGSM_ARG_DBID))
+	{
+		filter->has_dbid = true;
+		filter->dbid = PG_GETARG_OID(PGSM_ARG_DBID);
+	}
+	if (!PG_ARGISNULL(PGSM_ARG_USERID))
+	{
+		filter->has_userid = true;
+		filter->userid = PG_GETARG_OID(PGSM_ARG_USERID);
+	}
+	if (!PG_ARGISNULL(PGSM_ARG_QUERYID))
+	{
+		filter->has_queryid = true;
+		filter->queryid = (uint64) PG_GETARG_INT64(PGSM_ARG_QUERYID);
+	}
+	if (!PG_ARGISNULL(PGSM_ARG_MIN_CALLS))
+	{
+		filter->has_min_calls = true;
+		filter->min_calls = PG_GETARG_INT64(PGSM_ARG_MIN_CALLS);
+	}
+	if (!PG_ARGISNULL(PGSM_ARG_MIN_TOTAL_TIME))
+	{
+		filter->has_min_total_time = true;
+		filter->min_total_time = PG_GETARG_FLOAT8(PGSM_ARG_MIN_TOTAL_TIME);
+	}
+}
+
+/*
+ * Check the filters that only need the hash key.  The key of an entry never
+ * changes, so this doesn't need the entry's spinlock.
+ */
+static bool
+pgsm_filter_key(pgsmFilter *filter, pgsmHashKey *key)
+{
+	if (filter->has_bucket_from && (int64) key->bucket_id < filter->bucket_from)
+		return false;
+	if (filter->has_bucket_to && (int64) key->bucket_id > filter->bucket_to)
+		return false;
+	if (filter->has_dbid && key->dbid != filter->dbid)
+		return false;
+	if (filter->has_userid && key->userid != filter->userid)
+		return false;
+	if (filter->has_queryid && key->queryid != filter->queryid)
+		return false;
+
+	return true;
+}
+
+/*
+ * Check the filters on the counters, as reported by pg_stat_monitor_internal.
+ */
+static bool
+pgsm_filter_counters(pgsmFilter *filter, Counters *counters)
+{
+	/* An entry still being executed for the first time shows one call */
+	int64		calls = Max(counters->calls.calls, 1);
+
+	if (filter->has_min_calls && calls < filter->min_calls)
+		return false;
+	if (filter->has_min_total_time && counters->time.total_time < filter->min_total_time)
+		return false;
+
+	return true;
+}
+
+#if PG_VERSION_NUM >= 130000
+/*
+ * Return the call of pg_stat_monitor_internal() a range table entry reads
+ * from, if it is a subquery like the pg_stat_monitor view that only renames
+ * the columns of the function.  The filter arguments must not have been
+ * given yet.
+ */
+static FuncExpr *
+pgsm_view_function(RangeTblEntry *rte, Index *func_rti)
+{
+	Query	   *sub = rte->subquery;
+	RangeTblRef *ref;
+	RangeTblEntry *frte;
+	RangeTblFunction *rtfunc;
+	FuncExpr   *func;
+	char	   *funcname;
+
+	if (rte->rtekind != RTE_SUBQUERY || sub == NULL)
+		return NULL;
+
+	/* Filtering rows early must not change what the subquery returns */
+	if (sub->commandType != CMD_SELECT || sub->setOperations != NULL ||
+		sub->hasAggs || sub->hasWindowFuncs || sub->hasTargetSRFs ||
+		sub->groupClause != NIL || sub->groupingSets != NIL ||
+		sub->havingQual != NULL || sub->distinctClause != NIL ||
+		sub->limitCount != NULL || sub->limitOffset != NULL)
+		return NULL;
+
+	if (list_length(sub->jointree->fromlist) != 1 ||
+		!IsA(linitial(sub->jointree->fromlist), RangeTblRef))
+		return NULL;
+
+	ref = (RangeTblRef *) linitial(sub->jointree->fromlist);
+	frte = rt_fetch(ref->rtindex, sub->rtable);
+	if (frte->rtekind != RTE_FUNCTION || frte->funcordinality ||
+		list_length(frte->functions) != 1)
+		return NULL;
+
+	rtfunc = (RangeTblFunction *) linitial(frte->functions);
+	if (!IsA(rtfunc->funcexpr, FuncExpr) ||
+		rtfunc->funccolcount != PG_STAT_MONITOR_COLS_V2_2)
+		return NULL;
+
+	func = (FuncExpr *) rtfunc->funcexpr;
+	if (list_length(func->args) != 1 || IsA(linitial(func->args), NamedArgExpr))
+		return NULL;
+
+	funcname = get_func_name(func->funcid);
+	if (funcname == NULL || strcmp(funcname, "pg_stat_monitor_internal") != 0 ||
+		get_func_nargs(func->funcid) != PGSM_NUM_ARGS)
+		return NULL;
+
+	*func_rti = ref->rtindex;
+	return func;
+}
+
+/*
+ * Return the btree strategy of "var op value", or 0 if op isn't a btree
+ * comparison.
+ */
+static int
+pgsm_op_strategy(Oid opno, bool var_on_left)
+{
+	List	   *interpretations = get_op_btree_interpretation(opno);
+	int			strategy;
+
+	if (interpretations == NIL)
+		return 0;
+
+	strategy = ((OpBtreeInterpretation *) linitial(interpretations))->strategy;
+	if (strategy < BTLessStrategyNumber || strategy > BTGreaterStrategyNumber)
+		return 0;
+
+	if (!var_on_left)
+		strategy = BTCommuteStrategyNumber(strategy);
+
+	return strategy;
+}
+
+static bool
+pgsm_const_int64(Const *c, int64 *value)
+{
+	switch (c->consttype)
+	{
+		case INT2OID:
+			*value = DatumGetInt16(c->constvalue);
+			return true;
+		case INT4OID:
+			*value = DatumGetInt32(c->constvalue);
+			return true;
+		case INT8OID:
+			*value = DatumGetInt64(c->constvalue);
+			return true;
+		default:
+			return false;
+	}
+}
 
+static bool
+pgsm_const_float8(Const *c, double *value)
+{
+	int64		ivalue;
 
-	/* Update parent id if needed */
-	if (pgsm_track == PGSM_TRACK_ALL && nesting_level > 0 && nesting_level < max_stack_depth)
+	switch (c->consttype)
 	{
-		entry->key.parentid = nested_queryids[nesting_level - 1];
+		case FLOAT4OID:
+			*value = DatumGetFloat4(c->constvalue);
+			return true;
+		case FLOAT8OID:
+			*value = DatumGetFloat8(c->constvalue);
+			return true;
+		default:
+			if (!pgsm_const_int64(c, &ivalue))
+				return false;
+			*value = (double) ivalue;
+			return true;
 	}
-	else
+}
+
+/*
+ * Narrow the filter with the qual "column op value" on an output column of
+ * pg_stat_monitor_internal().  The filter only has to let through every row
+ * that satisfies the qual, as the qual itself is still evaluated afterwards.
+ */
+static void
+pgsm_filter_add_qual(pgsmFilter *filter, AttrNumber attno, int strategy, Const *c)
+{
+	int64		ivalue;
+	double		fvalue;
+
+	switch (attno)
 	{
-		entry->key.parentid = UINT64CONST(0);
+		case PGSM_COL_BUCKET:
+			if (!pgsm_const_int64(c, &ivalue))
+				break;
+			if (strategy != BTLessStrategyNumber && strategy != BTLessEqualStrategyNumber &&
+				(!filter->has_bucket_from || ivalue > filter->bucket_from))
+			{
+				filter->has_bucket_from = true;
+				filter->bucket_from = ivalue;
+			}
+			if (strategy != BTGreaterStrategyNumber && strategy != BTGreaterEqualStrategyNumber &&
+				(!filter->has_bucket_to || ivalue < filter->bucket_to))
+			{
+				filter->has_bucket_to = true;
+				filter->bucket_to = ivalue;
+			}
+			break;
+		case PGSM_COL_USERID:
+			if (strategy == BTEqualStrategyNumber && c->consttype == OIDOID)
+			{
+				filter->has_userid = true;
+				filter->userid = DatumGetObjectId(c->constvalue);
+			}
+			break;
+		case PGSM_COL_DBID:
+			if (strategy == BTEqualStrategyNumber && c->consttype == OIDOID)
+			{
+				filter->has_dbid = true;
+				filter->dbid = DatumGetObjectId(c->constvalue);
+			}
+			break;
+		case PGSM_COL_QUERYID:
+			if (strategy == BTEqualStrategyNumber && pgsm_const_int64(c, &ivalue))
+			{
+				filter->has_queryid = true;
+				filter->queryid = (uint64) ivalue;
+			}
+			break;
+		case PGSM_COL_CALLS:
+			if (strategy >= BTEqualStrategyNumber && pgsm_const_int64(c, &ivalue) &&
+				(!filter->has_min_calls || ivalue > filter->min_calls))
+			{
+				filter->has_min_calls = true;
+				filter->min_calls = ivalue;
+			}
+			break;
+		case PGSM_COL_TOTAL_EXEC_TIME:
+			if (strategy >= BTEqualStrategyNumber && pgsm_const_float8(c, &fvalue) &&
+				(!filter->has_min_total_time || fvalue > filter->min_total_time))
+			{
+				filter->has_min_total_time = true;
+				filter->min_total_time = fvalue;
+			}
+			break;
 	}
+}
 
-#if PG_VERSION_NUM >= 170000
-	memcpy(&jitusage.deform_counter, &entry->counters.jitinfo.instr_deform_counter, sizeof(instr_time));
-#endif
+/*
+ * Push the simple quals on the pg_stat_monitor view down to the filter
+ * arguments of pg_stat_monitor_internal(), so that the entries they reject
+ * are skipped during the hash scan instead of being turned into rows first.
+ * Only "column op constant" quals at the top level of the WHERE clause are
+ * considered, on bucket, userid, dbid, queryid, calls and total_exec_time.
+ */
+static void
+pgsm_push_down_filters(Query *parse)
+{
+	List	   *quals = NIL;
+	ListCell   *lc;
+	Index		rti = 0;
 
-	/*
-	 * Acquire a share lock to start with. We'd have to acquire exclusive if
-	 * we need to create the entry.
-	 */
-	pgsm_lock_aquire(pgsm, LW_SHARED);
-	shared_hash_entry = (pgsmEntry *) pgsm_hash_find(get_pgsmHash(), &entry->key, &found);
+	if (parse->commandType != CMD_SELECT || parse->jointree == NULL ||
+		parse->jointree->quals == NULL)
+		return;
 
-	if (!shared_hash_entry)
+	foreach(lc, parse->rtable)
 	{
-		dsa_pointer dsa_query_pointer;
-		dsa_area   *query_dsa_area;
-		char	   *query_buff;
+		RangeTblEntry *rte = (RangeTblEntry *) lfirst(lc);
+		FuncExpr   *func;
+		Index		func_rti;
+		pgsmFilter	filter;
+		ListCell   *qlc;
+
+		rti++;
+		func = pgsm_view_function(rte, &func_rti);
+		if (func == NULL)
+			continue;
 
-		/* New query, truncate length if necessary. */
-		if (query_len > pgsm_query_max_len)
-			query_len = pgsm_query_max_len;
+		if (quals == NIL)
+			quals = make_ands_implicit((Expr *) parse->jointree->quals);
 
-		/* Save the query text in raw dsa area */
-		query_dsa_area = get_dsa_area_for_query_text();
-		dsa_query_pointer = dsa_allocate_extended(query_dsa_area, query_len + 1, DSA_ALLOC_NO_OOM | DSA_ALLOC_ZERO);
-		if (!DsaPointerIsValid(dsa_query_pointer))
+		memset(&filter, 0, sizeof(pgsmFilter));
+		foreach(qlc, quals)
 		{
-			pgsm_lock_release(pgsm);
-			return;
-		}
+			OpExpr	   *op = (OpExpr *) lfirst(qlc);
+			Node	   *left;
+			Node	   *right;
+			Var		   *var;
+			Node	   *value;
+			TargetEntry *tle;
+			int			strategy;
+
+			if (!IsA(op, OpExpr) || list_length(op->args) != 2)
+				continue;
+
+			left = (Node *) linitial(op->args);
+			right = (Node *) lsecond(op->args);
+			if (IsA(left, Var))
+			{
+				var = (Var *) left;
+				value = right;
+			}
+			else if (IsA(right, Var))
+			{
+				var = (Var *) right;
+				value = left;
+			}
+			else
+				continue;
 
-		/*
-		 * Get the memory address from DSA pointer and copy the query text in
-		 * local variable
-		 */
-		query_buff = dsa_get_address(query_dsa_area, dsa_query_pointer);
-		memcpy(query_buff, query, query_len);
+			if (var->varno != rti || var->varlevelsup != 0)
+				continue;
 
-		pgsm_lock_release(pgsm);
-		pgsm_lock_aquire(pgsm, LW_EXCLUSIVE);
+			/* The view column must be a plain column of the function */
+			tle = get_tle_by_resno(rte->subquery->targetList, var->varattno);
+			if (tle == NULL || !IsA(tle->expr, Var) ||
+				((Var *) tle->expr)->varno != func_rti ||
+				((Var *) tle->expr)->varlevelsup != 0)
+				continue;
 
-		/* OK to create a new hashtable entry */
-		PG_TRY();
-		{
-			shared_hash_entry = hash_entry_alloc(pgsm, &entry->key, GetDatabaseEncoding());
-		}
-		PG_CATCH();
-		{
-			if (DsaPointerIsValid(dsa_query_pointer))
-				dsa_free(query_dsa_area, dsa_query_pointer);
-			PG_RE_THROW();
-		}
-		PG_END_TRY();
+			/* Fold casts of literals, such as numeric to float8 */
+			value = eval_const_expressions(NULL, value);
+			if (!IsA(value, Const) || ((Const *) value)->constisnull)
+				continue;
 
-		if (shared_hash_entry == NULL)
-		{
-			pgsm_lock_release(pgsm);
+			strategy = pgsm_op_strategy(op->opno, var == (Var *) left);
+			if (strategy == 0)
+				continue;
 
-			if (DsaPointerIsValid(dsa_query_pointer))
-				dsa_free(query_dsa_area, dsa_query_pointer);
+			pgsm_filter_add_qual(&filter, ((Var *) tle->expr)->varattno,
+								 strategy, (Const *) value);
+		}
 
-			/*
-			 * Out of memory; report only if the state has changed now.
-			 * Otherwise we risk filling up the log file with these message.
-			 */
-			if (!IsSystemOOM())
-			{
-				pgsm->pgsm_oom = true;
+		/* showtext stays as given, the filters follow in argument order */
+		func->args = lappend(func->args,
+							 filter.has_bucket_from ?
+							 makeConst(INT8OID, -1, InvalidOid, sizeof(int64),
+									   Int64GetDatum(filter.bucket_from), false, FLOAT8PASSBYVAL) :
+							 makeNullConst(INT8OID, -1, InvalidOid));
+		func->args = lappend(func->args,
+							 filter.has_bucket_to ?
+							 makeConst(INT8OID, -1, InvalidOid, sizeof(int64),
+									   Int64GetDatum(filter.bucket_to), false, FLOAT8PASSBYVAL) :
+							 makeNullConst(INT8OID, -1, InvalidOid));
+		func->args = lappend(func->args,
+							 filter.has_dbid ?
+							 makeConst(OIDOID, -1, InvalidOid, sizeof(Oid),
+									   ObjectIdGetDatum(filter.dbid), false, true) :
+							 makeNullConst(OIDOID, -1, InvalidOid));
+		func->args = lappend(func->args,
+							 filter.has_userid ?
+							 makeConst(OIDOID, -1, InvalidOid, sizeof(Oid),
+									   ObjectIdGetDatum(filter.userid), false, true) :
+							 makeNullConst(OIDOID, -1, InvalidOid));
+		func->args = lappend(func->args,
+							 filter.has_queryid ?
+							 makeConst(INT8OID, -1, InvalidOid, sizeof(int64),
+									   Int64GetDatum((int64) filter.queryid), false, FLOAT8PASSBYVAL) :
+							 makeNullConst(INT8OID, -1, InvalidOid));
+		func->args = lappend(func->args,
+							 filter.has_min_calls ?
+							 makeConst(INT8OID, -1, InvalidOid, sizeof(int64),
+									   Int64GetDatum(filter.min_calls), false, FLOAT8PASSBYVAL) :
+							 makeNullConst(INT8OID, -1, InvalidOid));
+		func->args = lappend(func->args,
+							 filter.has_min_total_time ?
+							 makeConst(FLOAT8OID, -1, InvalidOid, sizeof(float8),
+									   Float8GetDatum(filter.min_total_time), false, FLOAT8PASSBYVAL) :
+							 makeNullConst(FLOAT8OID, -1, InvalidOid));
+	}
+}
+#endif
 
-				disable_error_capture = true;
-				ereport(WARNING,
-						(errcode(ERRCODE_OUT_OF_MEMORY),
-						 errmsg("[pg_stat_monitor] pgsm_store: Hash table is out of memory and can no longer store queries!"),
-						 errdetail("You may reset the view or when the buckets are deallocated, pg_stat_monitor will resume saving " \
-								   "queries. Alternatively, try increasing the value of pg_stat_monitor.pgsm_max.")));
-				disable_error_capture = false;
-			}
+/*
+ * Whether a bucket is recent enough to be shown, as of now. The caller reads
+ * the current time once for a whole scan.
+ */
+static bool
+IsBucketValid(uint64 bucketid, TimestampTz now)
+{
+	long		secs;
+	int			microsecs;
+	pgsmSharedState *pgsm = pgsm_get_ss();
 
-			return;
-		}
-		else
-		{
-			/* If we got a new entry, reset the oom value false */
-			pgsm->pgsm_oom = false;
-		}
+	TimestampDifference(pgsm->bucket_start_time[bucketid], now, &secs, &microsecs);
 
-		/* If we already have the pointer set, free this one */
-		if (DsaPointerIsValid(shared_hash_entry->query_text.query_pos))
-			dsa_free(query_dsa_area, dsa_query_pointer);
-		else
-			shared_hash_entry->query_text.query_pos = dsa_query_pointer;
+	if (secs > ((int64) pgsm_bucket_time * pgsm_max_buckets))
+		return false;
+	return true;
+}
 
-		shared_hash_entry->pgsm_query_id = entry->pgsm_query_id;
-		shared_hash_entry->encoding = entry->encoding;
-		shared_hash_entry->counters.info.cmd_type = entry->counters.info.cmd_type;
-		shared_hash_entry->counters.info.parent_query = InvalidDsaPointer;
+/*
+ * Scale the counters of an entry that was only tracked for a sample of its
+ * executions up to all of them. Means, extremes, standard deviations and the
+ * histogram are left as they are, they describe the sampled executions.
+ */
+static void
+pgsm_scale_counters(Counters *counters)
+{
+	double		factor;
 
-		snprintf(shared_hash_entry->datname, sizeof(shared_hash_entry->datname), "%s", entry->datname);
-		snprintf(shared_hash_entry->username, sizeof(shared_hash_entry->username), "%s", entry->username);
+	if (counters->calls.calls > 0 && counters->calls.weight > counters->calls.calls)
+	{
+		factor = counters->calls.weight / counters->calls.calls;
+
+		counters->calls.calls = (int64) rint(counters->calls.weight);
+		counters->calls.rows = (int64) rint(counters->calls.rows * factor);
+		counters->time.total_time *= factor;
+		counters->time.sum_var_time *= factor;
+
+		counters->blocks.shared_blks_hit = (int64) rint(counters->blocks.shared_blks_hit * factor);
+		counters->blocks.shared_blks_read = (int64) rint(counters->blocks.shared_blks_read * factor);
+		counters->blocks.shared_blks_dirtied = (int64) rint(counters->blocks.shared_blks_dirtied * factor);
+		counters->blocks.shared_blks_written = (int64) rint(counters->blocks.shared_blks_written * factor);
+		counters->blocks.local_blks_hit = (int64) rint(counters->blocks.local_blks_hit * factor);
+		counters->blocks.local_blks_read = (int64) rint(counters->blocks.local_blks_read * factor);
+		counters->blocks.local_blks_dirtied = (int64) rint(counters->blocks.local_blks_dirtied * factor);
+		counters->blocks.local_blks_written = (int64) rint(counters->blocks.local_blks_written * factor);
+		counters->blocks.temp_blks_read = (int64) rint(counters->blocks.temp_blks_read * factor);
+		counters->blocks.temp_blks_written = (int64) rint(counters->blocks.temp_blks_written * factor);
+		counters->blocks.shared_blk_read_time *= factor;
+		counters->blocks.shared_blk_write_time *= factor;
+		counters->blocks.local_blk_read_time *= factor;
+		counters->blocks.local_blk_write_time *= factor;
+		counters->blocks.temp_blk_read_time *= factor;
+		counters->blocks.temp_blk_write_time *= factor;
+
+		counters->sysinfo.utime *= factor;
+		counters->sysinfo.stime *= factor;
+
+		counters->walusage.wal_records = (int64) rint(counters->walusage.wal_records * factor);
+		counters->walusage.wal_fpi = (int64) rint(counters->walusage.wal_fpi * factor);
+		counters->walusage.wal_bytes = (uint64) rint(counters->walusage.wal_bytes * factor);
+
+		counters->jitinfo.jit_functions = (int64) rint(counters->jitinfo.jit_functions * factor);
+		counters->jitinfo.jit_generation_time *= factor;
+		counters->jitinfo.jit_inlining_count = (int64) rint(counters->jitinfo.jit_inlining_count * factor);
+		counters->jitinfo.jit_inlining_time *= factor;
+		counters->jitinfo.jit_optimization_count = (int64) rint(counters->jitinfo.jit_optimization_count * factor);
+		counters->jitinfo.jit_optimization_time *= factor;
+		counters->jitinfo.jit_emission_count = (int64) rint(counters->jitinfo.jit_emission_count * factor);
+		counters->jitinfo.jit_emission_time *= factor;
+		counters->jitinfo.jit_deform_count = (int64) rint(counters->jitinfo.jit_deform_count * factor);
+		counters->jitinfo.jit_deform_time *= factor;
 	}
 
-	pgsm_update_entry(shared_hash_entry,	/* entry */
-					  query,	/* query */
-					  comments, /* comments */
-					  comments_len, /* comments length */
-					  &entry->counters.planinfo,	/* PlanInfo */
-					  &entry->counters.sysinfo, /* SysInfo */
-					  &entry->counters.error,	/* ErrorInfo */
-					  entry->counters.plantime.total_time,	/* plan_total_time */
-					  entry->counters.time.total_time,	/* exec_total_time */
-					  entry->counters.calls.rows,	/* rows */
-					  &bufusage,	/* bufusage */
-					  &walusage,	/* walusage */
-					  &jitusage,	/* jitusage */
-					  reset,	/* reset */
-					  PGSM_STORE);
+	if (counters->plancalls.calls > 0 && counters->plancalls.weight > counters->plancalls.calls)
+	{
+		factor = counters->plancalls.weight / counters->plancalls.calls;
 
-	memset(&entry->counters, 0, sizeof(entry->counters));
-	pgsm_lock_release(pgsm);
+		counters->plancalls.calls = (int64) rint(counters->plancalls.weight);
+		counters->plantime.total_time *= factor;
+		counters->plantime.sum_var_time *= factor;
+	}
 }
 
 /*
- * Reset all statement statistics.
+ * Append the qualified name of a relation used by a statement. The relations
+ * of the current database are looked up, so that they show their current
+ * name. The others, and the ones dropped since, show the name they had when
+ * the statement ran, or the OID if it had none. The names are looked up once
+ * per scan, and kept in *names.
  */
-Datum
-pg_stat_monitor_reset(PG_FUNCTION_ARGS)
+static void
+pgsm_append_relation_name(StringInfo buf, Oid dbid, pgsmRelation *rel, HTAB **names)
 {
-	pgsmSharedState *pgsm;
+	pgsmRelationName *cached = NULL;
 
-	/* Safety check... */
-	if (!IsSystemInitialized())
-		ereport(ERROR,
-				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				 errmsg("pg_stat_monitor: must be loaded via shared_preload_libraries")));
+	if (dbid == MyDatabaseId)
+	{
+		bool		found;
 
-	pgsm = pgsm_get_ss();
-	pgsm_lock_aquire(pgsm, LW_EXCLUSIVE);
-	hash_entry_dealloc(-1, -1, NULL);
+		if (*names == NULL)
+		{
+			HASHCTL		info;
+
+			memset(&info, 0, sizeof(info));
+			info.keysize = sizeof(Oid);
+			info.entrysize = sizeof(pgsmRelationName);
+			info.hcxt = CurrentMemoryContext;
+			*names = hash_create("pg_stat_monitor relation names", 64, &info,
+								 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+		}
 
-	pgsm_lock_release(pgsm);
-	PG_RETURN_VOID();
-}
+		cached = hash_search(*names, &rel->relid, HASH_ENTER, &found);
+		if (!found)
+		{
+			char	   *relname = get_rel_name(rel->relid);
+			char	   *nspname = NULL;
 
-Datum
-pg_stat_monitor_1_0(PG_FUNCTION_ARGS)
-{
-	pg_stat_monitor_internal(fcinfo, PGSM_V1_0, true);
-	return (Datum) 0;
-}
+			if (relname != NULL)
+				nspname = get_namespace_name(get_rel_namespace(rel->relid));
+			cached->name = (nspname != NULL) ? psprintf("%s.%s", nspname, relname) : NULL;
+		}
+	}
 
-Datum
-pg_stat_monitor_2_0(PG_FUNCTION_ARGS)
-{
-	pg_stat_monitor_internal(fcinfo, PGSM_V2_0, true);
-	return (Datum) 0;
-}
+	if (cached != NULL && cached->name != NULL)
+		appendStringInfoString(buf, cached->name);
+	else if (rel->name[0])
+		appendStringInfoString(buf, rel->name);
+	else
+		appendStringInfo(buf, "%u", rel->relid);
 
-Datum
-pg_stat_monitor_2_1(PG_FUNCTION_ARGS)
-{
-	pg_stat_monitor_internal(fcinfo, PGSM_V2_1, true);
-	return (Datum) 0;
+	if (rel->is_view)
+		appendStringInfoChar(buf, '*');
 }
 
 /*
-  * Legacy entry point for pg_stat_monitor() API versions 1.0
-  */
-Datum
-pg_stat_monitor(PG_FUNCTION_ARGS)
-{
-	pg_stat_monitor_internal(fcinfo, PGSM_V1_0, true);
-	return (Datum) 0;
-}
-
-static bool
-IsBucketValid(uint64 bucketid)
+ * Convert a uint64 counter to numeric. Values that fit into an int64, that
+ * is all of them in practice, skip the round trip through text.
+ */
+static Datum
+pgsm_uint64_numeric(uint64 value)
 {
-	long		secs;
-	int			microsecs;
-	TimestampTz current_tz = GetCurrentTimestamp();
-	pgsmSharedState *pgsm = pgsm_get_ss();
+	char		buf[32];
 
-	TimestampDifference(pgsm->bucket_start_time[bucketid], current_tz, &secs, &microsecs);
+	if (value <= (uint64) PG_INT64_MAX)
+#if PG_VERSION_NUM >= 140000
+		return NumericGetDatum(int64_to_numeric((int64) value));
+#else
+		return DirectFunctionCall1(int8_numeric, Int64GetDatum((int64) value));
+#endif
 
-	if (secs > ((int64) pgsm_bucket_time * pgsm_max_buckets))
-		return false;
-	return true;
+	snprintf(buf, sizeof buf, UINT64_FORMAT, value);
+	return DirectFunctionCall3(numeric_in,
+							   CStringGetDatum(buf),
+							   ObjectIdGetDatum(0),
+							   Int32GetDatum(-1));
 }
 
 /* Common code for all versions of pg_stat_monitor() */
 static void
 pg_stat_monitor_internal(FunctionCallInfo fcinfo,
 						 pgsmVersion api_version,
-						 bool showtext)
+						 bool showtext,
+						 pgsmFilter *filter)
 {
 	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	TupleDesc	tupdesc;
@@ -2173,6 +4407,16 @@ pg_stat_monitor_internal(FunctionCallInfo fcinfo,
 	PGSM_HASH_SEQ_STATUS hstat;
 	pgsmEntry  *entry;
 	pgsmSharedState *pgsm;
+	bool		changes = (filter && filter->has_changed_since);
+	uint64		cursor = 0;
+	pgsmEntry **top_entries = NULL;
+	int			num_top_entries = 0;
+	int			next_top_entry = 0;
+	Oid			current_userid = GetUserId();
+	bool		is_allowed_role;
+	TimestampTz now;
+	StringInfoData rels;
+	HTAB	   *relnames = NULL;
 
 	int			expected_columns;
 
@@ -2187,12 +4431,19 @@ pg_stat_monitor_internal(FunctionCallInfo fcinfo,
 		case PGSM_V2_1:
 			expected_columns = PG_STAT_MONITOR_COLS_V2_1;
 			break;
+		case PGSM_V2_2:
+			expected_columns = PG_STAT_MONITOR_COLS_V2_2;
+			break;
 		default:
 			ereport(ERROR,
 					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
 					 errmsg("[pg_stat_monitor] pg_stat_monitor_internal: Unknown API version")));
 	}
 
+	/* pg_stat_monitor_changes() also returns the generation and the cursor */
+	if (changes)
+		expected_columns = PG_STAT_MONITOR_COLS_CHANGES;
+
 	/* Disallow old api usage */
 	if (api_version < PGSM_V2_0)
 		ereport(ERROR,
@@ -2242,18 +4493,51 @@ pg_stat_monitor_internal(FunctionCallInfo fcinfo,
 
 	MemoryContextSwitchTo(oldcontext);
 
+	/* Make sure our own pending statistics are visible */
+	pgsm_flush_pending();
+
+	/* Everything that doesn't depend on the entry is done once */
+#if PG_VERSION_NUM < 140000
+	is_allowed_role = is_member_of_role(current_userid, DEFAULT_ROLE_READ_ALL_STATS);
+#else
+	is_allowed_role = is_member_of_role(current_userid, ROLE_PG_READ_ALL_STATS);
+#endif
+	now = GetCurrentTimestamp();
+	initStringInfo(&rels);
+
 	pgsm = pgsm_get_ss();
-	pgsm_lock_aquire(pgsm, LW_SHARED);
-	pgsm_hash_seq_init(&hstat, get_pgsmHash(), false);
 
-	while ((entry = pgsm_hash_seq_next(&hstat)) != NULL)
+	/*
+	 * Entries changed from now on get a generation after the cursor, the
+	 * ones changed before are returned by this scan.
+	 */
+	if (changes)
+		cursor = pg_atomic_fetch_add_u64(&pgsm->generation, 1);
+
+	pgsm_all_partitions_lock_aquire(pgsm, LW_SHARED);
+
+	/*
+	 * For pg_stat_monitor_top(), select the winners first, and only build
+	 * the rows of those.
+	 */
+	if (filter && filter->top_n > 0)
+		top_entries = pgsm_top_entries(filter, &num_top_entries);
+	else
+		pgsm_hash_seq_init(&hstat, get_pgsmHash(), false);
+
+	while ((entry = top_entries ?
+			pgsm_next_top_entry(top_entries, num_top_entries, &next_top_entry) :
+			pgsm_hash_seq_next(&hstat)) != NULL)
 	{
 		Datum		values[PG_STAT_MONITOR_COLS] = {0};
 		bool		nulls[PG_STAT_MONITOR_COLS] = {0};
 		int			i = 0;
 		Counters	tmp;
+		pgsmEntryMeta tmp_meta;
 		pgsmHashKey tmpkey;
 		double		stddev;
+		double		sample_rate = 1.0;
+		uint64		generation;
 		uint64		queryid = entry->key.queryid;
 		int64		bucketid = entry->key.bucket_id;
 		Oid			dbid = entry->key.dbid;
@@ -2261,27 +4545,13 @@ pg_stat_monitor_internal(FunctionCallInfo fcinfo,
 		uint64		ip = (uint64) entry->key.ip;
 		uint64		planid = entry->key.planid;
 		uint64		pgsm_query_id = entry->pgsm_query_id;
-		dsa_area   *query_dsa_area;
-		char	   *query_ptr;
-		char	   *query_txt = NULL;
-		char	   *parent_query_txt = NULL;
+		const char *query_txt;
+		const char *parent_query_txt = NULL;
 
 		bool		toplevel = entry->key.toplevel;
-#if PG_VERSION_NUM < 140000
-		bool		is_allowed_role = is_member_of_role(GetUserId(), DEFAULT_ROLE_READ_ALL_STATS);
-#else
-		bool		is_allowed_role = is_member_of_role(GetUserId(), ROLE_PG_READ_ALL_STATS);
-#endif
-		/* Load the query text from dsa area */
-		if (DsaPointerIsValid(entry->query_text.query_pos))
-		{
-			query_dsa_area = get_dsa_area_for_query_text();
-			query_ptr = dsa_get_address(query_dsa_area, entry->query_text.query_pos);
-			query_txt = pstrdup(query_ptr);
-		}
-		else
-			query_txt = pstrdup("Query string not available");	/* Should never happen.
-																 * Just a safty check */
+
+		if (filter && !pgsm_filter_key(filter, &entry->key))
+			continue;
 
 		/* copy counters to a local variable to keep locking time short */
 		{
@@ -2290,9 +4560,21 @@ pg_stat_monitor_internal(FunctionCallInfo fcinfo,
 			SpinLockAcquire(&e->mutex);
 			tmp = e->counters;
 			tmpkey = e->key;
+			generation = e->generation;
 			SpinLockRelease(&e->mutex);
 		}
 
+		if (changes && generation <= filter->changed_since)
+			continue;
+
+		/* Report the effective sample rate, and what it stands for */
+		if (tmp.calls.weight > tmp.calls.calls)
+			sample_rate = tmp.calls.calls / tmp.calls.weight;
+		pgsm_scale_counters(&tmp);
+
+		if (filter && !pgsm_filter_counters(filter, &tmp))
+			continue;
+
 		/*
 		 * In case that query plan is enabled, there is no need to show 0
 		 * planid query
@@ -2300,22 +4582,33 @@ pg_stat_monitor_internal(FunctionCallInfo fcinfo,
 		if (tmp.info.cmd_type == CMD_SELECT && pgsm_enable_query_plan && planid == 0)
 			continue;
 
-		if (!IsBucketValid(bucketid))
+		if (!IsBucketValid(bucketid, now))
 		{
 			continue;
 		}
 
+		/*
+		 * The query texts are used in place, they can't be freed while we
+		 * hold the partition locks.
+		 */
+		if (entry->key.overflow)
+			query_txt = "<other statements>";
+		else if (DsaPointerIsValid(entry->query_text.query_pos))
+			query_txt = dsa_get_address(get_dsa_area_for_query_text(), entry->query_text.query_pos);
+		else
+			query_txt = "Query string not available";	/* Should never happen.
+														 * Just a safty check */
+
+		/* Replacing the metadata needs the exclusive partition lock */
+		pgsm_meta_unpack(entry, &tmp_meta);
+
 		/* read the parent query text if any */
 		if (tmpkey.parentid != UINT64CONST(0))
 		{
 			if (DsaPointerIsValid(tmp.info.parent_query))
-			{
-				query_dsa_area = get_dsa_area_for_query_text();
-				query_ptr = dsa_get_address(query_dsa_area, tmp.info.parent_query);
-				parent_query_txt = pstrdup(query_ptr);
-			}
+				parent_query_txt = dsa_get_address(get_dsa_area_for_query_text(), tmp.info.parent_query);
 			else
-				parent_query_txt = pstrdup("parent query text not available");
+				parent_query_txt = "parent query text not available";
 		}
 		/* bucketid at column number 0 */
 		values[i++] = Int64GetDatumFast(bucketid);
@@ -2324,19 +4617,19 @@ pg_stat_monitor_internal(FunctionCallInfo fcinfo,
 		values[i++] = ObjectIdGetDatum(userid);
 
 		/* username at column number 2 */
-		values[i++] = CStringGetTextDatum(entry->username);
+		values[i++] = CStringGetTextDatum(tmp_meta.username);
 
 		/* dbid at column number 3 */
 		values[i++] = ObjectIdGetDatum(dbid);
 
 		/* datname at column number 4 */
-		values[i++] = CStringGetTextDatum(entry->datname);
+		values[i++] = CStringGetTextDatum(tmp_meta.datname);
 
 		/*
 		 * ip address at column number 5, Superusers or members of
 		 * pg_read_all_stats members are allowed
 		 */
-		if (is_allowed_role || userid == GetUserId())
+		if (is_allowed_role || userid == current_userid)
 			values[i++] = UInt32GetDatum(ip);
 		else
 			nulls[i++] = true;
@@ -2353,20 +4646,29 @@ pg_stat_monitor_internal(FunctionCallInfo fcinfo,
 		{
 			nulls[i++] = true;
 		}
-		if (is_allowed_role || userid == GetUserId())
+		if (is_allowed_role || userid == current_userid)
 		{
 			if (showtext)
 			{
+				int			query_len = strlen(query_txt);
 				char	   *enc;
 
-				/* query at column number 8 */
-				enc = pg_any_to_server(query_txt, strlen(query_txt), GetDatabaseEncoding());
-				values[i++] = CStringGetTextDatum(enc);
-				if (enc != query_txt)
-					pfree(enc);
+				/*
+				 * query at column number 8, converted if it was stored from a
+				 * database with another encoding
+				 */
+				if (entry->encoding == GetDatabaseEncoding())
+					values[i++] = PointerGetDatum(cstring_to_text_with_len(query_txt, query_len));
+				else
+				{
+					enc = pg_any_to_server(query_txt, query_len, entry->encoding);
+					values[i++] = CStringGetTextDatum(enc);
+					if (enc != query_txt)
+						pfree(enc);
+				}
 				/* plan at column number 9 */
-				if (planid && tmp.planinfo.plan_text[0])
-					values[i++] = CStringGetTextDatum(tmp.planinfo.plan_text);
+				if (planid && tmp_meta.planinfo.plan_text[0])
+					values[i++] = CStringGetTextDatum(tmp_meta.planinfo.plan_text);
 				else
 					nulls[i++] = true;
 			}
@@ -2404,36 +4706,24 @@ pg_stat_monitor_internal(FunctionCallInfo fcinfo,
 		}
 
 		/* application_name at column number 15 */
-		if (strlen(tmp.info.application_name) > 0)
-			values[i++] = CStringGetTextDatum(tmp.info.application_name);
+		if (strlen(tmp_meta.application_name) > 0)
+			values[i++] = CStringGetTextDatum(tmp_meta.application_name);
 		else
 			nulls[i++] = true;
 
 		/* relations at column number 14 */
-		if (tmp.info.num_relations > 0)
+		if (tmp_meta.num_relations > 0)
 		{
 			int			j;
-			char	   *text_str = palloc0(TOTAL_RELS_LENGTH);
-			char	   *tmp_str = palloc0(TOTAL_RELS_LENGTH);
-			bool		first = true;
 
-			/*
-			 * Need to calculate the actual size, and avoid unnessary memory
-			 * usage
-			 */
-			for (j = 0; j < tmp.info.num_relations; j++)
+			resetStringInfo(&rels);
+			for (j = 0; j < tmp_meta.num_relations; j++)
 			{
-				if (first)
-				{
-					snprintf(text_str, 1024, "%s", tmp.info.relations[j]);
-					first = false;
-					continue;
-				}
-				snprintf(tmp_str, 1024, "%s,%s", text_str, tmp.info.relations[j]);
-				snprintf(text_str, 1024, "%s", tmp_str);
+				if (j > 0)
+					appendStringInfoChar(&rels, ',');
+				pgsm_append_relation_name(&rels, dbid, &tmp_meta.relations[j], &relnames);
 			}
-			pfree(tmp_str);
-			values[i++] = CStringGetTextDatum(text_str);
+			values[i++] = PointerGetDatum(cstring_to_text_with_len(rels.data, rels.len));
 		}
 		else
 			nulls[i++] = true;
@@ -2445,19 +4735,19 @@ pg_stat_monitor_internal(FunctionCallInfo fcinfo,
 			values[i++] = Int64GetDatumFast((int64) tmp.info.cmd_type);
 
 		/* elevel at column number 16 */
-		values[i++] = Int64GetDatumFast(tmp.error.elevel);
+		values[i++] = Int64GetDatumFast(tmp_meta.error.elevel);
 
 		/* sqlcode at column number 17 */
-		if (strlen(tmp.error.sqlcode) == 0)
+		if (strlen(tmp_meta.error.sqlcode) == 0)
 			nulls[i++] = true;
 		else
-			values[i++] = CStringGetTextDatum(tmp.error.sqlcode);
+			values[i++] = CStringGetTextDatum(tmp_meta.error.sqlcode);
 
 		/* message at column number 18 */
-		if (strlen(tmp.error.message) == 0)
+		if (strlen(tmp_meta.error.message) == 0)
 			nulls[i++] = true;
 		else
-			values[i++] = CStringGetTextDatum(tmp.error.message);
+			values[i++] = CStringGetTextDatum(tmp_meta.error.message);
 
 		/* bucket_start_time at column number 19 */
 		values[i++] = TimestampTzGetDatum(pgsm->bucket_start_time[entry->key.bucket_id]);
@@ -2550,28 +4840,18 @@ pg_stat_monitor_internal(FunctionCallInfo fcinfo,
 		/* cpu_sys_time at column number 51 */
 		values[i++] = Float8GetDatumFast(tmp.sysinfo.stime);
 		{
-			char		buf[256];
-			Datum		wal_bytes;
-
 			/* wal_records at column number 52 */
 			values[i++] = Int64GetDatumFast(tmp.walusage.wal_records);
 
 			/* wal_fpi at column number 53 */
 			values[i++] = Int64GetDatumFast(tmp.walusage.wal_fpi);
 
-			snprintf(buf, sizeof buf, UINT64_FORMAT, tmp.walusage.wal_bytes);
-
-			/* Convert to numeric */
-			wal_bytes = DirectFunctionCall3(numeric_in,
-											CStringGetDatum(buf),
-											ObjectIdGetDatum(0),
-											Int32GetDatum(-1));
 			/* wal_bytes at column number 54 */
-			values[i++] = wal_bytes;
+			values[i++] = pgsm_uint64_numeric(tmp.walusage.wal_bytes);
 
 			/* application_name at column number 55 */
-			if (strlen(tmp.info.comments) > 0)
-				values[i++] = CStringGetTextDatum(tmp.info.comments);
+			if (strlen(tmp_meta.comments) > 0)
+				values[i++] = CStringGetTextDatum(tmp_meta.comments);
 			else
 				nulls[i++] = true;
 
@@ -2598,169 +4878,324 @@ pg_stat_monitor_internal(FunctionCallInfo fcinfo,
 		/* bucket_done at column number 67 */
 		values[i++] = BoolGetDatum(pg_atomic_read_u64(&pgsm->current_wbucket) != bucketid);
 
+		/* overflow at column number 68 */
+		values[i++] = BoolGetDatum(tmpkey.overflow);
+
+		/* sample_rate at column number 69 */
+		values[i++] = Float8GetDatumFast(sample_rate);
+
+		/* topk_error at column number 70 */
+		values[i++] = Float8GetDatumFast(entry->topk_error);
+
+		if (changes)
+		{
+			/* generation and cursor, for pg_stat_monitor_changes() only */
+			values[i++] = Int64GetDatumFast((int64) generation);
+			values[i++] = Int64GetDatumFast((int64) cursor);
+		}
+
 		/* clean up and return the tuplestore */
 		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
-
-		if (query_txt)
-			pfree(query_txt);
-		if (parent_query_txt)
-			pfree(parent_query_txt);
 	}
 	/* clean up and return the tuplestore */
-	pgsm_hash_seq_term(&hstat);
-	pgsm_lock_release(pgsm);
+	if (top_entries)
+		pfree(top_entries);
+	else
+		pgsm_hash_seq_term(&hstat);
+	pgsm_all_partitions_lock_release(pgsm);
+
+	pfree(rels.data);
+	if (relnames)
+		hash_destroy(relnames);
 }
 
-static uint64
-get_next_wbucket(pgsmSharedState *pgsm)
+/*
+ * Switch to a new bucket once the current one has expired. The entries left
+ * over in the new bucket from its previous use are evicted before the bucket
+ * is published in current_wbucket, so foreground backends never see them.
+ *
+ * Returns the number of milliseconds until the current bucket expires.
+ */
+static long
+pgsm_rotate_bucket(pgsmSharedState *pgsm)
 {
 	struct timeval tv;
 	uint64		current_bucket_sec;
 	uint64		new_bucket_id;
 	uint64		prev_bucket_id;
-	struct tm;
-	bool		update_bucket = false;
+	long		delay;
 
 	gettimeofday(&tv, NULL);
 	current_bucket_sec = pg_atomic_read_u64(&pgsm->prev_bucket_sec);
 
-	/*
-	 * If current bucket expired we loop attempting to update prev_bucket_sec.
-	 *
-	 * pg_atomic_compare_exchange_u64 may fail in two possible ways: 1.
-	 * Another thread/process updated the variable before us. 2. A spurious
-	 * failure / hardware event.
-	 *
-	 * In both failure cases we read prev_bucket_sec from memory again, if it
-	 * was a spurious failure then the value of prev_bucket_sec must be the
-	 * same as before, which will cause the while loop to execute again.
-	 *
-	 * If another thread updated prev_bucket_sec, then its current value will
-	 * definitely make the while condition to fail, we can stop the loop as
-	 * another thread has already updated prev_bucket_sec.
-	 */
-	while ((tv.tv_sec - (uint) current_bucket_sec) >= ((uint) pgsm_bucket_time))
-	{
-		if (pg_atomic_compare_exchange_u64(&pgsm->prev_bucket_sec, &current_bucket_sec, (uint64) tv.tv_sec))
-		{
-			update_bucket = true;
-			break;
-		}
-
-		current_bucket_sec = pg_atomic_read_u64(&pgsm->prev_bucket_sec);
-	}
-
-	if (update_bucket)
+	if ((tv.tv_sec - (uint) current_bucket_sec) >= ((uint) pgsm_bucket_time))
 	{
+		TimestampTz bucket_start_time;
+		instr_time	start;
+		instr_time	duration;
 
 		new_bucket_id = (tv.tv_sec / pgsm_bucket_time) % pgsm_max_buckets;
+		prev_bucket_id = pg_atomic_read_u64(&pgsm->current_wbucket);
+
+		/* Allign the value in prev_bucket_sec to the bucket start time */
+		tv.tv_sec = (tv.tv_sec) - (tv.tv_sec % pgsm_bucket_time);
+		current_bucket_sec = (uint64) tv.tv_sec;
 
-		/* Update bucket id and retrieve the previous one. */
-		prev_bucket_id = pg_atomic_exchange_u64(&pgsm->current_wbucket, new_bucket_id);
+		bucket_start_time = (TimestampTz) tv.tv_sec -
+			((POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY);
 
+		/*
+		 * The new start time is set before the bucket is emptied, under the
+		 * lock pgsm_flush_pending() holds, so that statistics pending since
+		 * before are discarded rather than merged into the new bucket.
+		 */
+		INSTR_TIME_SET_CURRENT(start);
 		pgsm_lock_aquire(pgsm, LW_EXCLUSIVE);
+		pgsm->bucket_start_time[new_bucket_id] = bucket_start_time * USECS_PER_SEC;
 		hash_entry_dealloc(new_bucket_id, prev_bucket_id, NULL);
-
 		pgsm_lock_release(pgsm);
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
 
-		/* Allign the value in prev_bucket_sec to the bucket start time */
-		tv.tv_sec = (tv.tv_sec) - (tv.tv_sec % pgsm_bucket_time);
+		elog(DEBUG1, "[pg_stat_monitor] pgsm_rotate_bucket: evicted bucket " UINT64_FORMAT " in %.3f ms.",
+			 new_bucket_id, INSTR_TIME_GET_MILLISEC(duration));
 
-		pg_atomic_exchange_u64(&pgsm->prev_bucket_sec, (uint64) tv.tv_sec);
+		/* Publish the new bucket only once its start time is in place */
+		pg_atomic_write_u64(&pgsm->prev_bucket_sec, current_bucket_sec);
+		pg_write_barrier();
+		pg_atomic_write_u64(&pgsm->current_wbucket, new_bucket_id);
 
-		pgsm->bucket_start_time[new_bucket_id] = (TimestampTz) tv.tv_sec -
-			((POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY);
-		pgsm->bucket_start_time[new_bucket_id] = pgsm->bucket_start_time[new_bucket_id] * USECS_PER_SEC;
-		return new_bucket_id;
+		gettimeofday(&tv, NULL);
 	}
 
-	return pg_atomic_read_u64(&pgsm->current_wbucket);
+	delay = ((long) (current_bucket_sec + pgsm_bucket_time) - (long) tv.tv_sec) * 1000L -
+		(long) (tv.tv_usec / 1000);
+
+	return Max(delay, 10L);
+}
+
+static void
+pgsm_bgworker_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
 }
 
 /*
- * This function expects a NORMALIZED query as the input.
- * It iterates oer the normalized query skipping comments and
- * multiple spaces. All spaces are converted to ' ' so that we
- * the calculation is independent of the space type whether
- * newline, tab, or any other type. Trailing and leading spaces
- * are also removed before calculating the hash.
+ * Main entry point of the background worker. It owns the bucket rotation, so
+ * that no foreground backend has to pay for evicting an expired bucket.
  */
-uint64
-get_pgsm_query_id_hash(const char *norm_query, int norm_len)
+void
+pgsm_bgworker_main(Datum main_arg)
 {
-	char	   *query;
-	char	   *q_iter;
-	char	   *norm_q_iter = (char *) norm_query;
-	uint64		pgsm_query_id = 0;
+	pgsmSharedState *pgsm;
 
-	if (!pgsm_enable_pgsm_query_id)
-		return 0;
+	pqsignal(SIGTERM, pgsm_bgworker_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	if (!IsSystemInitialized())
+		proc_exit(0);
 
-	query = palloc(norm_len + 1);
-	q_iter = query;
+	pgsm = pgsm_get_ss();
 
-	while (norm_q_iter && *norm_q_iter && norm_q_iter < (norm_query + norm_len))
+	while (!got_sigterm)
 	{
-		/*
-		 * Skip multiline comments, + 1 is safe even if we've reach end of
-		 * string
-		 */
-		if (*norm_q_iter == '/' && *(norm_q_iter + 1) == '*')
-		{
-			while (*norm_q_iter && *norm_q_iter != '*' && *(norm_q_iter + 1) != '/')
-				norm_q_iter++;
+		long		delay = pgsm_rotate_bucket(pgsm);
 
-			/* Skip the '/' if the current character is valid. */
-			if (*norm_q_iter)
-				norm_q_iter++;
-		}
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 delay,
+						 PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
 
-		/*
-		 * Skip single line comments, + 1 is safe even if we've reach end of
-		 * string
-		 */
-		if (*norm_q_iter == '-' && *(norm_q_iter + 1) == '-')
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	proc_exit(0);
+}
+
+/*
+ * Incremental version of hash_any_extended() with a zero seed, so that the
+ * canonical form of a query can be hashed as it is produced.  The mixing is
+ * the one of hash_bytes_extended() in src/common/hashfn.c, and the result is
+ * bit for bit the same as hashing the whole string at once.  The only thing
+ * lookup3 needs upfront is the length of the input.
+ */
+typedef struct pgsmQueryIdHash
+{
+	uint32		a,
+				b,
+				c;
+	unsigned char block[12];
+	int			used;
+} pgsmQueryIdHash;
+
+#define pgsm_hash_rot(x, k) (((x) << (k)) | ((x) >> (32 - (k))))
+
+#define pgsm_hash_mix(a, b, c) \
+{ \
+  a -= c;  a ^= pgsm_hash_rot(c, 4);	c += b; \
+  b -= a;  b ^= pgsm_hash_rot(a, 6);	a += c; \
+  c -= b;  c ^= pgsm_hash_rot(b, 8);	b += a; \
+  a -= c;  a ^= pgsm_hash_rot(c,16);	c += b; \
+  b -= a;  b ^= pgsm_hash_rot(a,19);	a += c; \
+  c -= b;  c ^= pgsm_hash_rot(b, 4);	b += a; \
+}
+
+#define pgsm_hash_final(a, b, c) \
+{ \
+  c ^= b; c -= pgsm_hash_rot(b,14); \
+  a ^= c; a -= pgsm_hash_rot(c,11); \
+  b ^= a; b -= pgsm_hash_rot(a,25); \
+  c ^= b; c -= pgsm_hash_rot(b,16); \
+  a ^= c; a -= pgsm_hash_rot(c, 4); \
+  b ^= a; b -= pgsm_hash_rot(a,14); \
+  c ^= b; c -= pgsm_hash_rot(b,24); \
+}
+
+static inline uint32
+pgsm_hash_word(const unsigned char *k)
+{
+#ifdef WORDS_BIGENDIAN
+	return k[3] + ((uint32) k[2] << 8) + ((uint32) k[1] << 16) + ((uint32) k[0] << 24);
+#else
+	return k[0] + ((uint32) k[1] << 8) + ((uint32) k[2] << 16) + ((uint32) k[3] << 24);
+#endif
+}
+
+static inline void
+pgsm_hash_init(pgsmQueryIdHash *h, int len)
+{
+	h->a = h->b = h->c = 0x9e3779b9 + (uint32) len + 3923095;
+	h->used = 0;
+}
+
+static inline void
+pgsm_hash_mix_block(pgsmQueryIdHash *h)
+{
+	h->a += pgsm_hash_word(h->block);
+	h->b += pgsm_hash_word(h->block + 4);
+	h->c += pgsm_hash_word(h->block + 8);
+	pgsm_hash_mix(h->a, h->b, h->c);
+	h->used = 0;
+}
+
+static inline void
+pgsm_hash_byte(pgsmQueryIdHash *h, unsigned char ch)
+{
+	/* A full block is only mixed once we know it isn't the last one */
+	if (h->used == sizeof(h->block))
+		pgsm_hash_mix_block(h);
+	h->block[h->used++] = ch;
+}
+
+static uint64
+pgsm_hash_end(pgsmQueryIdHash *h)
+{
+	if (h->used == sizeof(h->block))
+		pgsm_hash_mix_block(h);
+
+	/* The last 11 bytes, zero padded, so they add nothing past the end */
+	memset(h->block + h->used, 0, sizeof(h->block) - h->used);
+	h->a += pgsm_hash_word(h->block);
+	h->b += pgsm_hash_word(h->block + 4);
+#ifdef WORDS_BIGENDIAN
+	h->c += pgsm_hash_word(h->block + 8);
+#else
+	/* the lowest byte of c is reserved for the length */
+	h->c += pgsm_hash_word(h->block + 8) << 8;
+#endif
+	pgsm_hash_final(h->a, h->b, h->c);
+
+	return ((uint64) h->b << 32) | h->c;
+}
+
+/*
+ * Walk the canonical form of a query, which skips comment openings and
+ * collapses white space into single ' ' characters, without leading or
+ * trailing spaces.  The characters are hashed into h if given, and their
+ * number is returned.
+ *
+ * Only the two characters opening a block comment are dropped, the rest of
+ * the comment is treated as text.  That is how the pgsm_query_id has always been
+ * computed, and changing it would give existing statements a new id.
+ */
+static int
+pgsm_query_id_walk(const char *query, int len, pgsmQueryIdHash *h)
+{
+	const char *p = query;
+	const char *end = query + len;
+	bool		space = false;
+	int			n = 0;
+
+	while (p < end && *p)
+	{
+		/* + 1 is safe even if we've reached the end of the string */
+		if (*p == '/' && *(p + 1) == '*')
+			p += 2;
+
+		/* Skip single line comments */
+		if (*p == '-' && *(p + 1) == '-')
 		{
-			while (*norm_q_iter && *norm_q_iter != '\n')
-				norm_q_iter++;
+			while (*p && *p != '\n')
+				p++;
 		}
 
-		/* Skip white spaces */
-		if (scanner_isspace(*norm_q_iter))
+		/* Collapse white spaces, but only emit them before other text */
+		if (scanner_isspace(*p))
 		{
-			while (scanner_isspace(*++norm_q_iter));
+			while (scanner_isspace(*++p));
+			space = (n > 0);
+			continue;
+		}
 
-			/*
-			 * Let's replace it with a simple space. -1 is safe as we are
-			 * making sure we are not at the start of the string.
-			 */
-			if (q_iter != query && !scanner_isspace(*(q_iter - 1)))
-				*q_iter++ = ' ';
+		if (*p == '\0')
+			break;
 
-			continue;
+		if (space)
+		{
+			if (h)
+				pgsm_hash_byte(h, ' ');
+			n++;
+			space = false;
 		}
 
-		*q_iter++ = *norm_q_iter++;
+		if (h)
+			pgsm_hash_byte(h, (unsigned char) *p);
+		n++;
+		p++;
 	}
 
-	/* Ensure we have a terminating zero at the end */
-	*q_iter = '\0';
+	return n;
+}
 
-	/* Get rid of trailing spaces */
-	while (q_iter > query && *q_iter == '\0')
-	{
-		q_iter--;
+/*
+ * This function expects a NORMALIZED query as the input.
+ * It iterates over the normalized query skipping comments and
+ * multiple spaces. All spaces are converted to ' ' so that we
+ * the calculation is independent of the space type whether
+ * newline, tab, or any other type. Trailing and leading spaces
+ * are also removed before calculating the hash.
+ *
+ * The hash is computed without building the canonical string: a first walk
+ * gets its length, which seeds the hash, and a second one feeds it.
+ */
+uint64
+get_pgsm_query_id_hash(const char *norm_query, int norm_len)
+{
+	pgsmQueryIdHash h;
 
-		/* Continue reducing the string size if space is found. */
-		if (scanner_isspace(*q_iter))
-			*q_iter = '\0';
-	}
+	if (!pgsm_enable_pgsm_query_id)
+		return 0;
 
-	/* Calcuate the hash. */
-	pgsm_query_id = pgsm_hash_string(query, strlen(query));
+	pgsm_hash_init(&h, pgsm_query_id_walk(norm_query, norm_len, NULL));
+	pgsm_query_id_walk(norm_query, norm_len, &h);
 
-	pfree(query);
-	return pgsm_query_id;
+	return pgsm_hash_end(&h);
 }
 
 #if PG_VERSION_NUM < 140000
@@ -3550,21 +5985,286 @@ generate_normalized_query(JumbleState *jstate, const char *query,
 		last_tok_len = tok_len;
 	}
 
-	/*
-	 * We've copied up until the last ignorable constant.  Copy over the
-	 * remaining bytes of the original query string.
-	 */
-	len_to_wrt = query_len - quer_loc;
-
-	Assert(len_to_wrt >= 0);
-	memcpy(norm_query + n_quer_loc, query + quer_loc, len_to_wrt);
-	n_quer_loc += len_to_wrt;
+	/*
+	 * We've copied up until the last ignorable constant.  Copy over the
+	 * remaining bytes of the original query string.
+	 */
+	len_to_wrt = query_len - quer_loc;
+
+	Assert(len_to_wrt >= 0);
+	memcpy(norm_query + n_quer_loc, query + quer_loc, len_to_wrt);
+	n_quer_loc += len_to_wrt;
+
+	Assert(n_quer_loc <= norm_query_buflen);
+	norm_query[n_quer_loc] = '\0';
+
+	*query_len_p = n_quer_loc;
+	return norm_query;
+}
+
+/*
+ * Look up the normalized text of a statement in the backend local cache.
+ * Re-scanning the statement to find the lengths of its constants is the
+ * expensive part of normalizing it, so the cache is used when the statement
+ * has the same queryid as a cached one and its text only differs by the
+ * constants, as checked by pgsm_norm_cache_match(). Returns NULL on a miss.
+ *
+ * Note that this sorts the constant locations of jstate, as
+ * fill_in_constant_lengths() would.
+ */
+static pgsmNormCacheEntry *
+pgsm_norm_cache_lookup(uint64 queryid, JumbleState *jstate,
+					   const char *query, int query_loc, int query_len)
+{
+	pgsmNormCacheEntry *entry = NULL;
+
+	if (norm_cache != NULL)
+		entry = (pgsmNormCacheEntry *) hash_search(norm_cache, &queryid, HASH_FIND, NULL);
+
+	if (entry == NULL ||
+		entry->clocations_count != jstate->clocations_count ||
+		entry->highest_extern_param_id != jstate->highest_extern_param_id)
+	{
+		norm_cache_misses++;
+		return NULL;
+	}
+
+	if (jstate->clocations_count > 1)
+		qsort(jstate->clocations, jstate->clocations_count,
+			  sizeof(LocationLen), comp_location);
+
+	if (!pgsm_norm_cache_match(entry, jstate, query, query_loc, query_len))
+	{
+		norm_cache_misses++;
+		return NULL;
+	}
+
+	dlist_move_head(&norm_cache_lru, &entry->lru_node);
+	norm_cache_hits++;
+	return entry;
+}
+
+/*
+ * Check that a statement only differs from a cached one by its constants:
+ * the text before the first constant, between each of them and after the
+ * last one must be the same. The lengths of the new constants aren't known,
+ * they are taken to be what's left between those parts of the text, so each
+ * of them must look like a single literal.
+ */
+static bool
+pgsm_norm_cache_match(pgsmNormCacheEntry *entry, JumbleState *jstate,
+					  const char *query, int query_loc, int query_len)
+{
+	LocationLen *locs = jstate->clocations;
+	int			old_pos = 0;	/* end of previous constant in entry->query */
+	int			new_pos = -1;	/* start of previous constant in query */
+	int			last_loc = -1;
+	int			seg_len;
+	int			seg_start;
+	int			i;
+
+	for (i = 0; i < jstate->clocations_count; i++)
+	{
+		int			loc = locs[i].location - query_loc;
+
+		/* Duplicates are ignored, they must be the same ones */
+		if (loc <= last_loc)
+		{
+			if (entry->clocations[i].length >= 0)
+				return false;
+			continue;
+		}
+		if (entry->clocations[i].length < 0)
+			return false;
+		last_loc = loc;
+
+		/* The text before the constant */
+		seg_len = entry->clocations[i].location - old_pos;
+		seg_start = loc - seg_len;
+		if (new_pos < 0)
+		{
+			if (seg_start != 0)
+				return false;
+		}
+		else if (!pgsm_norm_cache_is_constant(query + new_pos, seg_start - new_pos))
+			return false;
+		if (memcmp(query + seg_start, entry->query + old_pos, seg_len) != 0)
+			return false;
+
+		new_pos = loc;
+		old_pos = entry->clocations[i].location + entry->clocations[i].length;
+	}
+
+	/* The text after the last constant */
+	seg_len = entry->query_len - old_pos;
+	seg_start = query_len - seg_len;
+	if (new_pos < 0 || !pgsm_norm_cache_is_constant(query + new_pos, seg_start - new_pos))
+		return false;
+
+	return memcmp(query + seg_start, entry->query + old_pos, seg_len) == 0;
+}
+
+/*
+ * Check that a part of a statement is a single literal: a number, possibly
+ * negative, a keyword such as TRUE or a quoted string. Whitespace and
+ * comments are only accepted inside a string, so that they are never taken
+ * as a part of a constant.
+ */
+static bool
+pgsm_norm_cache_is_constant(const char *p, int len)
+{
+	const char *quote;
+	int			i;
+
+	if (len <= 0)
+		return false;
+
+	quote = memchr(p, '\'', len);
+	if (quote != NULL)
+	{
+		int			prefix_len = quote - p;
+
+		/* The E, B, X, N or U& prefix of the string, if any */
+		if (prefix_len > 2)
+			return false;
+		for (i = 0; i < prefix_len; i++)
+		{
+			if (!((p[i] >= 'a' && p[i] <= 'z') || (p[i] >= 'A' && p[i] <= 'Z') || p[i] == '&'))
+				return false;
+		}
+		return len - prefix_len >= 2 && p[len - 1] == '\'';
+	}
+
+	if (p[0] == '$')
+	{
+		/* A dollar-quoted string ends with the same tag as it starts */
+		const char *tag_end = memchr(p + 1, '$', len - 1);
+		int			tag_len;
+
+		if (tag_end == NULL)
+			return false;
+		tag_len = tag_end - p + 1;
+		return len >= 2 * tag_len && memcmp(p, p + len - tag_len, tag_len) == 0;
+	}
+
+	if (p[0] == '-')
+	{
+		p++;
+		len--;
+		if (len == 0)
+			return false;
+	}
+
+	for (i = 0; i < len; i++)
+	{
+		char		c = p[i];
+
+		if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+			(c >= 'A' && c <= 'Z') || c == '_' || c == '.')
+			continue;
+		/* The sign of an exponent */
+		if ((c == '+' || c == '-') && i > 0 && (p[i - 1] == 'e' || p[i - 1] == 'E'))
+			continue;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Remember the normalized text of a statement, after
+ * generate_normalized_query() has filled in the lengths of its constants.
+ * The least recently used statement is evicted once the cache is full.
+ */
+static void
+pgsm_norm_cache_insert(uint64 queryid, JumbleState *jstate,
+					   const char *query, int query_loc, int query_len,
+					   const char *norm_query, int norm_query_len,
+					   uint64 pgsm_query_id)
+{
+	pgsmNormCacheEntry *entry;
+	Size		locs_size = jstate->clocations_count * sizeof(LocationLen);
+	char	   *data;
+	bool		found;
+	int			last_loc = -1;
+	int			i;
+
+	if (query_len > PGSM_NORM_CACHE_MAX_LEN)
+		return;
+
+	/* The scanner may have given up before finding all the constants */
+	for (i = 0; i < jstate->clocations_count; i++)
+	{
+		int			loc = jstate->clocations[i].location - query_loc;
+
+		if (loc <= last_loc)
+			continue;
+		if (jstate->clocations[i].length < 0)
+			return;
+		last_loc = loc;
+	}
+
+	if (norm_cache == NULL)
+	{
+		HASHCTL		info;
+
+		norm_cache_cxt = AllocSetContextCreate(TopMemoryContext,
+											   "pg_stat_monitor normalized queries",
+											   ALLOCSET_DEFAULT_SIZES);
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(uint64);
+		info.entrysize = sizeof(pgsmNormCacheEntry);
+		info.hcxt = norm_cache_cxt;
+		norm_cache = hash_create("pg_stat_monitor normalized queries", PGSM_NORM_CACHE_SIZE,
+								 &info, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	data = MemoryContextAllocExtended(norm_cache_cxt,
+									  locs_size + query_len + norm_query_len + 2,
+									  MCXT_ALLOC_NO_OOM);
+	if (data == NULL)
+		return;
+
+	entry = (pgsmNormCacheEntry *) hash_search(norm_cache, &queryid, HASH_ENTER, &found);
+	if (found)
+	{
+		/* Differently written, keep the latest one */
+		dlist_delete(&entry->lru_node);
+		pfree(entry->clocations);
+	}
+	else if (hash_get_num_entries(norm_cache) > PGSM_NORM_CACHE_SIZE)
+	{
+		pgsmNormCacheEntry *victim;
+
+		victim = dlist_container(pgsmNormCacheEntry, lru_node, dlist_tail_node(&norm_cache_lru));
+		dlist_delete(&victim->lru_node);
+		pfree(victim->clocations);
+		hash_search(norm_cache, &victim->queryid, HASH_REMOVE, NULL);
+	}
+
+	/* The locations go first, to keep them aligned */
+	entry->clocations = (LocationLen *) data;
+	entry->clocations_count = jstate->clocations_count;
+	for (i = 0; i < jstate->clocations_count; i++)
+	{
+		entry->clocations[i].location = jstate->clocations[i].location - query_loc;
+		entry->clocations[i].length = jstate->clocations[i].length;
+	}
+
+	entry->query = data + locs_size;
+	memcpy(entry->query, query, query_len);
+	entry->query[query_len] = '\0';
+	entry->query_len = query_len;
 
-	Assert(n_quer_loc <= norm_query_buflen);
-	norm_query[n_quer_loc] = '\0';
+	entry->norm_query = entry->query + query_len + 1;
+	memcpy(entry->norm_query, norm_query, norm_query_len);
+	entry->norm_query[norm_query_len] = '\0';
+	entry->norm_query_len = norm_query_len;
 
-	*query_len_p = n_quer_loc;
-	return norm_query;
+	entry->highest_extern_param_id = jstate->highest_extern_param_id;
+	entry->pgsm_query_id = pgsm_query_id;
+	dlist_push_head(&norm_cache_lru, &entry->lru_node);
 }
 
 /*
@@ -3746,6 +6446,69 @@ pg_stat_monitor_hook_stats(PG_FUNCTION_ARGS)
 	return (Datum) 0;
 }
 
+/*
+ * List the backends that hold statistics not flushed to the shared hash yet.
+ */
+Datum
+pg_stat_monitor_pending_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	pgsmPendingStats *slots;
+	int			i;
+
+	/* Safety check... */
+	if (!IsSystemInitialized())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("[pg_stat_monitor] pg_stat_monitor_pending_stats: Must be loaded via shared_preload_libraries.")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("[pg_stat_monitor] pg_stat_monitor_pending_stats: Set-valued function called in context that cannot accept a set.")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("[pg_stat_monitor] pg_stat_monitor_pending_stats: Materialize mode required, but it is not " \
+						"allowed in this context.")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "[pg_stat_monitor] pg_stat_monitor_pending_stats: Return type must be a row type.");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	slots = pgsm_get_pending_stats();
+	for (i = 0; i < MAX_BACKEND_PROCESES; i++)
+	{
+		Datum		values[3];
+		bool		nulls[3] = {0};
+		int64		calls = slots[i].calls;
+
+		if (slots[i].pid == 0 || calls == 0)
+			continue;
+
+		values[0] = Int32GetDatum(slots[i].pid);
+		values[1] = Int64GetDatumFast(calls);
+		values[2] = TimestampTzGetDatum(slots[i].since);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
 
 void
 pgsm_emit_log_hook(ErrorData *edata)
@@ -3788,6 +6551,194 @@ time_diff(struct timeval end, struct timeval start)
 	return mend - mstart;
 }
 
+/*
+ * Take the CPU time at the start of a statement, with the source selected by
+ * pgsm_cpu_time_source. getrusage() is a full system call that also collects
+ * many counters we don't need. The CPU clock of the backend is cheaper to
+ * read, but doesn't split user and system time. Sampling only calls
+ * getrusage() for a random one in PGSM_CPU_TIME_SAMPLE_INTERVAL statements.
+ *
+ * Statements nest, as a function called by a statement runs statements of its
+ * own, so the start is kept per nesting level. The array of starts is grown
+ * when a statement is nested deeper than any before.
+ */
+static void
+pgsm_cpu_time_start(void)
+{
+	int			source = pgsm_cpu_time_source;
+	pgsmCpuTimeStart *cpu_start;
+
+	if (nesting_level < 0)
+		return;
+
+	if (nesting_level >= cpu_time_levels)
+	{
+		int			levels = Max(cpu_time_levels * 2, 16);
+		int			i;
+
+		while (levels <= nesting_level)
+			levels *= 2;
+
+		if (cpu_time_starts == NULL)
+			cpu_time_starts = (pgsmCpuTimeStart *)
+				MemoryContextAlloc(TopMemoryContext, levels * sizeof(pgsmCpuTimeStart));
+		else
+			cpu_time_starts = (pgsmCpuTimeStart *)
+				repalloc(cpu_time_starts, levels * sizeof(pgsmCpuTimeStart));
+
+		for (i = cpu_time_levels; i < levels; i++)
+			cpu_time_starts[i].source = -1;
+		cpu_time_levels = levels;
+	}
+
+	cpu_start = &cpu_time_starts[nesting_level];
+	cpu_start->source = -1;
+
+	switch (source)
+	{
+		case PGSM_CPU_TIME_SAMPLED:
+#if PG_VERSION_NUM >= 150000
+			if (pg_prng_double(&pg_global_prng_state) >= 1.0 / PGSM_CPU_TIME_SAMPLE_INTERVAL)
+				return;
+#else
+			if (random() >= ((double) MAX_RANDOM_VALUE + 1) / PGSM_CPU_TIME_SAMPLE_INTERVAL)
+				return;
+#endif
+			/* FALLTHROUGH */
+		case PGSM_CPU_TIME_RUSAGE:
+			if (getrusage(RUSAGE_SELF, &cpu_start->rusage) != 0)
+			{
+				elog(DEBUG1, "[pg_stat_monitor] pgsm_cpu_time_start: Failed to execute getrusage.");
+				return;
+			}
+			break;
+		case PGSM_CPU_TIME_THREAD:
+#ifdef CLOCK_THREAD_CPUTIME_ID
+			if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start->cputime) != 0)
+			{
+				elog(DEBUG1, "[pg_stat_monitor] pgsm_cpu_time_start: Failed to execute clock_gettime.");
+				return;
+			}
+			break;
+#else
+			return;
+#endif
+		default:
+			return;
+	}
+
+	cpu_start->source = source;
+}
+
+/*
+ * Get the CPU time used since pgsm_cpu_time_start() at the same nesting
+ * level. Sampled times are scaled up, so that the totals stay right on
+ * average.
+ */
+static void
+pgsm_cpu_time_end(SysInfo *sys_info)
+{
+	pgsmCpuTimeStart *cpu_start;
+	struct rusage rusage_end;
+
+	sys_info->utime = 0;
+	sys_info->stime = 0;
+
+	if (nesting_level < 0 || nesting_level >= cpu_time_levels)
+		return;
+
+	cpu_start = &cpu_time_starts[nesting_level];
+
+	switch (cpu_start->source)
+	{
+		case PGSM_CPU_TIME_RUSAGE:
+		case PGSM_CPU_TIME_SAMPLED:
+			if (getrusage(RUSAGE_SELF, &rusage_end) != 0)
+			{
+				elog(DEBUG1, "[pg_stat_monitor] pgsm_cpu_time_end: Failed to execute getrusage.");
+				break;
+			}
+			sys_info->utime = time_diff(rusage_end.ru_utime, cpu_start->rusage.ru_utime);
+			sys_info->stime = time_diff(rusage_end.ru_stime, cpu_start->rusage.ru_stime);
+			if (cpu_start->source == PGSM_CPU_TIME_SAMPLED)
+			{
+				sys_info->utime *= PGSM_CPU_TIME_SAMPLE_INTERVAL;
+				sys_info->stime *= PGSM_CPU_TIME_SAMPLE_INTERVAL;
+			}
+			break;
+#ifdef CLOCK_THREAD_CPUTIME_ID
+		case PGSM_CPU_TIME_THREAD:
+			{
+				struct timespec cputime_end;
+
+				if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cputime_end) != 0)
+				{
+					elog(DEBUG1, "[pg_stat_monitor] pgsm_cpu_time_end: Failed to execute clock_gettime.");
+					break;
+				}
+				sys_info->utime = (double) (cputime_end.tv_sec - cpu_start->cputime.tv_sec) * 1000.0 +
+					(double) (cputime_end.tv_nsec - cpu_start->cputime.tv_nsec) / 1000000.0;
+				break;
+			}
+#endif
+		default:
+			break;
+	}
+
+	/* Don't use the same start twice */
+	cpu_start->source = -1;
+}
+
+/*
+ * Resolution of the CPU times reported with the current pgsm_cpu_time_source,
+ * in milliseconds. NULL if CPU time isn't tracked.
+ */
+Datum
+pg_stat_monitor_cpu_time_resolution(PG_FUNCTION_ARGS)
+{
+	switch (pgsm_cpu_time_source)
+	{
+		case PGSM_CPU_TIME_RUSAGE:
+		case PGSM_CPU_TIME_SAMPLED:
+			/* struct timeval has microseconds */
+			PG_RETURN_FLOAT8(0.001);
+		case PGSM_CPU_TIME_THREAD:
+#ifdef CLOCK_THREAD_CPUTIME_ID
+			{
+				struct timespec res;
+
+				if (clock_getres(CLOCK_THREAD_CPUTIME_ID, &res) == 0)
+					PG_RETURN_FLOAT8((double) res.tv_sec * 1000.0 + (double) res.tv_nsec / 1000000.0);
+			}
+#endif
+			break;
+		default:
+			break;
+	}
+
+	PG_RETURN_NULL();
+}
+
+/*
+ * Hits and misses of the normalized statement cache of this backend.
+ */
+Datum
+pg_stat_monitor_normalize_cache_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[3];
+	bool		nulls[3] = {0};
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "[pg_stat_monitor] pg_stat_monitor_normalize_cache_stats: Return type must be a row type.");
+
+	values[0] = Int64GetDatum((int64) norm_cache_hits);
+	values[1] = Int64GetDatum((int64) norm_cache_misses);
+	values[2] = Int32GetDatum(norm_cache ? (int32) hash_get_num_entries(norm_cache) : 0);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
 char *
 unpack_sql_state(int sql_state)
 {
@@ -3855,6 +6806,21 @@ set_histogram_bucket_timings(void)
 	{
 		histogram_bucket_timings(b_count, &hist_bucket_timings[b_count][HISTOGRAM_START], &hist_bucket_timings[b_count][HISTOGRAM_END]);
 	}
+
+	/*
+	 * End times of the buckets for get_histogram_bucket(), padded with
+	 * infinity. The max outlier bucket has no end and is left out.
+	 */
+	StaticAssertStmt(HISTOGRAM_LOOKUP_SIZE >= MAX_RESPONSE_BUCKET + 2,
+					 "histogram lookup table is too small");
+	hist_bucket_count_ends = hist_bucket_count_total - (int) (hist_bucket_max < HISTOGRAM_MAX_TIME);
+	for (b_count = 0; b_count < HISTOGRAM_LOOKUP_SIZE; b_count++)
+	{
+		if (b_count < hist_bucket_count_ends)
+			hist_bucket_ends[b_count] = hist_bucket_timings[b_count][HISTOGRAM_END];
+		else
+			hist_bucket_ends[b_count] = get_float8_infinity();
+	}
 }
 
 /*
@@ -3903,24 +6869,30 @@ histogram_bucket_timings(int index, double *b_start, double *b_end)
 
 /*
  * Get the histogram bucket index for a given query time.
+ *
+ * The buckets are contiguous, each one starting where the previous one ends,
+ * so the first bucket whose end is not below the time is the one it falls
+ * in. That's found with a branch-free binary search over hist_bucket_ends,
+ * which always takes the same six steps. Times outside of all buckets,
+ * including the max outlier bucket that has no end, go to the last bucket.
  */
 static int
 get_histogram_bucket(double q_time)
 {
-	int			index = 0;
-	double		exec_time = q_time;
+	int			base = 0;
 
-	for (index = 0; index < hist_bucket_count_total; index++)
-	{
-		if (exec_time >= hist_bucket_timings[index][HISTOGRAM_START] && exec_time <= hist_bucket_timings[index][HISTOGRAM_END])
-			return index;
-	}
+	/* Also catches NaN */
+	if (!(q_time >= hist_bucket_timings[0][HISTOGRAM_START]))
+		return (hist_bucket_count_total - 1);
 
-	/*
-	 * So haven't found a histogram bucket for this query. That's only
-	 * possible for the last bucket as its end time is less than 0.
-	 */
-	return (hist_bucket_count_total - 1);
+	base += (hist_bucket_ends[base + 31] < q_time) ? 32 : 0;
+	base += (hist_bucket_ends[base + 15] < q_time) ? 16 : 0;
+	base += (hist_bucket_ends[base + 7] < q_time) ? 8 : 0;
+	base += (hist_bucket_ends[base + 3] < q_time) ? 4 : 0;
+	base += (hist_bucket_ends[base + 1] < q_time) ? 2 : 0;
+	base += (hist_bucket_ends[base] < q_time) ? 1 : 0;
+
+	return (base < hist_bucket_count_ends) ? base : (hist_bucket_count_total - 1);
 }
 
 /*
@@ -3962,45 +6934,196 @@ get_histogram_timings(PG_FUNCTION_ARGS)
 	return CStringGetTextDatum(text_str);
 }
 
+/*
+ * Skip over the leading chunks of [p, end) that contain none of the characters
+ * in stops, using vector instructions where available.  Only whole chunks are
+ * skipped, the caller has to look at the remaining bytes one by one.
+ */
+static inline const char *
+comment_scan_skip(const char *p, const char *end, const char *stops)
+{
+#if PG_VERSION_NUM >= 160000
+	while (end - p >= (ptrdiff_t) sizeof(Vector8))
+	{
+		Vector8		chunk;
+		const char *c;
+
+		vector8_load(&chunk, (const uint8 *) p);
+		for (c = stops; *c != '\0'; c++)
+		{
+			if (vector8_has(chunk, (uint8) *c))
+				return p;
+		}
+		p += sizeof(Vector8);
+	}
+#endif
+	return p;
+}
+
+/* Same character classes as ident_start and ident_cont in scan.l */
+static inline bool
+comment_scan_ident_start(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_' ||
+		IS_HIGHBIT_SET(c);
+}
+
+static inline bool
+comment_scan_ident_char(unsigned char c)
+{
+	return comment_scan_ident_start(c) || (c >= '0' && c <= '9') || c == '$';
+}
+
+/*
+ * Extract the block comments of a query into comments, separated by ", ".
+ *
+ * This is a single pass over the query text that follows the lexical rules of
+ * the backend scanner closely enough to not pick up comment markers inside
+ * string literals, quoted identifiers, dollar quotes or line comments.  Block
+ * comments may nest, as they do in SQL.  Comments that don't fit into max_len
+ * anymore are left out.
+ */
 static void
-extract_query_comments(const char *query, char *comments, size_t max_len)
+extract_query_comments(const char *query, int query_len, char *comments, size_t max_len)
 {
-	int			rc;
-	size_t		nmatch = 1;
-	regmatch_t	pmatch;
-	regoff_t	comment_len,
-				total_len = 0;
-	const char *s = query;
+	const char *p = query;
+	const char *end = query + query_len;
+	size_t		total_len = 0;
 
-	while (total_len < max_len)
+	while (p < end)
 	{
-		rc = regexec(&preg_query_comments, s, nmatch, &pmatch, 0);
-		if (rc != 0)
+		p = comment_scan_skip(p, end, "/-'\"$");
+		if (p >= end)
 			break;
 
-		comment_len = pmatch.rm_eo - pmatch.rm_so;
+		switch (*p)
+		{
+			case '/':
+				if (p + 1 < end && p[1] == '*')
+				{
+					const char *start = p;
+					size_t		comment_len;
+					size_t		sep_len = total_len > 0 ? 2 : 0;
+					int			depth = 1;
+
+					p += 2;
+					while (depth > 0)
+					{
+						p = comment_scan_skip(p, end, "*/");
+						if (p + 1 >= end)
+							return;		/* unterminated comment */
+
+						if (p[0] == '*' && p[1] == '/')
+						{
+							depth--;
+							p += 2;
+						}
+						else if (p[0] == '/' && p[1] == '*')
+						{
+							depth++;
+							p += 2;
+						}
+						else
+							p++;
+					}
+
+					comment_len = p - start;
+					if (total_len + sep_len + comment_len >= max_len)
+						return;		/* no room left for this comment */
 
-		if (total_len + comment_len > max_len)
-			break;				/* TODO: log error in error view, insufficient
-								 * space for comment. */
+					memcpy(comments + total_len, ", ", sep_len);
+					memcpy(comments + total_len + sep_len, start, comment_len);
+					total_len += sep_len + comment_len;
+					continue;
+				}
+				break;
 
-		total_len += comment_len;
+			case '-':
+				if (p + 1 < end && p[1] == '-')
+				{
+					p = memchr(p, '\n', end - p);
+					if (p == NULL)
+						return;
+					continue;
+				}
+				break;
 
-		/* Not 1st iteration, append ", " before next comment. */
-		if (s != query)
-		{
-			if (total_len + 2 > max_len)
-				break;			/* TODO: log error in error view, insufficient
-								 * space for ", " + comment. */
+			case '\'':
+				{
+					/* Backslash escapes, as in E'...' */
+					bool		escapes = !standard_conforming_strings ||
+						(p > query && (p[-1] == 'E' || p[-1] == 'e') &&
+						 (p - 1 == query || !comment_scan_ident_char(p[-2])));
 
-			memcpy(comments, ", ", 2);
-			comments += 2;
-			total_len += 2;
-		}
+					p++;
+					for (;;)
+					{
+						p = comment_scan_skip(p, end, escapes ? "'\\" : "'");
+						if (p >= end)
+							return;		/* unterminated literal */
+
+						if (*p == '\\' && escapes)
+							p += 2;
+						else if (*p == '\'')
+						{
+							p++;
+							if (p >= end || *p != '\'')
+								break;
+							p++;
+						}
+						else
+							p++;
+					}
+					continue;
+				}
+
+			case '"':
+				for (;;)
+				{
+					p = memchr(p + 1, '"', end - p - 1);
+					if (p == NULL)
+						return;		/* unterminated identifier */
+
+					p++;
+					if (p >= end || *p != '"')
+						break;
+				}
+				continue;
+
+			case '$':
+				{
+					const char *tag = p;
+					size_t		tag_len;
+
+					/* $1 is a parameter, and foo$bar$ an identifier */
+					if (p > query && comment_scan_ident_char(p[-1]))
+						break;
+
+					p++;
+					if (p < end && comment_scan_ident_start(*p))
+					{
+						while (p < end && *p != '$' && comment_scan_ident_char(*p))
+							p++;
+					}
+					if (p >= end || *p != '$')
+						continue;
 
-		memcpy(comments, s + pmatch.rm_so, comment_len);
-		comments += comment_len;
-		s += pmatch.rm_eo;
+					tag_len = ++p - tag;
+					for (;;)
+					{
+						p = memchr(p, '$', end - p);
+						if (p == NULL || end - p < (ptrdiff_t) tag_len)
+							return;		/* unterminated dollar quote */
+
+						if (memcmp(p, tag, tag_len) == 0)
+							break;
+						p++;
+					}
+					p += tag_len;
+					continue;
+				}
+		}
+		p++;
 	}
 }
 
@@ -4039,3 +7162,39 @@ pgsm_lock_release(pgsmSharedState *pgsm)
 	disable_error_capture = false;
 	LWLockRelease(pgsm->lock);
 }
+
+/*
+ * Lock the hash partition holding the given hash code.
+ */
+static void
+pgsm_partition_lock_aquire(pgsmSharedState *pgsm, uint32 hashcode, LWLockMode mode)
+{
+	/* Disable error capturing while holding the lock to avoid deadlocks */
+	LWLockAcquire(PGSM_PARTITION_LOCK(pgsm, hashcode), mode);
+	disable_error_capture = true;
+}
+
+static void
+pgsm_partition_lock_release(pgsmSharedState *pgsm, uint32 hashcode)
+{
+	disable_error_capture = false;
+	LWLockRelease(PGSM_PARTITION_LOCK(pgsm, hashcode));
+}
+
+/*
+ * Lock all the hash partitions, needed to scan the whole hash table.
+ */
+static void
+pgsm_all_partitions_lock_aquire(pgsmSharedState *pgsm, LWLockMode mode)
+{
+	/* Disable error capturing while holding the lock to avoid deadlocks */
+	pgsm_partitions_lock(pgsm, mode);
+	disable_error_capture = true;
+}
+
+static void
+pgsm_all_partitions_lock_release(pgsmSharedState *pgsm)
+{
+	disable_error_capture = false;
+	pgsm_partitions_unlock(pgsm);
+}
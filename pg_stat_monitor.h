@@ -28,6 +28,7 @@
 #include <sys/resource.h>
 
 #include "lib/dshash.h"
+#include "lib/ilist.h"
 #include "utils/dsa.h"
 
 #include "access/hash.h"
@@ -48,6 +49,7 @@
 #include "pgstat.h"
 #include "storage/fd.h"
 #include "storage/ipc.h"
+#include "storage/proc.h"
 #include "storage/spin.h"
 #include "tcop/utility.h"
 #include "utils/acl.h"
@@ -68,7 +70,7 @@
 #define USAGE_EXEC(duration)	(1.0)
 #define USAGE_INIT				(1.0)	/* including initial planning */
 #define ASSUMED_LENGTH_INIT		1024	/* initial assumed mean query length */
-#define USAGE_DECREASE_FACTOR	(0.99)	/* decreased every entry_dealloc */
+#define USAGE_DECREASE_FACTOR	(0.99)	/* decreased every hash_entry_evict */
 #define STICKY_DECREASE_FACTOR	(0.50)	/* factor for sticky entries */
 #define USAGE_DEALLOC_PERCENT	5	/* free this % of entries at once */
 
@@ -76,14 +78,13 @@
 
 #define HISTOGRAM_MAX_TIME		50000000
 #define MAX_RESPONSE_BUCKET 50
+#define HISTOGRAM_LOOKUP_SIZE	64	/* power of 2 >= MAX_RESPONSE_BUCKET + 2 */
+#define PGSM_CPU_TIME_SAMPLE_INTERVAL	16	/* see PGSM_CPU_TIME_SAMPLED */
 #define INVALID_BUCKET_ID	-1
 #define TEXT_LEN			255
 #define ERROR_MESSAGE_LEN	100
-#define REL_TYPENAME_LEN	64
 #define REL_LST				10
-#define REL_LEN				132 /* REL_TYPENAME_LEN * 2 (relname + schema) + 1
-								 * (for view indication) + 1 and dot and
-								 * string terminator */
+#define REL_NAME_LEN		(NAMEDATALEN * 2)	/* schema, dot, relation name */
 #define CMD_LST				10
 #define CMD_LEN				20
 #define APPLICATIONNAME_LEN	NAMEDATALEN
@@ -97,11 +98,28 @@
 #define MAX_BUCKETS_MEM 					((int64)pgsm_max * 1024 * 1024)
 #define BUCKETS_MEM_OVERFLOW() 				((hash_get_num_entries(pgsm_hash) * sizeof(pgsmEntry)) >= MAX_BUCKETS_MEM)
 #define MAX_BUCKET_ENTRIES 					(MAX_BUCKETS_MEM / sizeof(pgsmEntry))
+#define PGSM_OVERFLOW_ENTRIES				256	/* room kept for overflow entries */
+#define PGSM_TOPK_ENTRIES					(MAX_BUCKET_ENTRIES / pgsm_max_buckets)
 #define QUERY_BUFFER_OVERFLOW(x,y)  		((x + y + sizeof(uint64) + sizeof(uint64)) > MAX_QUERY_BUF)
 #define QUERY_MARGIN 						100
 #define MIN_QUERY_LEN						10
 #define SQLCODE_LEN                         20
-#define TOTAL_RELS_LENGTH					(REL_LST * REL_LEN)
+
+/*
+ * The shared statistics hash is split into lock partitions in the same way
+ * as the shared buffer mapping table. Must be a power of 2.
+ */
+#define PGSM_NUM_LOCK_PARTITIONS			16
+#define PGSM_LOCK_PARTITION(hashcode)		((hashcode) % PGSM_NUM_LOCK_PARTITIONS)
+#define PGSM_PARTITION_LOCK(pgsm, hashcode) \
+	(&(pgsm)->partition_locks[PGSM_LOCK_PARTITION(hashcode)].lock)
+
+/* Index of the backend in the per-backend shared arrays */
+#if PG_VERSION_NUM >= 170000
+#define PGSM_MY_PROC_NUMBER					MyProcNumber
+#else
+#define PGSM_MY_PROC_NUMBER					(MyProc->pgprocno)
+#endif
 
 #if PG_VERSION_NUM >= 130000
 #define	MAX_SETTINGS                        15
@@ -205,6 +223,18 @@ typedef struct PlanInfo
 	size_t		plan_len;		/* strlen(plan_text) */
 } PlanInfo;
 
+/*
+ * Buffer the plan tree is serialized into to compute the planid, see
+ * pgsm_plan_fingerprint(). Once full, it is replaced by its hash.
+ */
+#define PLAN_JUMBLE_SIZE	1024
+
+typedef struct pgsmPlanJumble
+{
+	unsigned char buf[PLAN_JUMBLE_SIZE];
+	Size		len;			/* bytes used in buf */
+} pgsmPlanJumble;
+
 typedef struct pgsmHashKey
 {
 	uint64		bucket_id;		/* bucket number */
@@ -215,6 +245,7 @@ typedef struct pgsmHashKey
 	Oid			dbid;			/* database OID */
 	uint32		ip;				/* client ip address */
 	bool		toplevel;		/* query executed at top level */
+	bool		overflow;		/* statements that got no entry of their own */
 	uint64		parentid;		/* parent queryid of current query */
 } pgsmHashKey;
 
@@ -223,11 +254,6 @@ typedef struct QueryInfo
 	dsa_pointer parent_query;
 	int64		type;			/* type of query, options are query, info,
 								 * warning, error, fatal */
-	char		application_name[APPLICATIONNAME_LEN];
-	char		comments[COMMENTS_LEN];
-	char		relations[REL_LST][REL_LEN];	/* List of relation involved
-												 * in the query */
-	int			num_relations;	/* Number of relation in the query */
 	CmdType		cmd_type;		/* query command type
 								 * SELECT/UPDATE/DELETE/INSERT */
 } QueryInfo;
@@ -244,6 +270,8 @@ typedef struct Calls
 	int64		calls;			/* # of times executed */
 	int64		rows;			/* total # of retrieved or affected rows */
 	double		usage;			/* usage factor */
+	double		weight;			/* # of executions the calls stand for when
+								 * sampling */
 } Calls;
 
 
@@ -270,19 +298,6 @@ typedef struct Blocks
 	double		temp_blk_read_time; /* time spent reading temp blocks, in msec */
 	double		temp_blk_write_time;	/* time spent writing temp blocks, in
 										 * msec */
-
-	/*
-	 * Variables for local entry. The values to be passed to pgsm_update_entry
-	 * from pgsm_store.
-	 */
-	instr_time	instr_shared_blk_read_time; /* time spent reading shared
-											 * blocks */
-	instr_time	instr_shared_blk_write_time;	/* time spent writing shared
-												 * blocks */
-	instr_time	instr_local_blk_read_time;	/* time spent reading local blocks */
-	instr_time	instr_local_blk_write_time; /* time spent writing local blocks */
-	instr_time	instr_temp_blk_read_time;	/* time spent reading temp blocks */
-	instr_time	instr_temp_blk_write_time;	/* time spent writing temp blocks */
 } Blocks;
 
 typedef struct JitInfo
@@ -301,16 +316,6 @@ typedef struct JitInfo
 	int64		jit_emission_count; /* number of times emission time has been
 									 * > 0 */
 	double		jit_emission_time;	/* total time to emit jit code */
-
-	/*
-	 * Variables for local entry. The values to be passed to pgsm_update_entry
-	 * from pgsm_store.
-	 */
-	instr_time	instr_generation_counter;	/* generation counter */
-	instr_time	instr_inlining_counter; /* inlining counter */
-	instr_time	instr_deform_counter;	/* deform counter */
-	instr_time	instr_optimization_counter; /* optimization counter */
-	instr_time	instr_emission_counter; /* emission counter */
 } JitInfo;
 
 typedef struct SysInfo
@@ -334,17 +339,92 @@ typedef struct Counters
 
 	Calls		plancalls;
 	CallTime	plantime;
-	PlanInfo	planinfo;
 
 	Blocks		blocks;
 	SysInfo		sysinfo;
 	JitInfo		jitinfo;
-	ErrorInfo	error;
 	Wal_Usage	walusage;
 	int			resp_calls[MAX_RESPONSE_BUCKET];	/* execution time's in
 													 * msec */
 } Counters;
 
+/*
+ * Variables for local entry. The values to be passed to pgsm_update_entry
+ * from pgsm_store.
+ */
+typedef struct LocalInstr
+{
+	instr_time	instr_shared_blk_read_time; /* time spent reading shared
+											 * blocks */
+	instr_time	instr_shared_blk_write_time;	/* time spent writing shared
+												 * blocks */
+	instr_time	instr_local_blk_read_time;	/* time spent reading local blocks */
+	instr_time	instr_local_blk_write_time; /* time spent writing local blocks */
+	instr_time	instr_temp_blk_read_time;	/* time spent reading temp blocks */
+	instr_time	instr_temp_blk_write_time;	/* time spent writing temp blocks */
+	instr_time	instr_generation_counter;	/* generation counter */
+	instr_time	instr_inlining_counter; /* inlining counter */
+	instr_time	instr_deform_counter;	/* deform counter */
+	instr_time	instr_optimization_counter; /* optimization counter */
+	instr_time	instr_emission_counter; /* emission counter */
+} LocalInstr;
+
+/*
+ * Relation accessed by a statement. The name is looked up again when the view
+ * is read from the same database, the one captured when the statement ran is
+ * used otherwise.
+ */
+typedef struct pgsmRelation
+{
+	Oid			relid;			/* relation OID */
+	bool		is_view;		/* shown with a trailing '*' */
+	char		name[REL_NAME_LEN]; /* schema qualified name, or empty */
+} pgsmRelation;
+
+/*
+ * Statement metadata that is set once or rarely changes. Backend local
+ * entries keep it in this form, see pgsmSharedMeta for shared entries.
+ */
+typedef struct pgsmEntryMeta
+{
+	char		datname[NAMEDATALEN];	/* database name */
+	char		username[NAMEDATALEN];	/* user name */
+	char		application_name[APPLICATIONNAME_LEN];
+	char		comments[COMMENTS_LEN];
+	int			num_relations;	/* Number of relation in the query */
+	pgsmRelation relations[REL_LST];	/* List of relation involved in the
+										 * query */
+	PlanInfo	planinfo;
+	ErrorInfo	error;
+	LocalInstr	instr;
+} pgsmEntryMeta;
+
+/*
+ * Metadata of a shared entry, kept out of line in the DSA area so that the
+ * hash table only holds the counters. The strings are packed one after the
+ * other into a chunk of the exact size, see pgsm_meta_pack(). It is never
+ * modified in place, but replaced while holding the exclusive lock of the
+ * entry's partition.
+ */
+typedef struct pgsmSharedMeta
+{
+	int64		elevel;			/* error elevel */
+	char		sqlcode[SQLCODE_LEN];	/* error sqlcode  */
+	uint64		planid;			/* plan identifier */
+	uint64		message_hash;	/* hash of the error message */
+	int			flags;			/* PGSM_META_* strings that are set */
+	int			num_relations;	/* Number of relation in the query */
+	char		data[FLEXIBLE_ARRAY_MEMBER];	/* relations, then datname,
+												 * username, application name,
+												 * comments, plan text and
+												 * error message */
+} pgsmSharedMeta;
+
+/* pgsmSharedMeta.flags, the first seen strings that have been set */
+#define PGSM_META_COMMENTS			0x01
+#define PGSM_META_APPLICATION_NAME	0x02
+#define PGSM_META_PLAN				0x04
+
 /* Some global structure to get the cpu usage, really don't like the idea of global variable */
 
 /*
@@ -354,34 +434,143 @@ typedef struct pgsmEntry
 {
 	pgsmHashKey key;			/* hash key of entry - MUST BE FIRST */
 	uint64		pgsm_query_id;	/* pgsm generate normalized query hash */
-	char		datname[NAMEDATALEN];	/* database name */
-	char		username[NAMEDATALEN];	/* user name */
 	Counters	counters;		/* the statistics for this query */
 	int			encoding;		/* query text encoding */
 	TimestampTz stats_since;	/* timestamp of entry allocation */
 	TimestampTz minmax_stats_since; /* timestamp of last min/max values reset */
-	slock_t		mutex;			/* protects the counters only */
+	double		topk_error;		/* calls or time the entry may have missed
+								 * before it was created, in top-K mode */
+	uint64		generation;		/* value of the shared generation when the
+								 * counters were last changed */
+	uint64		serial;			/* tells an entry from a later one with the
+								 * same key */
+	slock_t		mutex;			/* protects the counters and generation */
+	dlist_node	bucket_node;	/* link in the entry list of its bucket */
 	union
 	{
 		dsa_pointer query_pos;	/* query location within query buffer */
 		char	   *query_pointer;
 	}			query_text;
+	union
+	{
+		dsa_pointer meta_pos;	/* pgsmSharedMeta location within the dsa
+								 * area */
+		pgsmEntryMeta *meta_pointer;
+	}			meta;
 } pgsmEntry;
 
+/*
+ * Entries of one bucket, so that evicting a bucket doesn't have to scan the
+ * whole hash. Entries are linked and unlinked while holding the exclusive
+ * lock of their hash partition, the mutex protects against other partitions
+ * doing the same. Only used with the classic shared memory hash.
+ */
+typedef struct pgsmBucket
+{
+	slock_t		mutex;			/* protects the list and the count */
+	dlist_head	entries;		/* pgsmEntry.bucket_node list */
+	int64		num_entries;	/* number of entries in the list */
+	double		topk_threshold; /* highest count evicted in top-K mode */
+} pgsmBucket;
+
+/*
+ * Query texts are shared by all the entries of a bucket, user and database
+ * with the same queryid and pgsm_query_id, whatever their client or
+ * application. Unless pgsm_normalized_query is on the text keeps the
+ * constants of the statement, so it is never shared with other users, and
+ * each bucket shows the constants of its own first statement. A text is
+ * freed once the last entry using it is removed.
+ */
+typedef struct pgsmTextKey
+{
+	uint64		bucket_id;		/* bucket number */
+	uint64		queryid;		/* query identifier */
+	uint64		pgsm_query_id;	/* pgsm generate normalized query hash */
+	Oid			userid;			/* user OID */
+	Oid			dbid;			/* database OID */
+} pgsmTextKey;
+
+typedef struct pgsmText
+{
+	pgsmTextKey key;			/* hash key of entry - MUST BE FIRST */
+	dsa_pointer text_pos;		/* query text location within the dsa area */
+	int64		refcount;		/* number of entries using the text */
+} pgsmText;
+
+/*
+ * Backend local cache of database, user or relation names, see
+ * pgsm_cached_name().
+ * Entries are marked invalid rather than removed by the syscache callbacks,
+ * so pointers to the names stay usable.
+ */
+typedef struct pgsmNameCacheEntry
+{
+	Oid			oid;			/* hash key of entry - MUST BE FIRST */
+	bool		valid;			/* false once the catalog row has changed */
+	char		name[REL_NAME_LEN];
+} pgsmNameCacheEntry;
+
+/*
+ * Backend local record of the plans whose text has been stored, see
+ * pgsm_plan_seen(). The key is the hash key of the entry the plan belongs
+ * to, without the bucket id: the epoch tells whether the shared entry may
+ * have been removed since.
+ */
+typedef struct pgsmPlanSeenEntry
+{
+	pgsmHashKey key;			/* hash key of entry - MUST BE FIRST */
+	uint64		epoch;			/* plan_epoch when the text was stored */
+} pgsmPlanSeenEntry;
+
+#define PGSM_PLAN_SEEN_MAX 4096
+
+/*
+ * Backend local entry of a statement in flight, see
+ * pgsm_get_entry_for_query(). Kept in a simplehash table by queryid.
+ */
+typedef struct pgsmLocalEntry
+{
+	uint64		queryid;		/* hash key of entry - MUST BE FIRST */
+	char		status;			/* hash status, used by simplehash */
+	pgsmEntry  *entry;
+} pgsmLocalEntry;
+
+/*
+ * Statistics a backend has accumulated locally and not yet flushed to the
+ * shared hash, see pgsm_flush_batch_size. Each backend only writes its own
+ * slot, readers may see slightly outdated values.
+ */
+typedef struct pgsmPendingStats
+{
+	int			pid;			/* backend pid, 0 if nothing is pending */
+	int64		calls;			/* number of statements not yet flushed */
+	TimestampTz since;			/* time of the oldest statement not yet
+								 * flushed */
+} pgsmPendingStats;
+
 /*
  * Global shared state
  */
 typedef struct pgsmSharedState
 {
-	LWLock	   *lock;			/* protects hashtable search/modification */
+	LWLock	   *lock;			/* serializes bucket rotation and reset */
+	LWLockPadded *partition_locks;	/* protect hashtable partitions
+									 * search/modification */
+	LWLock	   *text_lock;		/* protects the query text hash */
+	LWLock	   *evict_lock;		/* serializes hash_entry_evict() */
 	slock_t		mutex;			/* protects following fields only: */
 	pg_atomic_uint64 current_wbucket;
 	pg_atomic_uint64 prev_bucket_sec;
+	pg_atomic_uint64 plan_epoch;	/* bumped whenever entries are removed */
+	pg_atomic_uint64 generation;	/* bumped whenever changes are read, see
+									 * pg_stat_monitor_changes() */
+	pg_atomic_uint64 entry_serial;	/* source of pgsmEntry.serial */
 	int			hash_tranche_id;
 	void	   *raw_dsa_area;	/* DSA area pointer to store query texts.
 								 * dshash also lives in this memory when
 								 * USE_DYNAMIC_HASH is enabled */
 	PGSM_HASH_TABLE_HANDLE hash_handle;
+	HTAB	   *text_hash;		/* shared query texts, see pgsmText */
 
 	/*
 	 * hash table handle. can be either classic shared memory hash or dshash
@@ -389,6 +578,8 @@ typedef struct pgsmSharedState
 	 */
 
 	bool		pgsm_oom;
+	dsa_pointer pending_stats;	/* per-backend pgsmPendingStats array */
+	pgsmBucket *buckets;		/* per-bucket entry lists */
 	TimestampTz bucket_start_time[];	/* start time of the bucket */
 } pgsmSharedState;
 
@@ -438,6 +629,30 @@ typedef struct JumbleState
 } JumbleState;
 #endif
 
+/*
+ * Backend local cache of normalized statements, see pgsm_norm_cache_lookup().
+ * The statement text and the constant locations it was normalized from are
+ * kept, so that another statement with the same queryid can be checked to
+ * differ only in its constants.
+ */
+typedef struct pgsmNormCacheEntry
+{
+	uint64		queryid;		/* hash key of entry - MUST BE FIRST */
+	dlist_node	lru_node;		/* position in the LRU list, most recent
+								 * first */
+	uint64		pgsm_query_id;	/* pgsm_query_id of the normalized text */
+	int			highest_extern_param_id;
+	int			clocations_count;
+	LocationLen *clocations;	/* sorted, relative to the start of query */
+	char	   *query;			/* statement text */
+	int			query_len;
+	char	   *norm_query;		/* normalized statement text */
+	int			norm_query_len;
+} pgsmNormCacheEntry;
+
+#define PGSM_NORM_CACHE_SIZE	256
+#define PGSM_NORM_CACHE_MAX_LEN	8192	/* longer statements aren't cached */
+
 /* guc.c */
 void		init_guc(void);
 
@@ -455,9 +670,15 @@ pgsmSharedState *pgsm_get_ss(void);
 void		hash_query_entries();
 void		hash_query_entry_dealloc(int new_bucket_id, int old_bucket_id, unsigned char *query_buffer[]);
 void		hash_entry_dealloc(int new_bucket_id, int old_bucket_id, unsigned char *query_buffer);
-pgsmEntry  *hash_entry_alloc(pgsmSharedState *pgsm, pgsmHashKey *key, int encoding);
+pgsmEntry  *hash_entry_alloc(pgsmSharedState *pgsm, pgsmHashKey *key, uint32 hashcode, int encoding);
+bool		hash_entry_evict(uint64 bucket_id);
+void		pgsm_partitions_lock(pgsmSharedState *pgsm, LWLockMode mode);
+void		pgsm_partitions_unlock(pgsmSharedState *pgsm);
 Size		pgsm_ShmemSize(void);
 void		pgsm_startup(void);
+pgsmPendingStats *pgsm_get_pending_stats(void);
+dsa_pointer pgsm_text_acquire(pgsmHashKey *key, uint64 pgsm_query_id, const char *query, int query_len);
+void		pgsm_text_release(pgsmHashKey *key, uint64 pgsm_query_id);
 
 /* hash_query.c */
 void		pgsm_startup(void);
@@ -466,6 +687,9 @@ MemoryContext GetPgsmMemoryContext(void);
 /* guc.c */
 void		init_guc(void);
 
+/* pg_stat_monitor.c */
+PGDLLEXPORT void pgsm_bgworker_main(Datum main_arg);
+
 /* GUC variables*/
 /*---- GUC variables ----*/
 typedef enum
@@ -482,6 +706,50 @@ static const struct config_enum_entry track_options[] =
 	{NULL, 0, false}
 };
 
+typedef enum
+{
+	PGSM_SAMPLE_RANDOM = 0,		/* sample executions at random */
+	PGSM_SAMPLE_QUERYID			/* sample queries by their queryid */
+} PGSMSampleMode;
+static const struct config_enum_entry sample_mode_options[] =
+{
+	{"random", PGSM_SAMPLE_RANDOM, false},
+	{"queryid", PGSM_SAMPLE_QUERYID, false},
+	{NULL, 0, false}
+};
+
+typedef enum
+{
+	PGSM_TOPK_OFF = 0,			/* evict the least used entries */
+	PGSM_TOPK_CALLS,			/* keep the entries with the most calls */
+	PGSM_TOPK_TIME				/* keep the entries with the most time */
+} PGSMTopKMetric;
+static const struct config_enum_entry topk_options[] =
+{
+	{"off", PGSM_TOPK_OFF, false},
+	{"calls", PGSM_TOPK_CALLS, false},
+	{"time", PGSM_TOPK_TIME, false},
+	{NULL, 0, false}
+};
+
+typedef enum
+{
+	PGSM_CPU_TIME_RUSAGE = 0,	/* getrusage() around every statement */
+	PGSM_CPU_TIME_THREAD,		/* CPU clock of the backend, no user/system
+								 * split */
+	PGSM_CPU_TIME_SAMPLED,		/* getrusage() around a random one in
+								 * PGSM_CPU_TIME_SAMPLE_INTERVAL */
+	PGSM_CPU_TIME_OFF			/* don't track CPU time */
+} PGSMCpuTimeSource;
+static const struct config_enum_entry cpu_time_source_options[] =
+{
+	{"getrusage", PGSM_CPU_TIME_RUSAGE, false},
+	{"thread_cputime", PGSM_CPU_TIME_THREAD, false},
+	{"sampled", PGSM_CPU_TIME_SAMPLED, false},
+	{"off", PGSM_CPU_TIME_OFF, false},
+	{NULL, 0, false}
+};
+
 typedef enum
 {
 	HISTOGRAM_START,
@@ -506,6 +774,12 @@ extern bool pgsm_track_utility;
 extern bool pgsm_track_application_names;
 extern bool pgsm_enable_pgsm_query_id;
 extern int	pgsm_track;
+extern double pgsm_sample_rate;
+extern int	pgsm_sample_mode;
+extern int	pgsm_topk;
+extern int	pgsm_cpu_time_source;
+extern int	pgsm_flush_batch_size;
+extern int	pgsm_flush_interval;
 
 #define DECLARE_HOOK(hook, ...) \
         static hook(__VA_ARGS__);
@@ -513,9 +787,11 @@ extern int	pgsm_track;
 #define HOOK_STATS_SIZE 0
 #endif
 
-void	   *pgsm_hash_find_or_insert(PGSM_HASH_TABLE * shared_hash, pgsmHashKey *key, bool *found);
-void	   *pgsm_hash_find(PGSM_HASH_TABLE * shared_hash, pgsmHashKey *key, bool *found);
+uint32		pgsm_hash_value(PGSM_HASH_TABLE * shared_hash, pgsmHashKey *key);
+void	   *pgsm_hash_find_or_insert(PGSM_HASH_TABLE * shared_hash, pgsmHashKey *key, uint32 hashcode, bool *found);
+void	   *pgsm_hash_find(PGSM_HASH_TABLE * shared_hash, pgsmHashKey *key, uint32 hashcode, bool *found);
 void		pgsm_hash_seq_init(PGSM_HASH_SEQ_STATUS * hstat, PGSM_HASH_TABLE * shared_hash, bool lock);
 void	   *pgsm_hash_seq_next(PGSM_HASH_SEQ_STATUS * hstat);
 void		pgsm_hash_seq_term(PGSM_HASH_SEQ_STATUS * hstat);
 void		pgsm_hash_delete_current(PGSM_HASH_SEQ_STATUS * hstat, PGSM_HASH_TABLE * shared_hash, void *key);
+void		pgsm_hash_delete(PGSM_HASH_TABLE * shared_hash, pgsmHashKey *key, uint32 hashcode);
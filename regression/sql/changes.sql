@@ -0,0 +1,17 @@
+CREATE EXTENSION pg_stat_monitor;
+SET pg_stat_monitor.pgsm_normalized_query = on;
+SELECT pg_stat_monitor_reset();
+SELECT 1 AS num;
+SELECT 1 AS num, 2 AS other;
+
+-- Everything changed since the start
+SELECT query, calls FROM pg_stat_monitor_changes(0) WHERE query LIKE 'SELECT $1 AS num%' ORDER BY query COLLATE "C";
+SELECT max(cursor) AS cursor FROM pg_stat_monitor_changes(0) \gset
+
+-- Only what changed since the cursor
+SELECT 2 AS num;
+SELECT query, calls FROM pg_stat_monitor_changes(:cursor) WHERE query LIKE 'SELECT $1 AS num%' ORDER BY query COLLATE "C";
+SELECT bool_and(generation > :cursor AND cursor > :cursor) FROM pg_stat_monitor_changes(:cursor);
+
+SELECT pg_stat_monitor_reset();
+DROP EXTENSION pg_stat_monitor;
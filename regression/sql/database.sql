@@ -22,7 +22,8 @@ SELECT * FROM t3,t4 WHERE t3.c = t4.d;
 \c contrib_regression
 DROP DATABASE db2;
 
-SELECT datname, query FROM pg_stat_monitor ORDER BY query COLLATE "C";
+-- Relations of other databases show the names they had when the statements ran
+SELECT datname, query, relations FROM pg_stat_monitor ORDER BY query COLLATE "C";
 SELECT pg_stat_monitor_reset();
 
 \c db1
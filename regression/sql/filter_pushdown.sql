@@ -0,0 +1,35 @@
+CREATE EXTENSION pg_stat_monitor;
+SET pg_stat_monitor.pgsm_normalized_query = on;
+SELECT pg_stat_monitor_reset();
+SELECT 1 AS num;
+SELECT 2 AS num;
+SELECT 3 AS num;
+SELECT 1 AS num, 2 AS other;
+
+-- Filter arguments of pg_stat_monitor_internal
+SELECT query, calls FROM pg_stat_monitor_internal(true, min_calls => 3) WHERE query LIKE 'SELECT $1 AS num%' ORDER BY query COLLATE "C";
+SELECT query, calls FROM pg_stat_monitor_internal(true, filter_queryid => (SELECT queryid FROM pg_stat_monitor WHERE query = 'SELECT $1 AS num, $2 AS other'));
+SELECT count(*) FROM pg_stat_monitor_internal(true, bucket_to => -1);
+SELECT count(*) FROM pg_stat_monitor_internal(true, filter_userid => 0);
+SELECT count(*) FROM pg_stat_monitor_internal(true, min_total_time => 1e9);
+
+-- Simple predicates on the view are pushed down to them
+CREATE FUNCTION function_call(q text) RETURNS SETOF text AS $$
+DECLARE
+    ln text;
+BEGIN
+    FOR ln IN EXECUTE 'EXPLAIN (VERBOSE, COSTS OFF) ' || q LOOP
+        IF ln LIKE '%Function Call:%' THEN
+            RETURN NEXT trim(ln);
+        END IF;
+    END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+SELECT function_call('SELECT query FROM pg_stat_monitor WHERE calls >= 3 AND bucket = 0');
+SELECT function_call('SELECT query FROM pg_stat_monitor WHERE 3 < calls AND total_exec_time > 0.5 AND userid = 10::oid AND queryid = 42');
+SELECT function_call('SELECT query FROM pg_stat_monitor WHERE calls >= 3 OR bucket = 0');
+SELECT query, calls FROM pg_stat_monitor WHERE calls >= 3 AND query LIKE 'SELECT $1 AS num%' ORDER BY query COLLATE "C";
+DROP FUNCTION function_call;
+
+SELECT pg_stat_monitor_reset();
+DROP EXTENSION pg_stat_monitor;
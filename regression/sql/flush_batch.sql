@@ -0,0 +1,25 @@
+CREATE EXTENSION pg_stat_monitor;
+SET pg_stat_monitor.pgsm_flush_batch_size = 1000;
+SET pg_stat_monitor.pgsm_flush_interval = '1h';
+SELECT pg_stat_monitor_reset();
+
+SELECT 1 AS num;
+SELECT 1 AS num;
+SELECT 1 AS num;
+SELECT pending_calls FROM pg_stat_monitor_pending_stats() WHERE pid = pg_backend_pid();
+
+-- Reading the view flushes the statistics of the own backend
+SELECT query, calls FROM pg_stat_monitor ORDER BY query COLLATE "C";
+SELECT pending_calls FROM pg_stat_monitor_pending_stats() WHERE pid = pg_backend_pid();
+
+-- Statistics waiting for longer than the interval are flushed by the next
+-- statement, even inside a transaction
+SET pg_stat_monitor.pgsm_flush_interval = '10ms';
+BEGIN;
+SELECT pg_sleep(0.1);
+SELECT 2 AS num;
+SELECT pending_calls FROM pg_stat_monitor_pending_stats() WHERE pid = pg_backend_pid();
+COMMIT;
+SELECT pg_stat_monitor_reset();
+
+DROP EXTENSION pg_stat_monitor;
@@ -0,0 +1,32 @@
+CREATE EXTENSION pg_stat_monitor;
+SET pg_stat_monitor.pgsm_normalized_query = on;
+SELECT pg_stat_monitor_reset();
+SELECT hits AS hits0, misses AS misses0 FROM pg_stat_monitor_normalize_cache_stats() \gset
+
+-- Only the constants differ, the normalized text is reused
+SELECT 1 AS a, 'x' AS b;
+SELECT 2 AS a, 'y' AS b;
+SELECT -3 AS a, 'z' AS b;
+
+-- Written differently, normalized again
+SELECT 4 AS a,  'w' AS b;
+SELECT 5 AS a,  'v' AS b;
+SELECT hits - :hits0 AS hits, misses - :misses0 AS misses FROM pg_stat_monitor_normalize_cache_stats();
+
+SELECT query, calls FROM pg_stat_monitor WHERE query LIKE 'SELECT $1 AS a%' ORDER BY query COLLATE "C";
+
+-- Cached statements follow pgsm_enable_pgsm_query_id, whatever it was when
+-- they were cached
+SET pg_stat_monitor.pgsm_enable_pgsm_query_id = off;
+SELECT pg_stat_monitor_reset();
+SELECT 6 AS a,  'u' AS b;
+SELECT 1 AS c;
+SELECT query, pgsm_query_id IS NOT NULL AS has_id FROM pg_stat_monitor WHERE query LIKE 'SELECT $1 AS %' ORDER BY query COLLATE "C";
+SET pg_stat_monitor.pgsm_enable_pgsm_query_id = on;
+SELECT pg_stat_monitor_reset();
+SELECT 7 AS a,  't' AS b;
+SELECT 2 AS c;
+SELECT query, pgsm_query_id IS NOT NULL AS has_id FROM pg_stat_monitor WHERE query LIKE 'SELECT $1 AS %' ORDER BY query COLLATE "C";
+
+SELECT pg_stat_monitor_reset();
+DROP EXTENSION pg_stat_monitor;
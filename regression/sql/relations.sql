@@ -54,6 +54,14 @@ SELECT * FROM v1,v2,v3,v4;
 SELECT query, relations from pg_stat_monitor ORDER BY query collate "C";
 SELECT pg_stat_monitor_reset();
 
+-- test that the names are looked up when the view is read
+SELECT pg_stat_monitor_reset();
+SELECT * FROM foo4;
+ALTER TABLE foo4 RENAME TO foo5;
+SELECT query, relations from pg_stat_monitor WHERE query LIKE 'SELECT * FROM foo%' ORDER BY query collate "C";
+ALTER TABLE foo5 RENAME TO foo4;
+SELECT pg_stat_monitor_reset();
+
 
 DROP VIEW v1;
 DROP VIEW v2;
@@ -0,0 +1,39 @@
+CREATE EXTENSION pg_stat_monitor;
+SELECT pg_stat_monitor_reset();
+
+-- Nothing is tracked with a sample rate of zero
+SET pg_stat_monitor.pgsm_sample_rate = 0;
+SELECT 1 AS num;
+SELECT 1 AS num;
+SET pg_stat_monitor.pgsm_sample_rate = 1;
+SELECT query, calls FROM pg_stat_monitor WHERE query LIKE 'SELECT 1 AS%' ORDER BY query COLLATE "C";
+
+-- The sampled executions stand for all of them
+SET pg_stat_monitor.pgsm_sample_rate = 0.5;
+\o /dev/null
+SELECT 'SELECT 2 AS num' FROM generate_series(1, 100) \gexec
+\o
+SET pg_stat_monitor.pgsm_sample_rate = 1;
+SELECT query, sample_rate FROM pg_stat_monitor WHERE query LIKE 'SELECT 2 AS%' ORDER BY query COLLATE "C";
+
+-- In queryid mode a query is either always tracked or never
+SET pg_stat_monitor.pgsm_sample_mode = 'queryid';
+SET pg_stat_monitor.pgsm_sample_rate = 0.5;
+\o /dev/null
+SELECT 'SELECT 3 AS num' FROM generate_series(1, 10) \gexec
+\o
+SET pg_stat_monitor.pgsm_sample_rate = 1;
+SELECT coalesce(max(calls), 10) AS calls, coalesce(max(sample_rate), 1) AS sample_rate FROM pg_stat_monitor WHERE query LIKE 'SELECT 3 AS%';
+RESET pg_stat_monitor.pgsm_sample_mode;
+
+-- Errors and utility statements are tracked regardless of the sample rate
+SET pg_stat_monitor.pgsm_sample_rate = 0;
+SELECT 1/0 AS sampled_error;
+CREATE TABLE sampled_table (a int);
+DROP TABLE sampled_table;
+SET pg_stat_monitor.pgsm_sample_rate = 1;
+SELECT sqlcode, message FROM pg_stat_monitor WHERE query LIKE 'SELECT 1/0 AS sampled_error%';
+SELECT count(*) AS utility FROM pg_stat_monitor WHERE query LIKE '%TABLE sampled_table%';
+
+SELECT pg_stat_monitor_reset();
+DROP EXTENSION pg_stat_monitor;
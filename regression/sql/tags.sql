@@ -2,6 +2,8 @@ CREATE EXTENSION pg_stat_monitor;
 Set pg_stat_monitor.pgsm_extract_comments = 'yes'; 
 SELECT pg_stat_monitor_reset();
 SELECT 1 AS num /* { "application", psql_app, "real_ip", 192.168.1.3) */;
+SELECT 'not /* a comment */' AS str /* first */, 2 AS num /* second */;
+SELECT $$ /* quoted */ $$ AS str /* outer /* nested */ comment */;
 SELECT query, comments FROM pg_stat_monitor ORDER BY query COLLATE "C";
 SELECT pg_stat_monitor_reset();
 DROP EXTENSION pg_stat_monitor;
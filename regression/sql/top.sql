@@ -0,0 +1,19 @@
+CREATE EXTENSION pg_stat_monitor;
+SET pg_stat_monitor.pgsm_normalized_query = on;
+SELECT pg_stat_monitor_reset();
+SELECT 1 AS num;
+SELECT 2 AS num;
+SELECT 3 AS num;
+SELECT 1 AS num, 2 AS other;
+SELECT 1 AS num, 2 AS other;
+SELECT count(*) FROM generate_series(1, 10);
+
+SELECT query, calls FROM pg_stat_monitor_top(2, 'calls');
+SELECT query, rows FROM pg_stat_monitor_top(1, 'rows');
+SELECT count(*) FROM pg_stat_monitor_top(3);
+SELECT count(*) FROM pg_stat_monitor_top(10, 'calls', -1);
+SELECT query FROM pg_stat_monitor_top(0);
+SELECT query FROM pg_stat_monitor_top(1, 'total_time');
+
+SELECT pg_stat_monitor_reset();
+DROP EXTENSION pg_stat_monitor;
@@ -30,9 +30,25 @@ DROP USER u2;
 SELECT username, query FROM pg_stat_monitor ORDER BY username, query COLLATE "C";
 SELECT pg_stat_monitor_reset();
 
+-- The statements of a user don't show the constants used by another one
+SET ROLE u1;
+SELECT 1 AS num WHERE 1 = 1;
+SET ROLE su;
+SELECT 1 AS num WHERE 2 = 2;
+SELECT username, query FROM pg_stat_monitor WHERE query LIKE 'SELECT 1 AS num%' ORDER BY username;
+SELECT pg_stat_monitor_reset();
+
+-- A renamed user shows up with the new name
+ALTER USER u1 RENAME TO u3;
+SET ROLE u3;
+SELECT * FROM t1;
+SET ROLE su;
+SELECT username, query FROM pg_stat_monitor WHERE query = 'SELECT * FROM t1';
+SELECT pg_stat_monitor_reset();
+
 DROP TABLE t1;
-DROP OWNED BY u1;
-DROP USER u1;
+DROP OWNED BY u3;
+DROP USER u3;
 
 DROP EXTENSION pg_stat_monitor;
 
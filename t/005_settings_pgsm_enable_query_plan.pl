@@ -65,6 +65,18 @@ trim($stdout);
 isnt($stdout,'',"Test: planid should not be empty");
 ok(length($stdout) > 0, 'Length of planid is > 0');
 
+# Test: the planid doesn't depend on the constants
+($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT value_0 FROM TBL_0 WHERE key = '000000'; SELECT value_0 FROM TBL_0 WHERE key = '000001';", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+ok($cmdret == 0, "Run queries with different constants");
+($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT calls, planid <> 0, query_plan <> '' FROM pg_stat_monitor WHERE query LIKE 'SELECT value_0 FROM TBL_0%';", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+is(trim($stdout), '2|t|t', "Single planid with its plan text");
+
+# Test: a backend that already stored a plan stores it again after a reset
+($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT value_0 FROM TBL_0 WHERE key = '000000'; SELECT pg_stat_monitor_reset(); SELECT value_0 FROM TBL_0 WHERE key = '000001';", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+ok($cmdret == 0, "Run queries around a reset");
+($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT calls, planid <> 0, query_plan <> '' FROM pg_stat_monitor WHERE query LIKE 'SELECT value_0 FROM TBL_0%';", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+is(trim($stdout), '1|t|t', "Plan text stored again after a reset");
+
 $node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_enable_query_plan = 'no'\n");
 $node->restart();
 
@@ -31,11 +31,11 @@ my %pg_versions_pgsm_columns = ( 17 => "application_name,".
    "local_blk_read_time,local_blk_write_time,local_blks_dirtied,local_blks_hit,".
    "local_blks_read,local_blks_written,max_exec_time,max_plan_time,mean_exec_time," .
    "mean_plan_time,message,min_exec_time,min_plan_time,minmax_stats_since," .
-   "pgsm_query_id,planid,plans,query,query_plan,queryid,relations,resp_calls,rows," .
+   "overflow,pgsm_query_id,planid,plans,query,query_plan,queryid,relations,resp_calls,rows,sample_rate," .
    "shared_blk_read_time,shared_blk_write_time,shared_blks_dirtied," .
    "shared_blks_hit,shared_blks_read,shared_blks_written,sqlcode,stats_since," .
    "stddev_exec_time,stddev_plan_time,temp_blk_read_time,temp_blk_write_time," .
-   "temp_blks_read,temp_blks_written,top_query,top_queryid,toplevel," .
+   "temp_blks_read,temp_blks_written,top_query,top_queryid,topk_error,toplevel," .
    "total_exec_time,total_plan_time,userid,username,wal_bytes,wal_fpi,wal_records",
 16 => "application_name,blk_read_time," .
     "blk_write_time,bucket,bucket_done,bucket_start_time,calls," .
@@ -45,12 +45,12 @@ my %pg_versions_pgsm_columns = ( 17 => "application_name,".
     "jit_optimization_count,jit_optimization_time," .
     "local_blks_dirtied,local_blks_hit,local_blks_read," .
     "local_blks_written,max_exec_time,max_plan_time,mean_exec_time," .
-    "mean_plan_time,message,min_exec_time,min_plan_time,pgsm_query_id,planid," .
+    "mean_plan_time,message,min_exec_time,min_plan_time,overflow,pgsm_query_id,planid," .
     "plans,query,query_plan,queryid,relations,resp_calls," .
-    "rows,shared_blks_dirtied,shared_blks_hit,shared_blks_read," .
+    "rows,sample_rate,shared_blks_dirtied,shared_blks_hit,shared_blks_read," .
     "shared_blks_written,sqlcode,stddev_exec_time,stddev_plan_time," .
     "temp_blk_read_time,temp_blk_write_time,temp_blks_read,temp_blks_written," .
-    "top_query,top_queryid,toplevel,total_exec_time,total_plan_time," .
+    "top_query,top_queryid,topk_error,toplevel,total_exec_time,total_plan_time," .
     "userid,username,wal_bytes,wal_fpi,wal_records",
 15 => "application_name,blk_read_time," .
     "blk_write_time,bucket,bucket_done,bucket_start_time,calls," .
@@ -60,43 +60,43 @@ my %pg_versions_pgsm_columns = ( 17 => "application_name,".
     "jit_optimization_count,jit_optimization_time," .
     "local_blks_dirtied,local_blks_hit,local_blks_read," .
     "local_blks_written,max_exec_time,max_plan_time,mean_exec_time," .
-    "mean_plan_time,message,min_exec_time,min_plan_time,pgsm_query_id,planid," .
+    "mean_plan_time,message,min_exec_time,min_plan_time,overflow,pgsm_query_id,planid," .
     "plans,query,query_plan,queryid,relations,resp_calls," .
-    "rows,shared_blks_dirtied,shared_blks_hit,shared_blks_read," .
+    "rows,sample_rate,shared_blks_dirtied,shared_blks_hit,shared_blks_read," .
     "shared_blks_written,sqlcode,stddev_exec_time,stddev_plan_time," .
     "temp_blk_read_time,temp_blk_write_time,temp_blks_read,temp_blks_written," .
-    "top_query,top_queryid,toplevel,total_exec_time,total_plan_time," .
+    "top_query,top_queryid,topk_error,toplevel,total_exec_time,total_plan_time," .
     "userid,username,wal_bytes,wal_fpi,wal_records",
  14 => "application_name,blk_read_time," .
     "blk_write_time,bucket,bucket_done,bucket_start_time,calls," .
     "client_ip,cmd_type,cmd_type_text,comments,cpu_sys_time,cpu_user_time," .
     "datname,dbid,elevel,local_blks_dirtied,local_blks_hit,local_blks_read," .
     "local_blks_written,max_exec_time,max_plan_time,mean_exec_time," .
-    "mean_plan_time,message,min_exec_time,min_plan_time,pgsm_query_id,planid," .
+    "mean_plan_time,message,min_exec_time,min_plan_time,overflow,pgsm_query_id,planid," .
     "plans,query,query_plan,queryid,relations,resp_calls," .
-    "rows,shared_blks_dirtied,shared_blks_hit,shared_blks_read," .
+    "rows,sample_rate,shared_blks_dirtied,shared_blks_hit,shared_blks_read," .
     "shared_blks_written,sqlcode,stddev_exec_time,stddev_plan_time," .
-    "temp_blks_read,temp_blks_written,top_query,top_queryid,toplevel," .
+    "temp_blks_read,temp_blks_written,top_query,top_queryid,topk_error,toplevel," .
     "total_exec_time,total_plan_time,userid,username,wal_bytes,wal_fpi,wal_records",
  13 => "application_name,blk_read_time," .
     "blk_write_time,bucket,bucket_done,bucket_start_time,calls," .
     "client_ip,cmd_type,cmd_type_text,comments,cpu_sys_time,cpu_user_time," .
     "datname,dbid,elevel,local_blks_dirtied,local_blks_hit,local_blks_read," .
     "local_blks_written,max_exec_time,max_plan_time,mean_exec_time," .
-    "mean_plan_time,message,min_exec_time,min_plan_time,pgsm_query_id,planid," .
+    "mean_plan_time,message,min_exec_time,min_plan_time,overflow,pgsm_query_id,planid," .
     "plans,query,query_plan,queryid,relations,resp_calls," .
-    "rows,shared_blks_dirtied,shared_blks_hit,shared_blks_read," .
+    "rows,sample_rate,shared_blks_dirtied,shared_blks_hit,shared_blks_read," .
     "shared_blks_written,sqlcode,stddev_exec_time,stddev_plan_time," .
-    "temp_blks_read,temp_blks_written,top_query,top_queryid,toplevel," .
+    "temp_blks_read,temp_blks_written,top_query,top_queryid,topk_error,toplevel," .
     "total_exec_time,total_plan_time,userid,username,wal_bytes,wal_fpi,wal_records",
  12 => "application_name,blk_read_time,blk_write_time,bucket,bucket_done," .
     "bucket_start_time,calls,client_ip,cmd_type,cmd_type_text,comments," .
     "cpu_sys_time,cpu_user_time,datname,dbid,elevel,local_blks_dirtied," .
     "local_blks_hit,local_blks_read,local_blks_written,max_time,mean_time," .
-    "message,min_time,pgsm_query_id,planid,query,query_plan,queryid,relations,resp_calls," .
-    "rows,shared_blks_dirtied,shared_blks_hit,shared_blks_read," .
+    "message,min_time,overflow,pgsm_query_id,planid,query,query_plan,queryid,relations,resp_calls," .
+    "rows,sample_rate,shared_blks_dirtied,shared_blks_hit,shared_blks_read," .
     "shared_blks_written,sqlcode,stddev_time,temp_blks_read,temp_blks_written," .
-    "top_query,top_queryid,total_time,userid,username"
+    "top_query,top_queryid,topk_error,total_time,userid,username"
  );
 
 # Start server
@@ -0,0 +1,65 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use File::Copy;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+my $pgdata = $node->data_dir;
+
+# Update postgresql.conf to include/load pg_stat_monitor library
+$node->append_conf('postgresql.conf', "shared_preload_libraries = 'pg_stat_monitor'");
+
+# Set bucket duration to 3600 seconds so bucket doesn't change.
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_bucket_time = 3600");
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_normalized_query = yes");
+$node->append_conf('postgresql.conf', "max_connections = 100");
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# Create EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+my $port = $node->port;
+
+my $out = system ("pgbench -i -s 1 -p $port postgres");
+ok($out == 0, "Perform pgbench init");
+
+# Run a fixed number of select-only transactions from several backends at
+# once. They all store into the same entry, so no call may be lost while the
+# backends update it concurrently.
+($cmdret, $stdout, $stderr) = $node->psql('postgres', 'SELECT pg_stat_monitor_reset();', extra_params => ['-a', '-Pformat=aligned','-Ptuples_only=off']);
+ok($cmdret == 0, "Reset PGSM EXTENSION");
+
+$out = system ("pgbench -n -S -t 500 -c 4 -j 4 -p $port postgres");
+ok($out == 0, "Run pgbench with 4 clients");
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT SUM(calls) FROM pg_stat_monitor WHERE query LIKE 'SELECT abalance%';", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+ok($cmdret == 0, "Get calls of 4 clients");
+ok(trim($stdout) eq '2000', "All calls of 4 clients are counted");
+PGSM::append_to_debug_file($stdout);
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+# Stop the server
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
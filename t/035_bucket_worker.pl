@@ -0,0 +1,73 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use File::Copy;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+my $pgdata = $node->data_dir;
+
+# Update postgresql.conf to include/load pg_stat_monitor library
+$node->append_conf('postgresql.conf', "shared_preload_libraries = 'pg_stat_monitor'");
+
+# Set change postgresql.conf for this test case.
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_bucket_time = 2");
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_max_buckets = 10");
+$node->append_conf('postgresql.conf', "log_min_messages = debug1");
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# Create EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres', 'SELECT pg_stat_monitor_reset();', extra_params => ['-a', '-Pformat=aligned','-Ptuples_only=off']);
+ok($cmdret == 0, "Reset PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres', 'SELECT 1 AS num;', extra_params => ['-a', '-Pformat=aligned','-Ptuples_only=off']);
+ok($cmdret == 0, "Run SELECT 1");
+PGSM::append_to_debug_file($stdout);
+
+# No statement runs while the bucket expires. The background worker has to
+# switch to a new bucket on its own.
+sleep(5);
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT bucket_done FROM pg_stat_monitor WHERE query = 'SELECT 1 AS num';", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+ok($cmdret == 0, "Get bucket_done of SELECT 1");
+ok(trim($stdout) eq 't', "Bucket has been rotated without any statement running");
+PGSM::append_to_debug_file($stdout);
+
+# The bucket worker logs the time spent evicting a bucket at DEBUG1.
+my $logged = 0;
+open my $log, '<', $node->logfile or die "could not open server log: $!";
+while (my $line = <$log>)
+{
+    $logged = 1 if $line =~ /pgsm_rotate_bucket: evicted bucket \d+ in [0-9.]+ ms/;
+}
+close $log;
+ok($logged, "Bucket worker logged the rotation time");
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+# Stop the server
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
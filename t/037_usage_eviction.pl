@@ -0,0 +1,89 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use File::Copy;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+my $pgdata = $node->data_dir;
+
+# Update postgresql.conf to include/load pg_stat_monitor library
+$node->append_conf('postgresql.conf', "shared_preload_libraries = 'pg_stat_monitor'");
+
+# Use the smallest shared memory and a single bucket that never rotates, so
+# the hash fills up quickly.
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_bucket_time = 3600");
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_max = 10");
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_max_buckets = 1");
+$node->append_conf('postgresql.conf', "log_min_messages = debug1");
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# Create EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres', 'SELECT pg_stat_monitor_reset();', extra_params => ['-a', '-Pformat=aligned','-Ptuples_only=off']);
+ok($cmdret == 0, "Reset PGSM EXTENSION");
+
+# Run a hot query many times before the hash gets full.
+my $sql = "SET application_name = 'hot';\n";
+$sql .= "SELECT 42 AS hot;\n" foreach (1 .. 200);
+($cmdret, $stdout, $stderr) = $node->psql('postgres', $sql);
+ok($cmdret == 0, "Run hot query");
+
+# Flood the hash with more distinct entries than it can hold. Every
+# application name gives a separate entry.
+$sql = '';
+$sql .= "SET application_name = 'evict_$_';\nSELECT 1 AS num;\n" foreach (1 .. 30000);
+($cmdret, $stdout, $stderr) = $node->psql('postgres', $sql);
+ok($cmdret == 0, "Flood hash with entries");
+
+# A statement run after the flood must still be captured.
+($cmdret, $stdout, $stderr) = $node->psql('postgres', "SET application_name = 'after';\nSELECT 'after flood' AS marker;");
+ok($cmdret == 0, "Run statement after flood");
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT count(*) FROM pg_stat_monitor WHERE query LIKE '%AS marker%';", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+ok($cmdret == 0 && trim($stdout) == 1, "Statement after flood is captured");
+
+# The hot query has a high usage and survives the eviction.
+($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT calls FROM pg_stat_monitor WHERE query LIKE '%AS hot%';", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+ok($cmdret == 0 && trim($stdout) eq '200', "Hot query survives eviction");
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT count(*) FROM pg_stat_monitor;", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+ok($cmdret == 0, "Count entries");
+PGSM::append_to_debug_file("total entries after flood = " . trim($stdout));
+
+# The server log must show that entries were evicted.
+my $evicted = 0;
+open my $log, '<', $node->logfile or die "could not open server log: $!";
+while (my $line = <$log>)
+{
+    $evicted = 1 if $line =~ /hash_entry_evict: evicted \d+ entries/;
+}
+close $log;
+ok($evicted, "Least used entries were evicted");
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+# Stop the server
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
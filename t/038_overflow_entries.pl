@@ -0,0 +1,99 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use File::Copy;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+my $pgdata = $node->data_dir;
+
+# Update postgresql.conf to include/load pg_stat_monitor library
+$node->append_conf('postgresql.conf', "shared_preload_libraries = 'pg_stat_monitor'");
+
+# Use the smallest shared memory and two buckets, so that the entries of one
+# bucket can fill up the hash for the next one.
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_bucket_time = 30");
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_max = 10");
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_max_buckets = 2");
+$node->append_conf('postgresql.conf', "log_min_messages = debug1");
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# Create EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+# Return the number of bucket rotations logged by the bucket worker.
+sub rotations
+{
+    my $count = 0;
+
+    open my $log, '<', $node->logfile or die "could not open server log: $!";
+    while (my $line = <$log>)
+    {
+        $count++ if $line =~ /pgsm_rotate_bucket: evicted bucket/;
+    }
+    close $log;
+
+    return $count;
+}
+
+# Wait for the bucket worker to switch to the next bucket.
+sub wait_for_rotation
+{
+    my $start = rotations();
+
+    foreach (1 .. 90)
+    {
+        return 1 if rotations() > $start;
+        sleep(1);
+    }
+    return 0;
+}
+
+# Start with a fresh bucket and fill the hash with its entries. Every
+# application name gives a separate entry.
+ok(wait_for_rotation(), "Bucket worker switched to a new bucket");
+
+my $sql = '';
+$sql .= "SET application_name = 'fill_$_';\nSELECT 1 AS num;\n" foreach (1 .. 20000);
+($cmdret, $stdout, $stderr) = $node->psql('postgres', $sql);
+ok($cmdret == 0, "Fill hash with entries");
+
+# In the next bucket there is nothing that could be evicted to make room, so
+# the statements are accounted in the overflow entry.
+ok(wait_for_rotation(), "Bucket worker switched to the next bucket");
+
+$sql = '';
+$sql .= "SELECT $_ AS overflowed;\n" foreach (1 .. 100);
+($cmdret, $stdout, $stderr) = $node->psql('postgres', $sql);
+ok($cmdret == 0, "Run statements in a full hash");
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT query, calls >= 100 AS calls_ok FROM pg_stat_monitor WHERE overflow AND bucket_done = false;", extra_params => ['-a', '-Pformat=aligned','-Ptuples_only=off']);
+ok($cmdret == 0, "Get overflow entry");
+PGSM::append_to_debug_file($stdout);
+like($stdout, qr/<other statements> \| t/, "Statements are folded into the overflow entry");
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+# Stop the server
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
@@ -0,0 +1,77 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use File::Copy;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+my $pgdata = $node->data_dir;
+
+# Update postgresql.conf to include/load pg_stat_monitor library
+$node->append_conf('postgresql.conf', "shared_preload_libraries = 'pg_stat_monitor'");
+
+# Keep only the statements with the most calls. With the smallest shared
+# memory and ten buckets, each bucket holds a few thousand entries.
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_topk = calls");
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_bucket_time = 3600");
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_max = 10");
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_max_buckets = 10");
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# Create EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres', 'SELECT pg_stat_monitor_reset();', extra_params => ['-a', '-Pformat=aligned','-Ptuples_only=off']);
+ok($cmdret == 0, "Reset PGSM EXTENSION");
+
+# Run a heavy hitter before the bucket gets full.
+my $sql = "SET application_name = 'hot';\n";
+$sql .= "SELECT 42 AS hot;\n" foreach (1 .. 500);
+($cmdret, $stdout, $stderr) = $node->psql('postgres', $sql);
+ok($cmdret == 0, "Run heavy hitter");
+
+# Flood the bucket with many more distinct statements than it can keep.
+# Every application name gives a separate entry.
+$sql = '';
+$sql .= "SET application_name = 'topk_$_';\nSELECT 1 AS num;\n" foreach (1 .. 20000);
+($cmdret, $stdout, $stderr) = $node->psql('postgres', $sql);
+ok($cmdret == 0, "Flood bucket with entries");
+
+# The heavy hitter is kept with exact counters.
+($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT calls, topk_error FROM pg_stat_monitor WHERE query LIKE '%AS hot%';", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+ok($cmdret == 0 && trim($stdout) eq '500|0', "Heavy hitter is kept");
+
+# The bucket only keeps its share of the entries, and the ones created after
+# the first eviction report an error bound.
+($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT count(*) FROM pg_stat_monitor WHERE application_name LIKE 'topk_%';", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+ok($cmdret == 0 && trim($stdout) < 20000, "Bucket keeps a bounded number of entries");
+PGSM::append_to_debug_file("entries kept = " . trim($stdout));
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT count(*) > 0 FROM pg_stat_monitor WHERE topk_error > 0;", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+ok($cmdret == 0 && trim($stdout) eq 't', "New entries report an error bound");
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+# Stop the server
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
@@ -0,0 +1,59 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use File::Copy;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+my $pgdata = $node->data_dir;
+
+# Update postgresql.conf to include/load pg_stat_monitor library
+$node->append_conf('postgresql.conf', "shared_preload_libraries = 'pg_stat_monitor'");
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_bucket_time = 3600");
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_query_max_len = 32768");
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# Create EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+# Build a statement of about 16 kB, the size of the statements an ORM sends,
+# with a leading tag comment and string literals that contain comment markers.
+my @columns;
+push @columns, "'value /* $_ */ ' || 'x' AS column_$_" foreach (1 .. 400);
+my $query = "/* app: bench, controller: comments */ SELECT " . join(', ', @columns) . ";\n";
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres', 'SELECT pg_stat_monitor_reset();', extra_params => ['-a', '-Pformat=aligned','-Ptuples_only=off']);
+ok($cmdret == 0, "Reset PGSM EXTENSION");
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres', "SET pg_stat_monitor.pgsm_extract_comments = yes;\n" . $query, extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+ok($cmdret == 0, "Run large statement");
+
+# Only the tag comment is extracted, the markers in the literals are not.
+($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT DISTINCT comments FROM pg_stat_monitor WHERE query LIKE '%column_400%';", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+ok($cmdret == 0 && trim($stdout) eq '/* app: bench, controller: comments */', "Extract comments of large statement");
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+# Stop the server
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
@@ -0,0 +1,98 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use File::Copy;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+my $pgdata = $node->data_dir;
+
+# Update postgresql.conf to include/load pg_stat_monitor library
+$node->append_conf('postgresql.conf', "shared_preload_libraries = 'pg_stat_monitor'");
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_bucket_time = 3600");
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# Create EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+# Cover no outlier buckets, one of them and both, with few and many buckets.
+# Every statement must land in exactly one bucket.
+foreach my $config ([0, 10, 2], [0.5, 11, 10], [1, 100000, 20], [5, 1000, 50],
+                    [1000, 50000000, 3], [0, 50000000, 50])
+{
+    my ($h_min, $h_max, $h_buckets) = @$config;
+
+    $node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_histogram_min = $h_min");
+    $node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_histogram_max = $h_max");
+    $node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_histogram_buckets = $h_buckets");
+    $node->restart();
+
+    ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'SELECT pg_stat_monitor_reset();', extra_params => ['-a', '-Pformat=aligned','-Ptuples_only=off']);
+    ok($cmdret == 0, "Reset PGSM EXTENSION with min = $h_min, max = $h_max, buckets = $h_buckets");
+
+    my $sql = '';
+    $sql .= "SELECT pg_sleep(0.00$_) AS hist;\n" foreach (1 .. 9);
+    ($cmdret, $stdout, $stderr) = $node->psql('postgres', $sql);
+    ok($cmdret == 0, "Run statements");
+
+    ($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT calls, (SELECT sum(c) FROM unnest(resp_calls::int[]) c) FROM pg_stat_monitor WHERE query LIKE '%AS hist%';", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+    ok($cmdret == 0 && trim($stdout) eq '9|9', "Histogram counts all calls");
+
+    # The bucket boundaries as shown by range(), rounded to microseconds. The
+    # max outlier bucket has no end.
+    ($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT get_histogram_timings();", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+    ok($cmdret == 0, "Get histogram timings");
+    my @bounds;
+    while ($stdout =~ /([\d.]+) - ([\d.]+)\}/g)
+    {
+        push @bounds, [$1, $2 eq '...' ? undef : $2];
+    }
+
+    # Every statement must be counted in the bucket its execution time falls
+    # in, allowing for the rounding of the boundaries.
+    foreach my $sleep ('0.0005', '0.001', '0.003', '0.008', '0.02', '0.05')
+    {
+        ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'SELECT pg_stat_monitor_reset();', extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+        ($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT pg_sleep($sleep) AS hist;");
+        ok($cmdret == 0, "Run statement sleeping $sleep s");
+
+        ($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT total_exec_time, array_to_string(resp_calls, ',') FROM pg_stat_monitor WHERE query LIKE 'SELECT pg_sleep%';", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+        my ($time, $resp_calls) = split(/\|/, trim($stdout));
+        my @counts = split(/,/, $resp_calls // '');
+        my ($index) = grep { $counts[$_] == 1 } (0 .. $#counts);
+        my $bucket = defined $index ? $bounds[$index] : undef;
+
+        ok(defined $bucket &&
+           (grep { $_ != 0 } @counts) == 1 &&
+           $time >= $bucket->[0] - 0.001 &&
+           (!defined $bucket->[1] || $time <= $bucket->[1] + 0.001),
+           "Statement of $time ms counted in its bucket with min = $h_min, max = $h_max, buckets = $h_buckets");
+        PGSM::append_to_debug_file("min = $h_min, max = $h_max, buckets = $h_buckets: $time ms in bucket " . ($index // 'none'));
+    }
+}
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+# Stop the server
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
@@ -0,0 +1,75 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use File::Copy;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+my $pgdata = $node->data_dir;
+
+# Update postgresql.conf to include/load pg_stat_monitor library
+$node->append_conf('postgresql.conf', "shared_preload_libraries = 'pg_stat_monitor'");
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_bucket_time = 3600");
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# Create EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+# Run a CPU bound statement with each CPU time source. The time is measured
+# for every statement unless the source is "sampled", which only measures
+# some of them, or "off", which measures none. The resolution is only
+# reported when the CPU time is measured.
+foreach my $source ('getrusage', 'thread_cputime', 'sampled', 'off')
+{
+    ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'SELECT pg_stat_monitor_reset();', extra_params => ['-a', '-Pformat=aligned','-Ptuples_only=off']);
+    ok($cmdret == 0, "Reset PGSM EXTENSION");
+
+    ($cmdret, $stdout, $stderr) = $node->psql('postgres', "SET pg_stat_monitor.pgsm_cpu_time_source = $source; SELECT count(*) AS cpu_bound FROM generate_series(1, 1000000);", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+    ok($cmdret == 0, "Run CPU bound statement with $source");
+
+    ($cmdret, $stdout, $stderr) = $node->psql('postgres', "SET pg_stat_monitor.pgsm_cpu_time_source = $source; SELECT pg_stat_monitor_cpu_time_resolution();", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+    ok($cmdret == 0, "Get resolution of $source");
+    my $resolution = trim($stdout);
+    $resolution = 'none' if $resolution eq '';
+    ok(($source eq 'off') == ($resolution eq 'none'), "Resolution of $source is reported");
+
+    ($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT calls, cpu_user_time + cpu_sys_time > 0 FROM pg_stat_monitor WHERE query LIKE 'SELECT count(*) AS cpu_bound%';", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+    ok($cmdret == 0, "Get CPU time for $source");
+    my ($calls, $measured) = split(/\|/, trim($stdout));
+    ok(defined $calls && $calls == 1, "Statement with $source is counted");
+    if ($source eq 'getrusage' || $source eq 'thread_cputime')
+    {
+        ok($measured eq 't', "CPU time is measured with $source");
+    }
+    elsif ($source eq 'off')
+    {
+        ok($measured eq 'f', "CPU time is not measured with $source");
+    }
+    PGSM::append_to_debug_file("cpu_time_source = $source, resolution = $resolution ms, calls|cpu measured = " . trim($stdout));
+}
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+# Stop the server
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
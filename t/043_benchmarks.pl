@@ -0,0 +1,247 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use File::Copy;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# The benchmarks take long and need a lot of shared memory with large sizes,
+# they only run if PG_TEST_EXTRA contains pgsm_benchmark. Their results depend
+# on the machine running them, so they are written to the debug file only and
+# nothing but the success of each step is checked.
+if (($ENV{PG_TEST_EXTRA} // '') !~ /\bpgsm_benchmark\b/)
+{
+    plan skip_all => 'pgsm_benchmark not enabled in PG_TEST_EXTRA';
+}
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+# Duration in seconds of every pgbench run.
+my $duration = $ENV{PGSM_BENCHMARK_DURATION} // 10;
+
+# Number of entries to read back, and pgsm_max (in MB) large enough to hold
+# the largest of them. Smaller sizes can be given with
+# PGSM_READ_BENCHMARK_SIZES along with a smaller PGSM_READ_BENCHMARK_MAX on
+# machines without that much memory. The number of entries actually created
+# is logged.
+my @sizes = split(' ', $ENV{PGSM_READ_BENCHMARK_SIZES} // '100000 1000000');
+my $pgsm_max = $ENV{PGSM_READ_BENCHMARK_MAX} // 10240;
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+my $pgdata = $node->data_dir;
+
+# Update postgresql.conf to include/load pg_stat_monitor library
+$node->append_conf('postgresql.conf', "shared_preload_libraries = 'pg_stat_monitor'");
+
+# Set bucket duration to 3600 seconds so bucket doesn't change.
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_bucket_time = 3600");
+$node->append_conf('postgresql.conf', "max_connections = 100");
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# Create EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+my $port = $node->port;
+
+my $out = system ("pgbench -i -s 10 -p $port postgres");
+ok($out == 0, "Perform pgbench init");
+
+# Append the given settings to postgresql.conf and restart the server. Later
+# settings override the ones of the previous benchmarks.
+sub configure
+{
+    $node->append_conf('postgresql.conf', $_) foreach (@_);
+    $node->restart();
+}
+
+# Reset the view before a run.
+sub reset_pgsm
+{
+    ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'SELECT pg_stat_monitor_reset();', extra_params => ['-a', '-Pformat=aligned','-Ptuples_only=off']);
+    ok($cmdret == 0, "Reset PGSM EXTENSION");
+}
+
+# Run pgbench with the given options and return the tps it reports.
+sub run_pgbench
+{
+    my ($pgoptions, $args, $name) = @_;
+
+    my $pgbench_out = `PGOPTIONS='$pgoptions' pgbench -n $args -T $duration -p $port postgres 2>&1`;
+    ok($? == 0, "Run pgbench $name");
+
+    my ($tps) = $pgbench_out =~ /tps = ([0-9.]+)/;
+    return defined $tps ? $tps : 0;
+}
+
+# Store scalability.
+#
+# Measure select-only throughput for an increasing number of backends. Every
+# statement goes through pgsm_store(), so the scaling of the tps numbers shows
+# how much the backends contend on the shared hash locks.
+configure("pg_stat_monitor.pgsm_normalized_query = yes");
+
+foreach my $clients (1, 2, 4, 8, 16)
+{
+    reset_pgsm();
+
+    my $tps = run_pgbench('', "-S -c $clients -j $clients", "with $clients clients");
+
+    ($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT SUM(calls) FROM pg_stat_monitor WHERE query LIKE 'SELECT abalance%';", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+    ok($cmdret == 0, "Get calls for $clients clients");
+
+    PGSM::append_to_debug_file("clients = $clients, tps = $tps, calls = " . trim($stdout));
+}
+
+# Comment extraction.
+#
+# Build a statement of about 16 kB, the size of the statements an ORM sends,
+# with a leading tag comment and string literals that contain comment markers,
+# and measure the throughput with comment extraction off and on. Every
+# statement goes through extract_query_comments() when it is on, so the
+# difference between both runs is the cost of scanning the query text.
+configure("pg_stat_monitor.pgsm_normalized_query = no",
+          "pg_stat_monitor.pgsm_query_max_len = 32768");
+
+my @columns;
+push @columns, "'value /* $_ */ ' || 'x' AS column_$_" foreach (1 .. 400);
+my $query = "/* app: bench, controller: comments */ SELECT " . join(', ', @columns) . ";\n";
+
+my $script = $node->basedir . '/comments.sql';
+open my $fh, '>', $script or die "could not write $script: $!";
+print $fh $query;
+close $fh;
+
+foreach my $extract ('no', 'yes')
+{
+    reset_pgsm();
+
+    my $tps = run_pgbench("-c pg_stat_monitor.pgsm_extract_comments=$extract", "-f $script -c 1 -j 1", "with pgsm_extract_comments = $extract");
+
+    PGSM::append_to_debug_file("extract_comments = $extract, tps = $tps");
+}
+
+# CPU time source.
+#
+# Measure select-only throughput for each CPU time source. The difference to
+# the "off" run is the cost of reading the CPU time around every statement.
+foreach my $source ('getrusage', 'thread_cputime', 'sampled', 'off')
+{
+    reset_pgsm();
+
+    my $tps = run_pgbench("-c pg_stat_monitor.pgsm_cpu_time_source=$source", "-S -c 1 -j 1", "with pgsm_cpu_time_source = $source");
+
+    ($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT calls, round((cpu_user_time + cpu_sys_time)::numeric, 3) FROM pg_stat_monitor WHERE query LIKE 'SELECT abalance%';", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+    ok($cmdret == 0, "Get CPU time for $source");
+
+    PGSM::append_to_debug_file("cpu_time_source = $source, tps = $tps, calls|cpu ms = " . trim($stdout));
+}
+
+# Read path.
+#
+# Fill the view with the given number of entries, then read all of it back.
+# The application name is part of the entry key, so every iteration of the
+# loop creates new entries for the statements it runs. The whole read is
+# timed, and the time of the function scan alone is what the partition locks
+# are held for.
+configure("pg_stat_monitor.pgsm_track = 'all'",
+          "pg_stat_monitor.pgsm_max = $pgsm_max");
+
+foreach my $size (@sizes)
+{
+    reset_pgsm();
+
+    for (my $from = 0; $from < $size; $from += 10000)
+    {
+        my $to = $from + 9999;
+        ($cmdret, $stdout, $stderr) = $node->psql('postgres', "DO \$\$ BEGIN FOR i IN $from..$to LOOP PERFORM set_config('application_name', 'read_bench_' || i, false); PERFORM i; END LOOP; END \$\$;", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+        last if $cmdret != 0;
+    }
+    ok($cmdret == 0, "Create $size entries");
+
+    ($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT count(*) FROM pg_stat_monitor;", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+    ok($cmdret == 0, "Count entries for $size");
+    my $entries = trim($stdout);
+
+    ($cmdret, $stdout, $stderr) = $node->psql('postgres', "\\timing on\nSELECT count(*) FROM pg_stat_monitor;", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+    ok($cmdret == 0, "Read all entries for $size");
+    my ($read_ms) = $stdout =~ /Time: ([0-9.]+) ms/;
+    $read_ms = 'n/a' unless defined $read_ms;
+
+    ($cmdret, $stdout, $stderr) = $node->psql('postgres', "EXPLAIN (ANALYZE, COSTS OFF, TIMING ON) SELECT * FROM pg_stat_monitor;", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+    ok($cmdret == 0, "Explain read of $size entries");
+    my ($scan_ms) = $stdout =~ /Function Scan on pg_stat_monitor_internal.*actual time=[0-9.]+\.\.([0-9.]+)/;
+    $scan_ms = 'n/a' unless defined $scan_ms;
+
+    PGSM::append_to_debug_file("size = $size, entries = $entries, read = $read_ms ms, function scan = $scan_ms ms");
+}
+
+# Bucket rotation.
+#
+# Fill the current bucket with an increasing number of entries, and time the
+# next rotation. Every application name gives a separate entry. Evicting the
+# next bucket only visits the entries of that bucket, so the rotation time
+# should not grow with the total number of entries. The bucket worker logs
+# the time spent evicting a bucket at DEBUG1.
+configure("pg_stat_monitor.pgsm_bucket_time = 10",
+          "pg_stat_monitor.pgsm_max_buckets = 10",
+          "log_min_messages = debug1");
+
+# Return the duration of the last bucket eviction logged by the bucket worker.
+sub last_rotation_ms
+{
+    my $ms;
+
+    open my $log, '<', $node->logfile or die "could not open server log: $!";
+    while (my $line = <$log>)
+    {
+        $ms = $1 if $line =~ /pgsm_rotate_bucket: evicted bucket \d+ in ([0-9.]+) ms/;
+    }
+    close $log;
+
+    return $ms;
+}
+
+foreach my $entries (1000, 5000, 20000)
+{
+    reset_pgsm();
+
+    my $sql = '';
+    $sql .= "SET application_name = 'bench_$_';\nSELECT 1 AS num;\n" foreach (1 .. $entries);
+    ($cmdret, $stdout, $stderr) = $node->psql('postgres', $sql);
+    ok($cmdret == 0, "Create entries for $entries application names");
+
+    ($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT count(*) FROM pg_stat_monitor;", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+    ok($cmdret == 0, "Count entries");
+    my $total = trim($stdout);
+
+    # Wait for the bucket worker to rotate to a new bucket.
+    sleep(11);
+
+    my $ms = last_rotation_ms();
+    $ms = 'n/a' unless defined $ms;
+
+    PGSM::append_to_debug_file("total entries = $total, rotation = $ms ms");
+}
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+# Stop the server
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
@@ -0,0 +1,68 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use File::Copy;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+my $pgdata = $node->data_dir;
+
+# Update postgresql.conf to include/load pg_stat_monitor library
+$node->append_conf('postgresql.conf', "shared_preload_libraries = 'pg_stat_monitor'");
+
+# Set change postgresql.conf for this test case.
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_bucket_time = 2");
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_max_buckets = 3");
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_normalized_query = no");
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# Create EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres', 'SELECT pg_stat_monitor_reset();', extra_params => ['-a', '-Pformat=aligned','-Ptuples_only=off']);
+ok($cmdret == 0, "Reset PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+# Without normalization the query text keeps the constants. The same
+# statement with other constants in the next bucket must show its own.
+($cmdret, $stdout, $stderr) = $node->psql('postgres', 'SELECT 1 AS bucket_text;', extra_params => ['-a', '-Pformat=aligned','-Ptuples_only=off']);
+ok($cmdret == 0, "Run statement in the first bucket");
+PGSM::append_to_debug_file($stdout);
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres', 'SELECT pg_sleep(3);', extra_params => ['-a', '-Pformat=aligned','-Ptuples_only=off']);
+ok($cmdret == 0, "Wait for the next bucket");
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres', 'SELECT 2 AS bucket_text;', extra_params => ['-a', '-Pformat=aligned','-Ptuples_only=off']);
+ok($cmdret == 0, "Run statement in the second bucket");
+PGSM::append_to_debug_file($stdout);
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres', "SELECT count(DISTINCT bucket), string_agg(substr(query, 1, 8), ',' ORDER BY bucket_start_time) FROM pg_stat_monitor WHERE query LIKE 'SELECT _ AS bucket_text%';", extra_params => ['-Pformat=unaligned','-Ptuples_only=on']);
+ok($cmdret == 0, "Get query texts of both buckets");
+PGSM::append_to_debug_file($stdout);
+is(trim($stdout), '2|SELECT 1,SELECT 2', "Each bucket shows its own constants");
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_stat_monitor;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+# Stop the server
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();